@@ -18,18 +18,50 @@
 #include "bitmaps.h"
 #include "../../../common/serialprotocol.h"
 
+#ifdef __AVR__
+#include <avr/sleep.h>
+#endif
+
 // Declaration for an SSD1306 display connected to I2C (SDA, SCL pins)
 #define MA_SCREEN_WIDTH         128     // OLED display width, in pixels
 #define MA_SCREEN_HEIGHT        64      // OLED display height, in pixels
 #define CH_SCREEN_WIDTH         128     // OLED display width, in pixels
 #define CH_SCREEN_HEIGHT        32      // OLED display height, in pixels
-Adafruit_SSD1306 mdisplay(MA_SCREEN_WIDTH, MA_SCREEN_HEIGHT, &Wire, -1, 600000, 400000);
-Adafruit_SSD1306 display(CH_SCREEN_WIDTH, CH_SCREEN_HEIGHT, &Wire, -1, 600000, 400000);
+#define MA_SCREEN_ADDRESS       0x3d    // OLED I2C address, 128x64
+#define CH_SCREEN_ADDRESS       0x3c    // OLED I2C address, 128x32
+#define I2C_CLOCK_DISPLAY       600000  // I2C clock while the library pushes to a display
+#define I2C_CLOCK_IDLE          400000  // I2C clock it restores afterwards
+Adafruit_SSD1306 mdisplay(MA_SCREEN_WIDTH, MA_SCREEN_HEIGHT, &Wire, -1, I2C_CLOCK_DISPLAY, I2C_CLOCK_IDLE);
+Adafruit_SSD1306 display(CH_SCREEN_WIDTH, CH_SCREEN_HEIGHT, &Wire, -1, I2C_CLOCK_DISPLAY, I2C_CLOCK_IDLE);
 
 #define MINVOLVAL               0
 #define MAXVOLVAL               100
+#define VOLPCT(_pct)            ((uint16_t)(_pct) * (VOL_FINE_MAX / 100))   // Percent to volVal units
 #define MAX_TEXT_LEN            80
 #define MAX_TEXT_ONSCREEN       21
+#define ICON_BYTES              (SPEAKERICON_WIDTH * SPEAKERICON_HEIGHT / 8)    // drawAppIcon reads this much
+static_assert(ICON_BYTES == MASTER_ICON_BYTES, "msgMinLength lets a shorter icon through");
+
+// The peak meter strip lives below the volume bar, inside display page 3
+// (rows 24-31), so a meter update only has to push that page segment.
+#define METER_PAGE              3
+#define METER_X                 4
+#define METER_Y                 29
+#define METER_HEIGHT            2
+#define METER_WIDTH             96
+#define METER_AREA_WIDTH        104     // Columns pushed on a meter update
+
+// The fastest link rate the serial RX buffer keeps up with. platformio.ini
+// raises the buffer to 256 bytes, the Arduino IDE keeps the core's 64.
+#if SERIAL_RX_BUFFER_SIZE >= 256
+#define LINK_MAX_BAUD           500000
+#else
+#define LINK_MAX_BAUD           115200
+#endif
+
+// How long the serial RX buffer takes to fill at LINK_MAX_BAUD, 10 bits a
+// byte. Just over 5 ms with either buffer.
+#define RX_BUFFER_MS            ((uint16_t)(SERIAL_RX_BUFFER_SIZE * 10000UL / LINK_MAX_BAUD))
 
 enum BUS_NUMBER
 {
@@ -63,9 +95,12 @@ const int irqPins[] =
     6, //CHANNEL_3
 };
 
-#define BUSY_WAIT_1MS   16L
-#define BUSY_WAIT_1S    (BUSY_WAIT_1MS * 1000L)
-#define SLEEP_TIMEOUT   (BUSY_WAIT_1S * 5L)
+#define RX_QUIET_MS         10      // Display pushes wait until the link has been quiet this long
+#define SCROLL_PERIOD_MS    100     // Label scroll step
+#define SLEEP_TIMEOUT_MS    5000L   // Displays off this long after the last redraw
+
+//Reported in MSGTYPE_CAPS
+const char buildId[] = __DATE__ " " __TIME__;
 
 //Set up the serial protocol functions
 #define serialSendBuffer(_dPtr, _dCount)	Serial.write(_dPtr, _dCount)
@@ -81,8 +116,15 @@ typedef struct
 
     uint8_t update;
     uint8_t scrolling;
-    uint8_t volVal;
+    uint16_t volVal;        //0..VOL_FINE_MAX
     uint8_t muteStatus;
+    uint8_t meter;
+    uint8_t meterUpdate;
+    uint8_t txSeq;          //Sequence number of the update waiting for an ACK, 0 if none
+    uint8_t txRetries;
+    uint32_t txTimer;
+    uint32_t knobTimer;     //millis() of the last local change, see LINK_ECHO_WINDOW_MS
+    uint32_t encTimer;      //millis() of the previous encoder step, for the acceleration
     char name[MAX_TEXT_LEN + 1];
     char scrname[MAX_TEXT_ONSCREEN + 1];
     unsigned char curCh;
@@ -96,29 +138,148 @@ typedef union
     uint32_t lval;
 }conv_t;
 
+//Encoder acceleration, a detent this soon after the previous one moves the
+//volume this many steps. Slow turns move 0.1 %, a fast sweep covers the full
+//range in about 20 detents.
+typedef struct
+{
+    uint16_t ms;
+    uint8_t step;
+}encAccel_t;
+
+const encAccel_t encAccel[] =
+{
+    { 20, 50 },
+    { 40, 20 },
+    { 80, 10 },
+    { 160, 5 },
+};
+
 volume_t chData[NUM_CHANNELS]   = { 0 };
 unsigned int ledval = 0;
 
+//Serial link speed, see MSGTYPE_SET_BAUD
+uint32_t linkBaud = LINK_DEFAULT_BAUD;
+uint32_t prevBaud = LINK_DEFAULT_BAUD;
+uint8_t baudPending = 0;
+uint32_t baudTimer = 0;
+
+//Frame sequencing, see serial_protocol.md
+uint8_t txSeqNum = 0;
+seqWindow_t rxWindow = { 0 };
+
+//Nothing to show after a reset until the PC has sent a snapshot, see MSGTYPE_STATE_LOST
+uint8_t stateKnown = 0;
+uint32_t stateTimer = 0;
+
+//Protocol version from the PC's HELLO, MSGTYPE_SET_VOL_FINE is sent from 3 on
+uint8_t hostProto = 0;
+
+//Loop profiler, reported and cleared by MSGTYPE_TELEMETRY
+enum PROFILE_STAGE
+{
+    PROF_DECODE = 0,
+    PROF_READVOLS,
+    PROF_DRAWSCREEN,
+    PROF_SCROLLS,
+    PROF_POLLENCS,
+    PROF_STAGES
+};
+
+uint16_t profHist[PROF_STAGES][TELEMETRY_BUCKETS] = { 0 };
+uint32_t profMax[PROF_STAGES] = { 0 };
+uint32_t profLoops = 0;
+uint32_t i2cBytes = 0;
+uint16_t rxOverruns = 0;
+
+//Cooperative scheduler, loop() runs every task that is due. A task that
+//starts more than deadlineMs after it was due counts a miss.
+typedef struct
+{
+    void (*run)(void);
+    uint16_t periodMs;      //Time between runs, 0 runs it on every pass
+    uint16_t deadlineMs;
+    uint32_t due;           //millis() of the next run
+    uint16_t misses;
+}task_t;
+
+enum TASK_ID
+{
+    TASK_LINK = 0,
+    TASK_DECODE,
+    TASK_ENCODERS,
+    TASK_REDRAW,
+    TASK_SCROLL,
+    TASK_METERS,
+    TASK_SCREENSAVER,
+    NUM_TASKS
+};
+
+uint32_t idleUs = 0;        //Time spent in idle sleep, reported by MSGTYPE_TELEMETRY
+uint32_t rxTimer = 0;       //millis() of the last pass that found the link busy
+uint32_t drawTimer = 0;     //millis() of the last redraw
+uint8_t asleep = 0;         //The displays are off
+
 void getCmds(uint8_t *, uint16_t);
 void readVols(void);
 int drawScreen(void);
 void updateScrolls(void);
 void drawText(volume_t *, int);
 void drawBar(volume_t *);
+void drawMeter(volume_t *);
+void updateMeters(void);
+void pushMeterPage(int8_t);
 void drawVolIcon(volume_t *);
 void drawAppIcon(volume_t *);
-void decodeProtocol(void);
+int decodeProtocol(void);
+void rxFrame(int);
 void selectBus(int8_t);
 void screenSaver(void);
 void pollEncs(void);
 void trimLabel(char *, uint8_t);
 void sendChannelUpdate(int8_t);
-void encoderSetup(int8_t, uint8_t);
+void encoderSetup(int8_t, uint16_t);
 void encoderRead(int8_t, volume_t *);
-void encoderSet(int8_t ch, uint8_t);
+void encoderSet(int8_t ch, uint16_t);
 void sleepDisplay(Adafruit_SSD1306*);
 void wakeDisplay(Adafruit_SSD1306*);
 void initChannel(Adafruit_SSD1306 *, int);
+void setBaud(uint32_t);
+void linkService(void);
+void sendBaud(void);
+int baudSupported(uint32_t);
+void protocolTxFrame(uint8_t, void *, int);
+int linkRxFrame(uint8_t);
+void sendAck(msgtype_t, uint8_t);
+void sendCaps(void);
+void sendStateLost(void);
+int hostEcho(int8_t, uint16_t, uint8_t);
+void setVolume(int8_t, uint16_t, uint8_t);
+void profileAdd(uint8_t, uint32_t);
+void sendTelemetry(void);
+uint16_t freeRam(void);
+void pushDisplay(Adafruit_SSD1306 *);
+int linkQuiet(void);
+void idleSleep(void);
+void encoderWake(void);
+void taskLink(void);
+void taskDecode(void);
+void taskEncoders(void);
+void taskRedraw(void);
+void taskScroll(void);
+void taskMeters(void);
+void taskScreenSaver(void);
+
+task_t tasks[NUM_TASKS] =
+{
+    { taskLink,         0,                  50 },
+    { taskDecode,       0,                  RX_BUFFER_MS }, //Before the RX buffer fills at the fastest link rate
+    { taskEncoders,     0,                  20 },
+    { taskRedraw,       0,                  50 },
+    { taskScroll,       SCROLL_PERIOD_MS,   50 },
+    { taskMeters,       0,                  33 },  //A meter frame arrives every ~33 ms
+    { taskScreenSaver,  100,                500 },
+};
 
 /*
 **------------------------------------------------------------------------------
@@ -133,7 +294,7 @@ void setup()
 
     pinMode(13, OUTPUT);
 
-    Serial.begin(19200);
+    Serial.begin(LINK_DEFAULT_BAUD);
 
     Wire.begin();
 
@@ -141,7 +302,7 @@ void setup()
     {
         selectBus(i);
         // SSD1306_SWITCHCAPVCC = generate display voltage from 3.3V internally
-        if (!display.begin(SSD1306_SWITCHCAPVCC, 0x3c))  // Address 0x3D for 128x64, 0x3c for 128x32
+        if (!display.begin(SSD1306_SWITCHCAPVCC, CH_SCREEN_ADDRESS))
         {
             for (;;)
             Serial.println(F("Channel display allocation failed")); // Don't proceed, loop forever
@@ -152,12 +313,21 @@ void setup()
     //Set up the master display
     i = CHANNEL_MASTER;
     selectBus(i);
-    if (!mdisplay.begin(SSD1306_SWITCHCAPVCC, 0x3d))  // Address 0x3D for 128x64, 0x3c for 128x32
+    if (!mdisplay.begin(SSD1306_SWITCHCAPVCC, MA_SCREEN_ADDRESS))
     {
         for (;;)
         Serial.println(F("Master display allocation failed")); // Don't proceed, loop forever
     }
     initChannel(&mdisplay, i);
+
+    //Ask the PC for everything, in case it was running before this reset
+    sendStateLost();
+
+    drawTimer = millis();
+    for(i = 0 ; i < NUM_TASKS ; i++)
+    {
+        tasks[i].due = drawTimer;
+    }
 }
 
 
@@ -165,52 +335,237 @@ void setup()
 **------------------------------------------------------------------------------
 ** loop:
 **
-** The standard main loop
+** The standard main loop, runs the tasks that are due
 **------------------------------------------------------------------------------
 */
 void loop()
 {
-    static int loops = 0;
-    static uint32_t idletimer = SLEEP_TIMEOUT;
+    uint32_t now;
+    uint8_t i;
 
-    decodeProtocol();
+    profLoops++;
 
-    readVols();
+    for(i = 0 ; i < NUM_TASKS ; i++)
+    {
+        now = millis();
+        if((int32_t)(now - tasks[i].due) < 0)
+        {
+            continue;
+        }
 
-    //Avoid display updates while receiving data
-    if(!Serial.available())
+        if((now - tasks[i].due > tasks[i].deadlineMs) && (tasks[i].misses < 0xFFFF))
+        {
+            tasks[i].misses++;
+        }
+
+        //Keep the cadence, unless it is more than a period behind
+        tasks[i].due += tasks[i].periodMs;
+        if(!tasks[i].periodMs || ((int32_t)(now - tasks[i].due) >= 0))
+        {
+            tasks[i].due = now + tasks[i].periodMs;
+        }
+
+        tasks[i].run();
+    }
+
+    digitalWrite(13, 0);
+
+    idleSleep();
+}
+
+/*
+**------------------------------------------------------------------------------
+** idleSleep:
+**
+** Sleeps until the next interrupt when nothing is waiting. Idle mode keeps
+** Timer0 running, so the millis() tick wakes the MCU at least every ~1 ms and
+** the scheduler stays on time. USART RX wakes it at once, as do the encoders
+** on pins with an external interrupt. Pins 4-6 have none on the Mega, those
+** encoders are seen on the next tick.
+**------------------------------------------------------------------------------
+*/
+void idleSleep(void)
+{
+#ifdef __AVR__
+    uint32_t t;
+    uint8_t i;
+
+    for(i = CHANNEL_MASTER ; i < NUM_CHANNELS ; i++)
     {
-        if(loops-- <= 0)
+        if(!digitalRead(chData[i].encPin))
         {
-            loops = 1;
-            if(drawScreen())
-            {
-                idletimer = SLEEP_TIMEOUT;
-            }
-            else if(idletimer && !(idletimer % (BUSY_WAIT_1MS * 100)))
-            {
-                updateScrolls();
-            }
+            //An encoder is waiting to be read
+            return;
         }
     }
-    else
+
+    t = micros();
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    cli();
+    if(!Serial.available())
+    {
+        //sei() lets the next instruction run first, a byte arriving now
+        //still wakes the sleep instead of waiting for the tick
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+    sei();
+    idleUs += micros() - t;
+#endif
+}
+
+/*
+**------------------------------------------------------------------------------
+** encoderWake:
+**
+** Encoder interrupt, only there to end the idle sleep. pollEncs reads the pin.
+**------------------------------------------------------------------------------
+*/
+void encoderWake(void)
+{
+}
+
+/*
+**------------------------------------------------------------------------------
+** linkQuiet:
+**
+** Checks if the link has been quiet for RX_QUIET_MS. The meters keep a steady
+** stream of frames going, so display pushes only hold off for a short gap.
+**------------------------------------------------------------------------------
+*/
+int linkQuiet(void)
+{
+    return (millis() - rxTimer >= RX_QUIET_MS);
+}
+
+/*
+**------------------------------------------------------------------------------
+** taskLink:
+**
+** Resends unACKed updates and keeps the link state
+**------------------------------------------------------------------------------
+*/
+void taskLink(void)
+{
+    linkService();
+}
+
+/*
+**------------------------------------------------------------------------------
+** taskDecode:
+**
+** Decodes and acts on the received frames
+**------------------------------------------------------------------------------
+*/
+void taskDecode(void)
+{
+    uint32_t t = micros();
+
+    if(decodeProtocol())
     {
-        loops = (BUSY_WAIT_1MS * 125);
+        rxTimer = millis();
     }
+    profileAdd(PROF_DECODE, t);
+}
 
-    digitalWrite(13, 0);
+/*
+**------------------------------------------------------------------------------
+** taskEncoders:
+**
+** Reads the encoders that signalled a change and sends the new values
+**------------------------------------------------------------------------------
+*/
+void taskEncoders(void)
+{
+    uint32_t t = micros();
+
+    pollEncs();
+    profileAdd(PROF_POLLENCS, t);
+
+    t = micros();
+    readVols();
+    profileAdd(PROF_READVOLS, t);
+}
+
+/*
+**------------------------------------------------------------------------------
+** taskRedraw:
+**
+** Redraws the channels that changed
+**------------------------------------------------------------------------------
+*/
+void taskRedraw(void)
+{
+    uint32_t t;
 
-    //Clear the displays when not in use
-    if(idletimer)
+    if(!linkQuiet())
     {
-        idletimer--;
+        return;
     }
-    else
+
+    t = micros();
+    if(drawScreen())
     {
-        screenSaver();
+        drawTimer = millis();
+        asleep = 0;
     }
+    profileAdd(PROF_DRAWSCREEN, t);
+}
 
-    pollEncs();
+/*
+**------------------------------------------------------------------------------
+** taskScroll:
+**
+** Steps the labels too long for the displays
+**------------------------------------------------------------------------------
+*/
+void taskScroll(void)
+{
+    uint32_t t;
+
+    if(asleep || !linkQuiet())
+    {
+        return;
+    }
+
+    t = micros();
+    updateScrolls();
+    profileAdd(PROF_SCROLLS, t);
+}
+
+/*
+**------------------------------------------------------------------------------
+** taskMeters:
+**
+** Pushes the peak meters that changed
+**------------------------------------------------------------------------------
+*/
+void taskMeters(void)
+{
+    if(asleep || !linkQuiet())
+    {
+        return;
+    }
+
+    updateMeters();
+}
+
+/*
+**------------------------------------------------------------------------------
+** taskScreenSaver:
+**
+** Clears the displays when not in use
+**------------------------------------------------------------------------------
+*/
+void taskScreenSaver(void)
+{
+    if(!asleep && (millis() - drawTimer >= SLEEP_TIMEOUT_MS))
+    {
+        screenSaver();
+        asleep = 1;
+    }
 }
 
 /*
@@ -232,7 +587,9 @@ void readVols(void)
 
             //Read the encoder
             encoderRead(i, &chData[i]);
+            chData[i].knobTimer = millis();
             //Update channel in the PC
+            chData[i].txRetries = 0;
             sendChannelUpdate(i);
         }
     }
@@ -244,7 +601,9 @@ void readVols(void)
 
         //Read the encoder
         encoderRead(i, &chData[i]);
+        chData[i].knobTimer = millis();
         //Update channel in the PC
+        chData[i].txRetries = 0;
         sendChannelUpdate(i);
     }
 }
@@ -275,13 +634,14 @@ int drawScreen(void)
         drawText(&chData[CHANNEL_MASTER], 0);
 
         drawBar(&chData[CHANNEL_MASTER]);
+        drawMeter(&chData[CHANNEL_MASTER]);
         drawVolIcon(&chData[CHANNEL_MASTER]);
         drawAppIcon(&chData[CHANNEL_MASTER]);
 
         //Update
         selectBus(CHANNEL_MASTER);
         wakeDisplay(chData[CHANNEL_MASTER].display);
-        chData[CHANNEL_MASTER].display->display();
+        pushDisplay(chData[CHANNEL_MASTER].display);
     }
 
     for (i = CHANNEL_0; i < NUM_CHANNELS; i++)
@@ -299,13 +659,14 @@ int drawScreen(void)
             drawText(&chData[i], 0);
 
             drawBar(&chData[i]);
+            drawMeter(&chData[i]);
             drawVolIcon(&chData[i]);
             drawAppIcon(&chData[i]);
 
             //Update
             selectBus(i);
             wakeDisplay(chData[i].display);
-            chData[i].display->display();
+            pushDisplay(chData[i].display);
         }
     }
 
@@ -337,12 +698,13 @@ void updateScrolls(void)
         drawText(&chData[i], 1);
 
         drawBar(&chData[i]);
+        drawMeter(&chData[i]);
         drawVolIcon(&chData[i]);
         drawAppIcon(&chData[i]);
 
         //Update
         selectBus(i);
-        chData[i].display->display();
+        pushDisplay(chData[i].display);
     }
 
     //channel data
@@ -353,12 +715,13 @@ void updateScrolls(void)
             drawText(&chData[i], 1);
 
             drawBar(&chData[i]);
+            drawMeter(&chData[i]);
             drawVolIcon(&chData[i]);
             drawAppIcon(&chData[i]);
 
             //Update
             selectBus(i);
-            chData[i].display->display();
+            pushDisplay(chData[i].display);
         }
     }
 }
@@ -389,7 +752,9 @@ void drawText(volume_t *vP, int scroll)
         strncpy(vP->scrname, vP->name, MAX_TEXT_ONSCREEN);
     }
     vP->display->println(vP->scrname);
-    vP->display->print(vP->volVal, DEC);
+    vP->display->print(vP->volVal / VOLPCT(1), DEC);
+    vP->display->print('.');
+    vP->display->print(vP->volVal % VOLPCT(1), DEC);
     vP->display->println(F(" %"));
 }
 
@@ -403,7 +768,84 @@ void drawText(volume_t *vP, int scroll)
 void drawBar(volume_t *vP)
 {
     vP->display->drawRoundRect(2, 17, 100, 10, 3, WHITE);
-    vP->display->fillRoundRect(4, 19, map(vP->volVal, MINVOLVAL, MAXVOLVAL, 0, 96),6, 2, WHITE);
+    vP->display->fillRoundRect(4, 19, map(vP->volVal, MINVOLVAL, VOL_FINE_MAX, 0, 96),6, 2, WHITE);
+}
+
+/*
+**------------------------------------------------------------------------------
+** drawMeter:
+**
+** Draws the peak meter strip on the screen
+**------------------------------------------------------------------------------
+*/
+void drawMeter(volume_t *vP)
+{
+    vP->display->fillRect(0, METER_Y, METER_AREA_WIDTH, METER_HEIGHT, BLACK);
+    vP->display->fillRect(METER_X, METER_Y, map(vP->meter, MINVOLVAL, MAXVOLVAL, 0, METER_WIDTH), METER_HEIGHT, WHITE);
+    vP->meterUpdate = 0;
+}
+
+/*
+**------------------------------------------------------------------------------
+** updateMeters:
+**
+** Redraws the peak meters that changed, touching only the meter page
+**------------------------------------------------------------------------------
+*/
+void updateMeters(void)
+{
+    int i;
+
+    for(i = CHANNEL_MASTER ; i < NUM_CHANNELS ; i++)
+    {
+        if(chData[i].meterUpdate && chData[i].active)
+        {
+            drawMeter(&chData[i]);
+            pushMeterPage(i);
+        }
+    }
+}
+
+/*
+**------------------------------------------------------------------------------
+** pushMeterPage:
+**
+** Sends the meter part of the frame buffer to the display. Only the meter
+** columns of METER_PAGE are written, ~1/5 of a full 128x32 display().
+**------------------------------------------------------------------------------
+*/
+void pushMeterPage(int8_t ch)
+{
+    Adafruit_SSD1306 *dP = chData[ch].display;
+    uint8_t addr = (ch == CHANNEL_MASTER) ? MA_SCREEN_ADDRESS : CH_SCREEN_ADDRESS;
+    uint8_t *buf = dP->getBuffer() + (METER_PAGE * dP->width());
+    uint8_t i;
+    uint8_t n;
+
+    selectBus(ch);
+
+    dP->ssd1306_command(SSD1306_PAGEADDR);
+    dP->ssd1306_command(METER_PAGE);
+    dP->ssd1306_command(METER_PAGE);
+    dP->ssd1306_command(SSD1306_COLUMNADDR);
+    dP->ssd1306_command(0);
+    dP->ssd1306_command(METER_AREA_WIDTH - 1);
+    i2cBytes += 6 * 2;      //Each command goes with a control byte
+
+    //The library restored the idle clock after each command, the data goes at
+    //the display clock like display() does. The Wire buffer is 32 bytes, one
+    //of them is taken by the control byte.
+    Wire.setClock(I2C_CLOCK_DISPLAY);
+    for(i = 0 ; i < METER_AREA_WIDTH ; i += n)
+    {
+        n = min(METER_AREA_WIDTH - i, BUFFER_LENGTH - 1);
+        Wire.beginTransmission(addr);
+        Wire.write((uint8_t)0x40);
+        Wire.write(&buf[i], n);
+        Wire.endTransmission();
+        i2cBytes += n + 1;
+    }
+    Wire.setClock(I2C_CLOCK_IDLE);
 }
 
 /*
@@ -421,15 +863,15 @@ void drawVolIcon(volume_t *vP)
         return;
     }
 
-    if (vP->volVal >= 90)
+    if (vP->volVal >= VOLPCT(90))
     {
         vP->display->drawBitmap(108, 14, speaker_100, SPEAKERICON_WIDTH, SPEAKERICON_HEIGHT, WHITE);
     }
-    else if (vP->volVal >= 60)
+    else if (vP->volVal >= VOLPCT(60))
     {
         vP->display->drawBitmap(108, 14, speaker_66, SPEAKERICON_WIDTH, SPEAKERICON_HEIGHT, WHITE);
     }
-    else if (vP->volVal >= 30)
+    else if (vP->volVal >= VOLPCT(30))
     {
         vP->display->drawBitmap(108, 14, speaker_33, SPEAKERICON_WIDTH, SPEAKERICON_HEIGHT, WHITE);
     }
@@ -466,70 +908,164 @@ void getCmds(uint8_t *pMsgBuf,  uint16_t dataLen)
     serialProtocol_t *msgPtr = (serialProtocol_t*)pMsgBuf;
     int channel;
 
+    if(dataLen < msgMinLength(msgPtr->msgType))
+    {
+        //Too short, the fields would be stale data from an earlier frame
+        return;
+    }
+
     switch(msgPtr->msgType)
     {
         case MSGTYPE_SET_MASTER_VOL_PREC:
         if( (msgPtr->msg_set_master_vol_prec.volVal >= MINVOLVAL) && (msgPtr->msg_set_master_vol_prec.volVal <= MAXVOLVAL) )
         {
-            channel = CHANNEL_MASTER;
-            chData[channel].volVal = msgPtr->msg_set_master_vol_prec.volVal;
-            chData[channel].muteStatus = msgPtr->msg_set_master_vol_prec.muteStatus;
+            setVolume(CHANNEL_MASTER, VOLPCT(msgPtr->msg_set_master_vol_prec.volVal), msgPtr->msg_set_master_vol_prec.muteStatus);
 
-            chData[channel].update = 1;
-            encoderSet(channel, chData[channel].volVal);
-            chData[channel].active = 1;
+            //The snapshot starts with the master volume
+            stateKnown = 1;
         }
         break;
 
         case MSGTYPE_SET_MASTER_LABEL:
         channel = CHANNEL_MASTER;
         memset(chData[channel].name, 0, sizeof(chData[channel].name));
-        strncpy(chData[channel].name, (char*)msgPtr->msg_set_master_label.str, MAX_TEXT_LEN);
+        strncpy(chData[channel].name, (char*)msgPtr->msg_set_master_label.str, min(dataLen - sizeof(struct msg_set_master_label), (unsigned)MAX_TEXT_LEN));
         chData[channel].update = 1;
         break;
 
         case MSGTYPE_SET_CHANNEL_VOL_PREC:
-        if(msgPtr->msg_set_channel_vol_prec.channel < NUM_CHANNELS)
+        if(msgPtr->msg_set_channel_vol_prec.channel < NUM_CHANNELS - CHANNEL_0)
         {
             channel = msgPtr->msg_set_channel_vol_prec.channel + CHANNEL_0;
             if( (msgPtr->msg_set_channel_vol_prec.volVal >= MINVOLVAL) && (msgPtr->msg_set_channel_vol_prec.volVal <= MAXVOLVAL) )
             {
-                chData[channel].volVal = msgPtr->msg_set_channel_vol_prec.volVal;
-                chData[channel].muteStatus = msgPtr->msg_set_channel_vol_prec.muteStatus;
+                setVolume(channel, VOLPCT(msgPtr->msg_set_channel_vol_prec.volVal), msgPtr->msg_set_channel_vol_prec.muteStatus);
+            }
+        }
+        break;
+
+        case MSGTYPE_SET_VOL_FINE:
+        if(getLe16(msgPtr->msg_set_vol_fine.volVal) <= VOL_FINE_MAX)
+        {
+            if(msgPtr->msg_set_vol_fine.channel == VOL_FINE_MASTER)
+            {
+                setVolume(CHANNEL_MASTER, getLe16(msgPtr->msg_set_vol_fine.volVal), msgPtr->msg_set_vol_fine.muteStatus);
 
-                chData[channel].update = 1;
-                encoderSet(channel, chData[channel].volVal);
-                chData[channel].active = 1;
+                //The snapshot starts with the master volume
+                stateKnown = 1;
+            }
+            else if(msgPtr->msg_set_vol_fine.channel < NUM_CHANNELS - CHANNEL_0)
+            {
+                setVolume(msgPtr->msg_set_vol_fine.channel + CHANNEL_0, getLe16(msgPtr->msg_set_vol_fine.volVal), msgPtr->msg_set_vol_fine.muteStatus);
             }
         }
         break;
 
         case MSGTYPE_SET_CHANNEL_LABEL:
-        if(msgPtr->msg_set_channel_label.channel < NUM_CHANNELS)
+        if(msgPtr->msg_set_channel_label.channel < NUM_CHANNELS - CHANNEL_0)
         {
             channel = msgPtr->msg_set_channel_label.channel + CHANNEL_0;
             memset(chData[channel].name, 0, sizeof(chData[channel].name));
-            strncpy(chData[channel].name, (char*)msgPtr->msg_set_channel_label.str, MAX_TEXT_LEN);
+            strncpy(chData[channel].name, (char*)msgPtr->msg_set_channel_label.str, min(dataLen - sizeof(struct msg_set_channel_label), (unsigned)MAX_TEXT_LEN));
             chData[channel].update = 1;
         }
         break;
 
-        case MSGTYPE_SET_MASTER_ICON:
-        channel = CHANNEL_MASTER;
-        if(chData[channel].iconPtr)
+        case MSGTYPE_SET_METERS:
+        for(channel = 0 ; (channel < msgPtr->msg_set_meters.count) && (channel < NUM_CHANNELS) && (channel < dataLen - (int)sizeof(struct msg_set_meters)) ; channel++)
+        {
+            if(chData[channel].meter != msgPtr->msg_set_meters.level[channel])
+            {
+                chData[channel].meter = msgPtr->msg_set_meters.level[channel];
+                chData[channel].meterUpdate = 1;
+            }
+        }
+        break;
+
+        case MSGTYPE_SET_BAUD:
+        if((getLe32(msgPtr->msg_set_baud.baud) == linkBaud) && baudPending)
+        {
+            //The PC confirms the new rate
+            baudPending = 0;
+            sendBaud();
+        }
+        else
+        {
+            if(baudSupported(getLe32(msgPtr->msg_set_baud.baud)))
+            {
+                //Answer at the current rate, then switch and wait for the confirmation
+                prevBaud = linkBaud;
+                linkBaud = getLe32(msgPtr->msg_set_baud.baud);
+                sendBaud();
+                setBaud(linkBaud);
+                baudPending = 1;
+                baudTimer = millis();
+            }
+            else
+            {
+                //Unsupported, report the rate in use
+                sendBaud();
+            }
+        }
+        break;
+
+        case MSGTYPE_LINK_PROBE:
+        protocolTxData(msgPtr, dataLen);
+        break;
+
+        case MSGTYPE_TELEMETRY:
+        sendTelemetry();
+        break;
+
+        case MSGTYPE_HELLO:
+        hostProto = msgPtr->msg_hello.protoVersion;
+        if((dataLen < sizeof(struct msg_hello)) || !(msgPtr->msg_hello.flags & HELLO_KEEPALIVE))
+        {
+            //A new host session, its sequence numbers start over and it sends the full state
+            rxWindow = { 0 };
+            for(channel = CHANNEL_MASTER ; channel < NUM_CHANNELS ; channel++)
+            {
+                chData[channel].txSeq = 0;
+                chData[channel].txRetries = 0;
+            }
+        }
+        sendCaps();
+        break;
+
+        case MSGTYPE_ACK:
+        for(channel = CHANNEL_MASTER ; channel < NUM_CHANNELS ; channel++)
+        {
+            if(msgPtr->msg_ack.seq && (chData[channel].txSeq == msgPtr->msg_ack.seq))
+            {
+                chData[channel].txSeq = 0;
+            }
+        }
+        break;
+
+        case MSGTYPE_NAK:
+        for(channel = CHANNEL_MASTER ; channel < NUM_CHANNELS ; channel++)
         {
-            free(chData[channel].iconPtr);
-            chData[channel].iconPtr = NULL;
+            if(msgPtr->msg_ack.seq && (chData[channel].txSeq == msgPtr->msg_ack.seq) && (chData[channel].txRetries < LINK_MAX_RETRIES))
+            {
+                chData[channel].txRetries++;
+                sendChannelUpdate(channel);
+            }
         }
+        break;
+
+        case MSGTYPE_SET_MASTER_ICON:
+        //A partial bitmap was dropped by msgMinLength, drawAppIcon reads ICON_BYTES
+        channel = CHANNEL_MASTER;
 
+        //Always the same size, the buffer is kept for the next icon
         if(!chData[channel].iconPtr)
         {
-            chData[channel].iconPtr = (uint8_t*)malloc(dataLen);
+            chData[channel].iconPtr = (uint8_t*)malloc(ICON_BYTES);
         }
 
         if(chData[channel].iconPtr)
         {
-            memcpy(chData[channel].iconPtr, msgPtr->msg_set_master_icon.icon, dataLen);
+            memcpy(chData[channel].iconPtr, msgPtr->msg_set_master_icon.icon, ICON_BYTES);
             chData[channel].update = 1;
         }
         break;
@@ -543,21 +1079,30 @@ void getCmds(uint8_t *pMsgBuf,  uint16_t dataLen)
 **------------------------------------------------------------------------------
 ** ctrlChecksum:
 **
-** Checks the received checksum
+** Checks the received length and CRC
 **------------------------------------------------------------------------------
 */
-bool ctrlChecksum(uint8_t *pMsgBuf)
+bool ctrlChecksum(uint8_t *pMsgBuf, int msgLen)
 {
-    uint16_t len = *(uint16_t*)pMsgBuf;
-    uint16_t check = *(uint16_t*)&pMsgBuf[len + 2];
-    uint16_t sum = 0;
-    unsigned int i;
+    uint16_t len;
+    uint16_t check;
+    uint16_t sum;
+
+    if(msgLen < 5)
+    {
+        return 0;
+    }
 
-    for(i = 0 ; i < len + 2; i++)
+    //Length, sequence number, data and CRC must add up to what was received
+    len = getLe16(pMsgBuf);
+    if(len + 5 != msgLen)
     {
-        sum ^= pMsgBuf[i];
+        return 0;
     }
 
+    check = getLe16(&pMsgBuf[len + 3]);
+    sum = crc16(0xFFFF, pMsgBuf, len + 3);
+
     if(check == sum)
     {
         return 1;
@@ -568,29 +1113,105 @@ bool ctrlChecksum(uint8_t *pMsgBuf)
     }
 }
 
+/*
+**------------------------------------------------------------------------------
+** rxFrame:
+**
+** Handles a complete frame from the decoder, either framing
+**------------------------------------------------------------------------------
+*/
+void rxFrame(int msgLen)
+{
+    static uint8_t checksumErrors = 0;
+
+    if(ctrlChecksum(rxBuffer, msgLen))
+    {
+        checksumErrors = 0;
+        if(linkRxFrame(rxBuffer[2]))
+        {
+            getCmds(rxBuffer+3, getLe16(rxBuffer));
+        }
+    }
+    else if((++checksumErrors >= LINK_MAX_CHECKSUM_ERRORS) && (linkBaud != LINK_DEFAULT_BAUD))
+    {
+        //The link is not holding up, go back to the safe rate
+        checksumErrors = 0;
+        baudPending = 0;
+        linkBaud = LINK_DEFAULT_BAUD;
+        setBaud(linkBaud);
+    }
+}
+
 /*
 **------------------------------------------------------------------------------
 ** decodeProtocol:
 **
-** Receives serial data and decodes it
+** Receives serial data and decodes it. Returns 1 while data is coming in.
+** STX/ETX and COBS frames are both taken, COBS is decoded straight into
+** rxBuffer as it arrives.
 **------------------------------------------------------------------------------
 */
-void decodeProtocol(void)
+int decodeProtocol(void)
 {
     uint8_t ch;
     static int msgLen = 0;
     static msgState_t msgState = MSGSTATE_IDLE;
-    static uint8_t *msgPtr;
+    static uint8_t cobsLeft = 0;    //Bytes left in the COBS block
+    static uint8_t cobsZero = 0;    //The COBS block ends with a zero
 
-    if(Serial.available())
+    if(!Serial.available())
+    {
+        return (msgState != MSGSTATE_IDLE);
+    }
+
+    if(Serial.available() >= SERIAL_RX_BUFFER_SIZE - 1)
+    {
+        //Full, the RX interrupt drops what does not fit
+        rxOverruns++;
+    }
+
+    while(Serial.available())
     {
         ch = (uint8_t)Serial.read();
 
-        if(msgLen >= MAX_RXTX_BUFFER_LENGTH)
+        if(msgState == MSGSTATE_COBS)
         {
-            //Not enough room, stop
-            msgState = MSGSTATE_IDLE;
-            msgLen = 0;
+            //Only the delimiter is special, STX, ETX and DLE are data here
+            if(ch == COBS_DELIM)
+            {
+                if(msgLen || cobsLeft || cobsZero)
+                {
+                    //A block cut short is a broken frame, the zero of the last
+                    //block is the delimiter itself
+                    if(!cobsLeft)
+                    {
+                        rxFrame(msgLen);
+                    }
+                    msgState = MSGSTATE_IDLE;
+                }
+                //Else nothing yet, this was the opening delimiter
+            }
+            else if(msgLen >= MAX_MSG_LENGTH)
+            {
+                //Longer than any valid frame, drop it instead of waiting for the delimiter
+                msgState = MSGSTATE_IDLE;
+            }
+            else if(!cobsLeft)
+            {
+                //Block length, the zero that ended the previous block goes in first
+                if(cobsZero)
+                {
+                    rxBuffer[msgLen++] = 0;
+                }
+                cobsLeft = ch - 1;
+                cobsZero = (ch != 0xFF);
+            }
+            else
+            {
+                rxBuffer[msgLen++] = ch;
+                cobsLeft--;
+            }
+            continue;
         }
 
         switch (ch)
@@ -599,45 +1220,53 @@ void decodeProtocol(void)
             //Message starting
             msgState = MSGSTATE_ACTIVE;
             msgLen = 0;
-            msgPtr = rxBuffer;
             break;
 
             case ETX:
             //Message ending
             if(msgState == MSGSTATE_ACTIVE)
             {
-                if(ctrlChecksum(rxBuffer))
-                {
-                    getCmds(rxBuffer+2, msgLen-2);
-                }
-                msgState = MSGSTATE_IDLE;
+                rxFrame(msgLen);
             }
+            //An ETX right after a DLE is a broken frame, wait for the next STX
+            msgState = MSGSTATE_IDLE;
             break;
 
             case DLE:
-            //Stuff byte
-            if(MSGSTATE_ACTIVE)
-            {
-                msgState = MSGSTATE_DLE;
-            }
+            //Stuff byte, only inside a frame. Two in a row is a broken frame.
+            msgState = (msgState == MSGSTATE_ACTIVE) ? MSGSTATE_DLE : MSGSTATE_IDLE;
             break;
 
             default:
             //Copy data
-            if(msgState == MSGSTATE_DLE)
+            if(msgState == MSGSTATE_IDLE)
             {
-                *msgPtr++ = ch ^ DLE;
-                msgState = MSGSTATE_ACTIVE;
-                msgLen++;
+                if(ch == COBS_DELIM)
+                {
+                    //COBS frame starting
+                    msgState = MSGSTATE_COBS;
+                    msgLen = 0;
+                    cobsLeft = 0;
+                    cobsZero = 0;
+                }
+                //Else line noise between frames
+                break;
             }
-            else if(msgState == MSGSTATE_ACTIVE)
+
+            if(msgLen >= MAX_MSG_LENGTH)
             {
-                *msgPtr++ = ch;
-                msgLen++;
+                //Longer than any valid frame, drop it instead of waiting for the ETX
+                msgState = MSGSTATE_IDLE;
+                break;
             }
+
+            rxBuffer[msgLen++] = (msgState == MSGSTATE_DLE) ? (ch ^ DLE) : ch;
+            msgState = MSGSTATE_ACTIVE;
             break;
         }
     }
+
+    return 1;
 }
 
 /*
@@ -668,6 +1297,7 @@ void selectBus(int8_t ch)
         Wire.beginTransmission(0x70);
         Wire.write(channel2bus[ch]);
         Wire.endTransmission();
+        i2cBytes++;
 
         lastch = ch;
     }
@@ -763,11 +1393,25 @@ void trimLabel(char * label, uint8_t len)
 **------------------------------------------------------------------------------
 ** protocolTxData:
 **
-** Stuffs and checksums the data to be sent
+** Sends data that is not sequenced
 **------------------------------------------------------------------------------
 */
 #ifdef serialSendBuffer
 void protocolTxData(void *dataPtr, int dataLength)
+{
+    protocolTxFrame(0, dataPtr, dataLength);
+}
+#endif
+
+/*
+**------------------------------------------------------------------------------
+** protocolTxFrame:
+**
+** Stuffs and checksums the data to be sent
+**------------------------------------------------------------------------------
+*/
+#ifdef serialSendBuffer
+void protocolTxFrame(uint8_t seq, void *dataPtr, int dataLength)
 {
     int numData = 0;
     int i;
@@ -779,10 +1423,11 @@ void protocolTxData(void *dataPtr, int dataLength)
     //Fill the work buffer
     workBufPtr = msgBuffer;
 
-    //Start the message by adding the length
-    *((uint16_t*)workBufPtr) = dataLength;
-    numData += 2;
-    workBufPtr += 2;	//Jump to the first data byte
+    //Start the message by adding the length and the sequence number
+    putLe16(workBufPtr, dataLength);
+    workBufPtr[2] = seq;
+    numData += 3;
+    workBufPtr += 3;	//Jump to the first data byte
 
     //Copy the data
     memcpy(workBufPtr, dataPtr, dataLength);
@@ -790,16 +1435,21 @@ void protocolTxData(void *dataPtr, int dataLength)
     workBufPtr += dataLength;	//Jump to the checksum
 
     //calculate the checksum
-    checksum = 0;
-    for (i = 0; i < numData; i++)
-    {
-        checksum ^= msgBuffer[i];
-    }
+    checksum = crc16(0xFFFF, msgBuffer, numData);
 
     //Add the checksum
-    *((uint16_t*)workBufPtr) = checksum;
+    putLe16(workBufPtr, checksum);
     numData += 2;
 
+    if(hostProto >= PROTOCOL_COBS)
+    {
+        //COBS, encoded straight into the TX buffer between the delimiters
+        txBuffer[0] = COBS_DELIM;
+        totalData = 1 + cobsEncode(msgBuffer, numData, txBuffer + 1);
+        txBuffer[totalData++] = COBS_DELIM;
+        serialSendBuffer(txBuffer, totalData);
+        return;
+    }
 
     //Start the TX buffer with STX
     txBufPtr = txBuffer;
@@ -835,33 +1485,408 @@ void protocolTxData(void *dataPtr, int dataLength)
 }
 #endif
 
+/*
+**------------------------------------------------------------------------------
+** setBaud:
+**
+** Lets the pending output go out, then switches the serial port speed
+**------------------------------------------------------------------------------
+*/
+void setBaud(uint32_t baud)
+{
+    Serial.flush();
+    Serial.begin(baud);
+}
+
+/*
+**------------------------------------------------------------------------------
+** linkService:
+**
+** Reverts a new baud rate that was not confirmed in time, resends the
+** channel updates that were not ACKed in time and repeats STATE_LOST until
+** the PC has sent the state.
+**------------------------------------------------------------------------------
+*/
+void linkService(void)
+{
+    int i;
+
+    if(baudPending && ((millis() - baudTimer) > LINK_BAUD_CONFIRM_MS))
+    {
+        baudPending = 0;
+        linkBaud = prevBaud;
+        setBaud(linkBaud);
+    }
+
+    if(!stateKnown && ((millis() - stateTimer) >= LINK_STATE_LOST_MS))
+    {
+        sendStateLost();
+    }
+
+    for(i = CHANNEL_MASTER ; i < NUM_CHANNELS ; i++)
+    {
+        if(chData[i].txSeq && ((millis() - chData[i].txTimer) >= LINK_RETX_TIMEOUT_MS))
+        {
+            if(chData[i].txRetries < LINK_MAX_RETRIES)
+            {
+                chData[i].txRetries++;
+                sendChannelUpdate(i);
+            }
+            else
+            {
+                chData[i].txSeq = 0;
+            }
+        }
+    }
+}
+
+/*
+**------------------------------------------------------------------------------
+** linkRxFrame:
+**
+** ACKs a received sequenced frame and NAKs any frames missing before it.
+** Returns 1 if the frame should be acted on, 0 for a duplicate.
+**------------------------------------------------------------------------------
+*/
+int linkRxFrame(uint8_t seq)
+{
+    int missing;
+    int i;
+    uint8_t nak;
+
+    if(!seq)
+    {
+        return 1;
+    }
+
+    sendAck(MSGTYPE_ACK, seq);
+
+    missing = seqAccept(&rxWindow, seq);
+    if(missing < 0)
+    {
+        return 0;
+    }
+
+    //NAK the most recent of the missing frames
+    nak = seq;
+    for(i = 0 ; (i < missing) && (i < LINK_MAX_NAKS) ; i++)
+    {
+        nak = (nak == 1) ? 255 : nak - 1;
+        sendAck(MSGTYPE_NAK, nak);
+    }
+
+    return 1;
+}
+
+/*
+**------------------------------------------------------------------------------
+** sendAck:
+**
+** Sends an ACK or a NAK
+**------------------------------------------------------------------------------
+*/
+void sendAck(msgtype_t msgType, uint8_t seq)
+{
+    uint8_t msg[sizeof(struct msg_ack)];
+
+    msg[0] = msgType;
+    msg[1] = seq;
+
+    protocolTxData(msg, sizeof(msg));
+}
+
+/*
+**------------------------------------------------------------------------------
+** baudSupported:
+**
+** Checks if the requested baud rate is one of LINK_BAUD_RATES, and not above
+** LINK_MAX_BAUD
+**------------------------------------------------------------------------------
+*/
+int baudSupported(uint32_t baud)
+{
+    unsigned int i;
+
+    for(i = 0 ; i < sizeof(LINK_BAUD_RATES) / sizeof(LINK_BAUD_RATES[0]) ; i++)
+    {
+        if((baud == LINK_BAUD_RATES[i]) && (baud <= LINK_MAX_BAUD))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+**------------------------------------------------------------------------------
+** sendBaud:
+**
+** Reports the current baud rate
+**------------------------------------------------------------------------------
+*/
+void sendBaud(void)
+{
+    uint8_t msg[sizeof(struct msg_set_baud)];
+
+    msg[0] = MSGTYPE_SET_BAUD;
+    putLe32(&msg[1], linkBaud);
+
+    protocolTxData(msg, sizeof(msg));
+}
+
+/*
+**------------------------------------------------------------------------------
+** sendCaps:
+**
+** Tells the PC what this receiver can do
+**------------------------------------------------------------------------------
+*/
+void sendCaps(void)
+{
+    const msgtype_t handled[] =
+    {
+        MSGTYPE_SET_MASTER_VOL_PREC,
+        MSGTYPE_SET_MASTER_LABEL,
+        MSGTYPE_SET_CHANNEL_VOL_PREC,
+        MSGTYPE_SET_CHANNEL_LABEL,
+        MSGTYPE_SET_MASTER_ICON,
+        MSGTYPE_SET_METERS,
+        MSGTYPE_SET_BAUD,
+        MSGTYPE_LINK_PROBE,
+        MSGTYPE_ACK,
+        MSGTYPE_NAK,
+        MSGTYPE_HELLO,
+        MSGTYPE_STATE_LOST,
+        MSGTYPE_SET_VOL_FINE,
+        MSGTYPE_TELEMETRY
+    };
+    uint8_t msg[sizeof(struct msg_caps) + sizeof(buildId)] = { 0 };
+    struct msg_caps *capsPtr = (struct msg_caps *)msg;
+    unsigned int i;
+
+    capsPtr->msgType = MSGTYPE_CAPS;
+    capsPtr->protoVersion = PROTOCOL_VERSION;
+    capsPtr->numChannels = NUM_CHANNELS - CHANNEL_0;
+    capsPtr->masterWidth = MA_SCREEN_WIDTH;
+    capsPtr->masterHeight = MA_SCREEN_HEIGHT;
+    capsPtr->channelWidth = CH_SCREEN_WIDTH;
+    capsPtr->channelHeight = CH_SCREEN_HEIGHT;
+    for(i = 0 ; i < sizeof(handled) ; i++)
+    {
+        capsSetMsg(capsPtr->msgTypes, handled[i]);
+    }
+    capsPtr->maxData = MAX_DATA_LENGTH;
+    memcpy(capsPtr->build, buildId, sizeof(buildId));
+
+    protocolTxData(msg, sizeof(msg));
+}
+
+/*
+**------------------------------------------------------------------------------
+** sendStateLost:
+**
+** Asks the PC to resend the full state
+**------------------------------------------------------------------------------
+*/
+void sendStateLost(void)
+{
+    uint8_t msg[sizeof(struct msg_state_lost)];
+
+    msg[0] = MSGTYPE_STATE_LOST;
+    stateTimer = millis();
+
+    protocolTxData(msg, sizeof(msg));
+}
+
+/*
+**------------------------------------------------------------------------------
+** hostEcho:
+**
+** Checks if a volume from the PC is the echo of a local knob change, or already
+** shown. Writing it to the encoder then would only make the knob jump back.
+**------------------------------------------------------------------------------
+*/
+int hostEcho(int8_t ch, uint16_t volVal, uint8_t muteStatus)
+{
+    if(chData[ch].active && (chData[ch].volVal == volVal) && (chData[ch].muteStatus == muteStatus))
+    {
+        return 1;
+    }
+
+    //The knob is ahead of anything the PC sends while it is turned
+    if(chData[ch].knobTimer && (millis() - chData[ch].knobTimer < LINK_ECHO_WINDOW_MS))
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+**------------------------------------------------------------------------------
+** setVolume:
+**
+** Shows a volume, 0..VOL_FINE_MAX, from the PC and moves the knob to it
+**------------------------------------------------------------------------------
+*/
+void setVolume(int8_t ch, uint16_t volVal, uint8_t muteStatus)
+{
+    if(!hostEcho(ch, volVal, muteStatus))
+    {
+        chData[ch].volVal = volVal;
+        chData[ch].muteStatus = muteStatus;
+
+        chData[ch].update = 1;
+        encoderSet(ch, chData[ch].volVal);
+    }
+    chData[ch].active = 1;
+}
+
+/*
+**------------------------------------------------------------------------------
+** profileAdd:
+**
+** Adds the run time of a loop stage, started at micros() start, to the profile
+**------------------------------------------------------------------------------
+*/
+void profileAdd(uint8_t stage, uint32_t start)
+{
+    uint32_t us = micros() - start;
+    uint8_t b = 0;
+
+    while((b < TELEMETRY_BUCKETS - 1) && (us >= (TELEMETRY_BUCKET_US << (2 * b))))
+    {
+        b++;
+    }
+
+    if(profHist[stage][b] < 0xFFFF)
+    {
+        profHist[stage][b]++;
+    }
+
+    if(us > profMax[stage])
+    {
+        profMax[stage] = us;
+    }
+}
+
+/*
+**------------------------------------------------------------------------------
+** sendTelemetry:
+**
+** Sends the loop profile and the bus counters, then clears them
+**------------------------------------------------------------------------------
+*/
+void sendTelemetry(void)
+{
+    uint8_t msg[sizeof(struct msg_telemetry)];
+    struct msg_telemetry *tP = (struct msg_telemetry *)msg;
+    uint8_t s;
+    uint8_t b;
+
+    tP->msgType = MSGTYPE_TELEMETRY;
+    for(s = 0 ; s < PROF_STAGES ; s++)
+    {
+        for(b = 0 ; b < TELEMETRY_BUCKETS ; b++)
+        {
+            putLe16(tP->hist[s][b], profHist[s][b]);
+        }
+        putLe32(tP->maxUs[s], profMax[s]);
+    }
+    putLe32(tP->loops, profLoops);
+    putLe32(tP->i2cBytes, i2cBytes);
+    putLe16(tP->rxOverruns, rxOverruns);
+    putLe16(tP->freeRam, freeRam());
+    putLe32(tP->idleUs, idleUs);
+    idleUs = 0;
+    for(s = 0 ; s < NUM_TASKS ; s++)
+    {
+        putLe16(tP->taskMisses[s], tasks[s].misses);
+        tasks[s].misses = 0;
+    }
+
+    protocolTxData(msg, sizeof(msg));
+
+    memset(profHist, 0, sizeof(profHist));
+    memset(profMax, 0, sizeof(profMax));
+    profLoops = 0;
+    i2cBytes = 0;
+    rxOverruns = 0;
+}
+
+/*
+**------------------------------------------------------------------------------
+** freeRam:
+**
+** Returns the free SRAM between the top of the heap and the stack
+**------------------------------------------------------------------------------
+*/
+uint16_t freeRam(void)
+{
+#ifdef __AVR__
+    extern int __heap_start, *__brkval;
+    int top;
+
+    return (int)&top - (__brkval == 0 ? (int)&__heap_start : (int)__brkval);
+#else
+    return 0;
+#endif
+}
+
+/*
+**------------------------------------------------------------------------------
+** pushDisplay:
+**
+** Sends the whole frame buffer to a display, the bus has to be selected
+**------------------------------------------------------------------------------
+*/
+void pushDisplay(Adafruit_SSD1306 *dP)
+{
+    dP->display();
+    i2cBytes += (uint32_t)dP->width() * dP->height() / 8;
+}
+
 /*
 **------------------------------------------------------------------------------
 ** sendChannelUpdate:
 **
-** Sends a channel volume change update.
+** Sends a channel volume change update. The update is sequenced and resent by
+** linkService until the PC ACKs it. A PC that does not know
+** MSGTYPE_SET_VOL_FINE gets the volume in whole percents.
 **------------------------------------------------------------------------------
 */
 void sendChannelUpdate(int8_t ch)
 {
-    uint8_t msg[3] = {0};
+    uint8_t msg[sizeof(struct msg_set_vol_fine)] = {0};
     uint8_t len = 0;
 
-    if(ch == CHANNEL_MASTER)
+    if(hostProto >= PROTOCOL_VOL_FINE)
+    {
+        msg[len++] = MSGTYPE_SET_VOL_FINE;
+        msg[len++] = (ch == CHANNEL_MASTER) ? VOL_FINE_MASTER : ch - CHANNEL_0;
+        putLe16(&msg[len], chData[ch].volVal);
+        len += 2;
+        msg[len++] = chData[ch].muteStatus;
+    }
+    else if(ch == CHANNEL_MASTER)
     {
         msg[len++] = MSGTYPE_SET_MASTER_VOL_PREC;
-        msg[len++] = chData[CHANNEL_MASTER].volVal;
+        msg[len++] = (chData[CHANNEL_MASTER].volVal + VOLPCT(1) / 2) / VOLPCT(1);
         msg[len++] = chData[CHANNEL_MASTER].muteStatus;
     }
     else
     {
         msg[len++] = MSGTYPE_SET_CHANNEL_VOL_PREC;
         msg[len++] = ch - CHANNEL_0;
-        msg[len++] = chData[ch].volVal;
+        msg[len++] = (chData[ch].volVal + VOLPCT(1) / 2) / VOLPCT(1);
         msg[len++] = chData[ch].muteStatus;
     }
 
-    protocolTxData(msg, len);
+    txSeqNum = seqNext(txSeqNum);
+    chData[ch].txSeq = txSeqNum;
+    chData[ch].txTimer = millis();
+    protocolTxFrame(txSeqNum, msg, len);
 }
 
 /*
@@ -871,7 +1896,7 @@ void sendChannelUpdate(int8_t ch)
 ** Sets up the selected encoder
 **------------------------------------------------------------------------------
 */
-void encoderSetup(int8_t ch, uint8_t volVal)
+void encoderSetup(int8_t ch, uint16_t volVal)
 {
     conv_t tempval;
 
@@ -898,7 +1923,7 @@ void encoderSetup(int8_t ch, uint8_t volVal)
     Wire.write(tempval.bval[1]); //Write the counter value
     Wire.write(tempval.bval[0]); //Write the counter value
 
-    tempval.lval = MAXVOLVAL;
+    tempval.lval = VOL_FINE_MAX;
     Wire.write(tempval.bval[3]); //Write the counter max value
     Wire.write(tempval.bval[2]); //Write the counter max value
     Wire.write(tempval.bval[1]); //Write the counter max value
@@ -916,6 +1941,7 @@ void encoderSetup(int8_t ch, uint8_t volVal)
     Wire.write(1); //Write the increment step value
 
     Wire.endTransmission();
+    i2cBytes += 21;
 
 }
 
@@ -923,13 +1949,18 @@ void encoderSetup(int8_t ch, uint8_t volVal)
 **------------------------------------------------------------------------------
 ** encoderRead:
 **
-** Reads the selected encoder
+** Reads the selected encoder. The counter moves one step per detent, the
+** volume moves by the encAccel step for the time since the previous detent and
+** the counter is set to match.
 **------------------------------------------------------------------------------
 */
 void encoderRead(int8_t ch, volume_t *vP)
 {
     int32_t pos;
     uint8_t irq;
+    uint32_t now;
+    uint8_t step;
+    uint8_t i;
 
     selectBus(ch);
 
@@ -944,6 +1975,7 @@ void encoderRead(int8_t ch, volume_t *vP)
     {
         irq = Wire.read();
     }
+    i2cBytes += 2;
 
     //Value changed
     if(irq & 0x18)
@@ -965,6 +1997,26 @@ void encoderRead(int8_t ch, volume_t *vP)
             pos += Wire.read();
         }
         Wire.endTransmission();
+        i2cBytes += 5;
+
+        now = millis();
+        step = 1;
+        for(i = 0 ; i < sizeof(encAccel) / sizeof(encAccel[0]) ; i++)
+        {
+            if(now - vP->encTimer < encAccel[i].ms)
+            {
+                step = encAccel[i].step;
+                break;
+            }
+        }
+        vP->encTimer = now;
+
+        pos = (int32_t)vP->volVal + (pos - (int32_t)vP->volVal) * step;
+        pos = constrain(pos, MINVOLVAL, (int32_t)VOL_FINE_MAX);
+        if(step > 1)
+        {
+            encoderSet(ch, pos);
+        }
 
         vP->update = 1;
         vP->volVal = pos;
@@ -993,7 +2045,7 @@ void encoderRead(int8_t ch, volume_t *vP)
 ** Sets the current encoder value
 **------------------------------------------------------------------------------
 */
-void encoderSet(int8_t ch, uint8_t val)
+void encoderSet(int8_t ch, uint16_t val)
 {
     conv_t tempval;
 
@@ -1008,6 +2060,7 @@ void encoderSet(int8_t ch, uint8_t val)
     Wire.write(tempval.bval[0]); //Write the counter value
 
     Wire.endTransmission();
+    i2cBytes += 5;
 }
 
 /*
@@ -1050,19 +2103,23 @@ void initChannel(Adafruit_SSD1306 *dP, int ix)
     wakeDisplay(chData[ix].display);
 
     chData[ix].display->clearDisplay();
-    chData[ix].display->display();
+    pushDisplay(chData[ix].display);
 
     chData[ix].display->setTextSize(1);      // Normal 1:1 pixel scale
     chData[ix].display->setTextColor(WHITE); // Draw white text
     chData[ix].display->setCursor(0, 0);     // Start at top-left corner
     chData[ix].display->cp437(true);         // Use full 256 char 'Code Page 437' font
-    chData[ix].display->display();
+    pushDisplay(chData[ix].display);
     chData[ix].iconPtr = NULL;
 
     chData[ix].encPin = irqPins[ix];
     chData[ix].encWriteUpdate = 1;
     encoderSetup(ix, chData[ix].volVal);
     pinMode(irqPins[ix], INPUT_PULLUP);
+    if(digitalPinToInterrupt(irqPins[ix]) != NOT_AN_INTERRUPT)
+    {
+        attachInterrupt(digitalPinToInterrupt(irqPins[ix]), encoderWake, FALLING);
+    }
 
     chData[ix].muteStatus = 0;
     chData[ix].active = 0;
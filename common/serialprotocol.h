@@ -2,29 +2,198 @@
 #ifndef _SERIALPROTOCOL_H_
 #define _SERIALPROTOCOL_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 // --------------------- Serial Protocol start ----------------------
 #define STX				2
 #define ETX				3
 #define DLE				0x10
+#define COBS_DELIM		0x00	//Starts and ends a COBS frame, see PROTOCOL_COBS
 
 typedef enum
 {
     MSGSTATE_IDLE = 0,
     MSGSTATE_ACTIVE,
-    MSGSTATE_DLE
+    MSGSTATE_DLE,
+    MSGSTATE_COBS
 }msgState_t;
 
 const int MAX_MSG_LENGTH = 120;	//Any old number, deemed enough, would do
 const int MAX_RXTX_BUFFER_LENGTH = MAX_MSG_LENGTH * 2 + 4; //Needs to facilitate the start and stop tokens and the worst case stuffing situation
 
+#ifdef ARDUINO
+//The receivers frame buffers, the host keeps its own per receiver
 uint8_t msgBuffer[MAX_MSG_LENGTH] = { 0 };
 uint8_t txBuffer[MAX_RXTX_BUFFER_LENGTH] = { 0 };
 uint8_t rxBuffer[MAX_RXTX_BUFFER_LENGTH] = { 0 };
+#endif
 
 #ifdef serialSendBuffer
 void protocolTxData(void *, int);	//Use this to send a known number of data bytes, set up the send macro to use
 #endif
 
+// ------------------------- Link speed ---------------------------
+const uint32_t LINK_DEFAULT_BAUD = 19200;                               //Both ends start here after a reset
+const uint32_t LINK_BAUD_RATES[] = { 57600, 115200, 250000, 500000 };   //Stepped through in this order
+const int LINK_BAUD_CONFIRM_MS = 500;       //The MCU reverts a new rate that is not confirmed within this time
+const int LINK_MAX_CHECKSUM_ERRORS = 8;     //Consecutive bad frames before falling back to LINK_DEFAULT_BAUD
+const int LINK_PROBE_COUNT = 16;            //Probes sent at each new rate
+const int LINK_PROBE_LENGTH = 32;           //Pattern bytes per probe
+const int LINK_PROBE_MAX_ERRORS = 1;        //Lost or corrupted probes tolerated at a rate
+
+// ---------------------- Frame integrity -------------------------
+const uint8_t PROTOCOL_VERSION = 4;         //2: CRC-16 and sequence numbers, 3: MSGTYPE_SET_VOL_FINE, 4: COBS framing
+const uint8_t PROTOCOL_VOL_FINE = 3;        //From this version on MSGTYPE_SET_VOL_FINE is sent to a peer that has it
+const uint8_t PROTOCOL_COBS = 4;            //From this version on both framings are decoded, COBS is sent to a peer that has it
+const int LINK_RETX_TIMEOUT_MS = 250;       //Resend a sequenced frame that is not ACKed within this time
+const int LINK_MAX_RETRIES = 3;             //Resends before a frame is given up
+const int LINK_MAX_NAKS = 4;                //NAKs sent for one gap in the sequence
+const int LINK_TX_WINDOW = 16;              //Sequenced frames the PC keeps for resending
+const int LINK_STATE_LOST_MS = 1000;        //The MCU repeats STATE_LOST this often until it has state again
+const int LINK_KEEPALIVE_MS = 2000;         //The PC sends HELLO this often while connected
+const int LINK_KEEPALIVE_TIMEOUT_MS = 5000; //No CAPS for this long and the PC reconnects
+const int LINK_ECHO_WINDOW_MS = 300;       //A volume from the other end this soon after a knob change is its echo
+
+//CRC-16/CCITT-FALSE, poly 0x1021, init 0xFFFF. The table lives in flash on the AVR.
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define CRC16_PROGMEM           PROGMEM
+#define crc16TableRead(_ix)     pgm_read_word(&crc16Table[_ix])
+#else
+#define CRC16_PROGMEM
+#define crc16TableRead(_ix)     crc16Table[_ix]
+#endif
+
+const uint16_t crc16Table[256] CRC16_PROGMEM =
+{
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+//Consistent Overhead Byte Stuffing, no zero bytes in the result, at most one
+//byte added per 254. dst needs room for n + n / 254 + 1 bytes. Returns the
+//encoded length.
+inline int cobsEncode(const uint8_t *src, int n, uint8_t *dst)
+{
+    uint8_t *code = dst;
+    uint8_t *out = dst + 1;
+    uint8_t run = 1;
+
+    while (n--)
+    {
+        uint8_t b = *src++;
+
+        if (b)
+        {
+            *out++ = b;
+            run++;
+        }
+        if (!b || (run == 0xFF))
+        {
+            *code = run;
+            code = out++;
+            run = 1;
+        }
+    }
+    *code = run;
+
+    return (int)(out - dst);
+}
+
+inline uint16_t crc16(uint16_t crc, const uint8_t *p, int n)
+{
+    while (n--)
+    {
+        crc = (crc << 8) ^ crc16TableRead((uint8_t)(crc >> 8) ^ *p++);
+    }
+    return crc;
+}
+
+//Sequence numbers run 1..255, 0 marks a frame that is not ACKed
+typedef struct
+{
+    uint8_t last;       //Highest sequence number received
+    uint32_t seen;      //Bit n set: last - n has been received
+}seqWindow_t;
+
+inline uint8_t seqNext(uint8_t seq)
+{
+    return (seq >= 255) ? 1 : seq + 1;
+}
+
+inline int seqDistance(uint8_t from, uint8_t to)
+{
+    int d = (int)to - (int)from;
+    return (d < 0) ? d + 255 : d;
+}
+
+//Returns the number of frames missing just before seq, or -1 for a duplicate
+inline int seqAccept(seqWindow_t *w, uint8_t seq)
+{
+    int d;
+
+    if (!w->last)
+    {
+        w->last = seq;
+        w->seen = 1;
+        return 0;
+    }
+
+    d = seqDistance(w->last, seq);
+    if (d == 0)
+    {
+        return -1;
+    }
+
+    if (d < 128)
+    {
+        //Ahead of the window, slide it
+        w->seen = (d >= 32) ? 1 : ((w->seen << d) | 1);
+        w->last = seq;
+        return d - 1;
+    }
+
+    //Behind, a resend filling a gap or a duplicate
+    d = 255 - d;
+    if ((d >= 32) || (w->seen & ((uint32_t)1 << d)))
+    {
+        return -1;
+    }
+    w->seen |= ((uint32_t)1 << d);
+    return 0;
+}
+
 // ------------------------- Data layer ---------------------------
 typedef uint8_t msgtype_t;
 const msgtype_t MSGTYPE_SET_MASTER_VOL_PREC = 0;
@@ -32,6 +201,31 @@ const msgtype_t MSGTYPE_SET_MASTER_LABEL = 1;
 const msgtype_t MSGTYPE_SET_CHANNEL_VOL_PREC = 2;
 const msgtype_t MSGTYPE_SET_CHANNEL_LABEL = 3;
 const msgtype_t MSGTYPE_SET_MASTER_ICON = 4;
+const msgtype_t MSGTYPE_SET_METERS = 5;
+const msgtype_t MSGTYPE_SET_BAUD = 6;
+const msgtype_t MSGTYPE_LINK_PROBE = 7;
+const msgtype_t MSGTYPE_ACK = 8;
+const msgtype_t MSGTYPE_NAK = 9;
+const msgtype_t MSGTYPE_HELLO = 10;
+const msgtype_t MSGTYPE_CAPS = 11;
+const msgtype_t MSGTYPE_STATE_LOST = 12;
+const msgtype_t MSGTYPE_SET_VOL_FINE = 13;
+const msgtype_t MSGTYPE_TELEMETRY = 14;
+
+const int MAX_DATA_LENGTH = MAX_MSG_LENGTH - 5;    //Length, sequence number and checksum take the rest
+const int MASTER_ICON_BYTES = 16 * 16 / 8;         //MSGTYPE_SET_MASTER_ICON bitmap, 16x16 pixels, one bit each
+
+const int MAX_METER_LEVELS = 16;    //Master + 15 channels, more than any display strip will show
+
+const uint16_t VOL_FINE_MAX = 1000;     //Full scale of MSGTYPE_SET_VOL_FINE, 0.1 % steps
+const uint8_t VOL_FINE_MASTER = 0xFF;   //MSGTYPE_SET_VOL_FINE channel addressing the master
+
+const uint8_t HELLO_KEEPALIVE = 0x01;   //MSGTYPE_HELLO flags, a keepalive within the session, without it a new session starts
+
+const int TELEMETRY_STAGES = 5;         //decodeProtocol, readVols, drawScreen, updateScrolls, pollEncs
+const int TELEMETRY_BUCKETS = 6;        //Run time buckets per stage, each 4 times wider than the previous
+const uint32_t TELEMETRY_BUCKET_US = 64; //Upper bound of the first bucket
+const int TELEMETRY_TASKS = 7;          //link, decode, encoders, redraw, scroll, meters, screensaver
 
 struct msg_set_master_vol_prec
 {
@@ -69,6 +263,79 @@ struct msg_set_master_icon
     uint8_t icon[];
 };
 
+struct msg_set_meters
+{
+    msgtype_t msgType;
+    uint8_t count;
+    uint8_t level[];    //Peak level in %, master first, then channel 0, 1, ...
+};
+
+struct msg_set_baud
+{
+    msgtype_t msgType;
+    uint8_t baud[4];    //Little endian, kept as bytes so both ends agree on the layout
+};
+
+struct msg_link_probe
+{
+    msgtype_t msgType;
+    uint8_t seq;
+    uint8_t pattern[];
+};
+
+struct msg_ack
+{
+    msgtype_t msgType;
+    uint8_t seq;
+};
+
+struct msg_hello
+{
+    msgtype_t msgType;
+    uint8_t protoVersion;
+    uint8_t flags;              //HELLO_*, optional, older hosts do not send it
+};
+
+struct msg_caps
+{
+    msgtype_t msgType;
+    uint8_t protoVersion;
+    uint8_t numChannels;        //Channels besides the master
+    uint8_t masterWidth;        //Display geometry in pixels
+    uint8_t masterHeight;
+    uint8_t channelWidth;
+    uint8_t channelHeight;
+    uint8_t msgTypes[4];        //Bit n set: MSGTYPE n is handled
+    uint8_t maxData;            //Longest data layer accepted
+    char build[];               //Firmware build ID, null terminated
+};
+
+struct msg_state_lost
+{
+    msgtype_t msgType;
+};
+
+struct msg_telemetry
+{
+    msgtype_t msgType;
+    uint8_t hist[TELEMETRY_STAGES][TELEMETRY_BUCKETS][2]; //Runs per stage and run time bucket, little endian
+    uint8_t maxUs[TELEMETRY_STAGES][4]; //Longest run per stage in us, little endian
+    uint8_t loops[4];                   //loop() runs
+    uint8_t i2cBytes[4];                //Bytes written to or read from the I2C bus
+    uint8_t rxOverruns[2];              //Times the serial RX buffer was found full
+    uint8_t freeRam[2];                 //Free SRAM between the heap and the stack
+    uint8_t taskMisses[TELEMETRY_TASKS][2]; //Scheduler deadline misses per task, little endian
+    uint8_t idleUs[4];                  //Time spent in idle sleep, little endian
+};
+
+struct msg_set_vol_fine
+{
+    msgtype_t msgType;
+    uint8_t channel;        //VOL_FINE_MASTER for the master
+    uint8_t volVal[2];      //0..VOL_FINE_MAX, little endian
+    uint8_t muteStatus;
+};
+
 typedef union
 {
     msgtype_t msgType;
@@ -77,13 +344,84 @@ typedef union
     struct msg_set_channel_vol_prec		msg_set_channel_vol_prec;
     struct msg_set_channel_label		msg_set_channel_label;
     struct msg_set_master_icon          msg_set_master_icon;
+    struct msg_set_meters               msg_set_meters;
+    struct msg_set_baud                 msg_set_baud;
+    struct msg_link_probe               msg_link_probe;
+    struct msg_ack                      msg_ack;
+    struct msg_hello                    msg_hello;
+    struct msg_caps                     msg_caps;
+    struct msg_state_lost               msg_state_lost;
+    struct msg_set_vol_fine             msg_set_vol_fine;
+    struct msg_telemetry                msg_telemetry;
 }serialProtocol_t;
 
 void protocolTxData(void *, int);	//Use this to send a known number of data bytes, set up a send macro to use
 
+inline uint16_t getLe16(const uint8_t *p)
+{
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+inline void putLe16(uint8_t *p, uint16_t val)
+{
+    p[0] = (uint8_t)val;
+    p[1] = (uint8_t)(val >> 8);
+}
+
+inline uint32_t getLe32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline void putLe32(uint8_t *p, uint32_t val)
+{
+    p[0] = (uint8_t)val;
+    p[1] = (uint8_t)(val >> 8);
+    p[2] = (uint8_t)(val >> 16);
+    p[3] = (uint8_t)(val >> 24);
+}
+
+//State messages are sequenced and ACKed, everything else is fire and forget
+inline bool msgSequenced(msgtype_t msgType)
+{
+    return (msgType <= MSGTYPE_SET_MASTER_ICON) || (msgType == MSGTYPE_SET_VOL_FINE);
+}
+
+//Shortest data layer a message can have, anything shorter is dropped before
+//the fields are read. Variable length parts are checked by the handlers.
+inline int msgMinLength(msgtype_t msgType)
+{
+    switch (msgType)
+    {
+        case MSGTYPE_SET_MASTER_VOL_PREC:   return sizeof(struct msg_set_master_vol_prec);
+        case MSGTYPE_SET_MASTER_LABEL:      return sizeof(struct msg_set_master_label);
+        case MSGTYPE_SET_CHANNEL_VOL_PREC:  return sizeof(struct msg_set_channel_vol_prec);
+        case MSGTYPE_SET_CHANNEL_LABEL:     return sizeof(struct msg_set_channel_label);
+        case MSGTYPE_SET_MASTER_ICON:       return sizeof(struct msg_set_master_icon) + MASTER_ICON_BYTES;
+        case MSGTYPE_SET_METERS:            return sizeof(struct msg_set_meters);
+        case MSGTYPE_SET_BAUD:              return sizeof(struct msg_set_baud);
+        case MSGTYPE_LINK_PROBE:            return sizeof(struct msg_link_probe);
+        case MSGTYPE_ACK:                   return sizeof(struct msg_ack);
+        case MSGTYPE_NAK:                   return sizeof(struct msg_ack);
+        case MSGTYPE_HELLO:                 return offsetof(struct msg_hello, flags);
+        case MSGTYPE_SET_VOL_FINE:          return sizeof(struct msg_set_vol_fine);
+        default:                            return sizeof(msgtype_t);
+    }
+}
+
+inline void capsSetMsg(uint8_t *msgTypes, msgtype_t msgType)
+{
+    msgTypes[msgType >> 3] |= (1 << (msgType & 7));
+}
+
+inline bool capsHasMsg(const uint8_t *msgTypes, msgtype_t msgType)
+{
+    return (msgType < 32) && (msgTypes[msgType >> 3] & (1 << (msgType & 7)));
+}
+
 serialProtocol_t * allocProtocolBuf(msgtype_t, size_t);
 void freeProtocolBuf(serialProtocol_t *);
-bool ctrlChecksum(uint8_t *);
+bool ctrlChecksum(uint8_t *, int);
 
 // --------------------- Serial Protocol end ----------------------
 
@@ -0,0 +1,30 @@
+/*
+**------------------------------------------------------------------------------
+** check:
+**
+** Minimal test helpers for the host side tests, no framework needed
+**------------------------------------------------------------------------------
+*/
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <stdio.h>
+
+static int checkFailures = 0;
+
+//Records a failed condition and carries on with the rest of the test
+#define CHECK(_cond)                                                                \
+    do                                                                              \
+        {                                                                           \
+        if (!(_cond))                                                               \
+            {                                                                       \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #_cond);        \
+            checkFailures++;                                                        \
+            }                                                                       \
+        } while (0)
+
+//Exit code for main, prints a summary line
+#define CHECK_RESULT(_name)                                                         \
+    (printf("%s: %s\n", _name, checkFailures ? "FAILED" : "ok"), checkFailures ? 1 : 0)
+
+#endif
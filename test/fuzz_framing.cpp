@@ -0,0 +1,77 @@
+/*
+**------------------------------------------------------------------------------
+** fuzz_framing:
+**
+** libFuzzer target for the host frame decoder. Every frame the decoder hands
+** out is copied to a buffer of its own size, so AddressSanitizer catches a
+** check that lets a read past the bytes received through. test_framing runs
+** the same entry point on random input where there is no clang, see the
+** Makefile.
+**------------------------------------------------------------------------------
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "framing.h"
+
+volatile uint8_t fuzzSink;              //Keeps the reads in readFields
+
+/*
+**------------------------------------------------------------------------------
+** readFields:
+**
+** Reads every byte msgFits vouched for, as getCmds would
+**------------------------------------------------------------------------------
+*/
+static uint8_t readFields(const uint8_t *data, int dataLen)
+    {
+    uint8_t sum = 0;
+
+    for (int i = 0; i < msgMinLength(data[0]); i++)
+        {
+        sum += data[i];
+        }
+    return (uint8_t)(sum + dataLen);
+    }
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *input, size_t size)
+    {
+    frameDecoder_t dec;
+
+    decodeReset(&dec);
+    for (size_t i = 0; i < size; i++)
+        {
+        int done = decodeByte(&dec, input[i]);
+
+        //Never more than a frame can hold, whatever the state
+        if ((dec.len < 0) || (dec.len > MAX_MSG_LENGTH))
+            {
+            abort();
+            }
+        if (!done)
+            {
+            continue;
+            }
+
+        //Exactly what was received, nothing of the decoders buffer around it
+        uint8_t *frame = (uint8_t*)malloc(dec.len ? dec.len : 1);
+        memcpy(frame, dec.buffer, dec.len);
+
+        if (ctrlChecksum(frame, dec.len))
+            {
+            int dataLen = getLe16(frame);
+
+            if (dataLen + 5 != dec.len)
+                {
+                abort();
+                }
+            if (msgFits(frame + 3, dataLen))
+                {
+                fuzzSink = readFields(frame + 3, dataLen);
+                }
+            }
+        free(frame);
+        }
+    return 0;
+    }
@@ -0,0 +1,363 @@
+/*
+**------------------------------------------------------------------------------
+** test_endpoints:
+**
+** Tests the endpoint handling against mock backends: several endpoints
+** enumerated at once, device swaps while the knobs are turned, and a swap to
+** a device that is gone. Built with ThreadSanitizer, see the Makefile.
+**------------------------------------------------------------------------------
+*/
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "endpoints.h"
+#include "knobs.h"
+#include "check.h"
+
+using namespace std;
+
+const int KNOBS = 4;                    //Master and three channels
+const int TURNS = 20000;                //Positions posted per knob
+const int SWAPS = 200;                  //Default device changes during the turns
+const int NO_DEVICE = -1;
+const int ENDPOINTS = 4;                //Default output, a second output, a microphone and a headset
+
+struct mixer_s
+    {
+    int id;
+    };
+
+static mixer_t board;
+
+typedef struct
+    {
+    int knob;
+    int pos;
+    int device;                         //Device bound when it was applied
+    }applied_t;
+
+/*
+**------------------------------------------------------------------------------
+** MockBackend:
+**
+** One output endpoint. The devices are numbered, systemDevice is the one the
+** system has as default now, NO_DEVICE if there is none.
+**------------------------------------------------------------------------------
+*/
+class MockBackend : public EndpointBackend
+    {
+    public:
+        atomic<int> systemDevice;
+        int bound = 0;
+        int opened = NO_DEVICE;
+        int enumerated = NO_DEVICE;     //Device whose streams were read last
+        int switches = 0;
+        int unwarmed = 0;               //Binds of a device whose streams were not read
+        vector <applied_t> applied;
+
+        MockBackend(void) : systemDevice(0) {}
+
+        int openEndpoint(int endpoint)
+            {
+            opened = endpoint ? NO_DEVICE : (int)systemDevice;
+            return opened != NO_DEVICE;
+            }
+
+        void enumerateEndpoint(int)
+            {
+            enumerated = (opened != NO_DEVICE) ? opened : bound;
+            }
+
+        void bindEndpoint(int)
+            {
+            unwarmed += (enumerated != opened);
+            bound = opened;
+            opened = NO_DEVICE;
+            switches++;
+            }
+
+        void applyKnobs(void)
+            {
+            vector <knobEvent_t> events;
+
+            takeKnobs(&events);
+            for (size_t e = 0; e < events.size(); e++)
+                {
+                int knob = (events[e].msgType == MSGTYPE_SET_MASTER_VOL_PREC) ? 0 : 1 + events[e].channel;
+
+                applied.push_back({ knob, events[e].volVal, bound });
+                }
+            }
+    };
+
+/*
+**------------------------------------------------------------------------------
+** MultiBackend:
+**
+** Several endpoints. Each enumeration waits until together of them have
+** started, up to a second, so a serial enumeration shows as no overlap.
+**------------------------------------------------------------------------------
+*/
+class MultiBackend : public EndpointBackend
+    {
+    public:
+        atomic<int> inside;             //Enumerations running now
+        atomic<int> started;            //Enumerations started so far
+        atomic<int> overlap;            //Most enumerations seen running at once
+        atomic<int> count[ENDPOINTS];   //Enumerations per endpoint
+        thread::id ran[ENDPOINTS];      //Thread of the last enumeration per endpoint
+        int together = 1;               //Enumerations each one waits for
+        int opened = NO_DEVICE;
+        int bound = 0;
+
+        MultiBackend(void) : inside(0), started(0), overlap(0)
+            {
+            for (int e = 0; e < ENDPOINTS; e++)
+                {
+                count[e] = 0;
+                }
+            }
+
+        int openEndpoint(int endpoint)
+            {
+            opened = endpoint ? NO_DEVICE : bound + 1;
+            return opened != NO_DEVICE;
+            }
+
+        void enumerateEndpoint(int endpoint)
+            {
+            chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::seconds(1);
+            int now;
+
+            inside++;
+            started++;
+            while ((started < together) && (chrono::steady_clock::now() < deadline))
+                {
+                this_thread::yield();
+                }
+
+            now = inside;
+            for (int seen = overlap; (now > seen) && !overlap.compare_exchange_weak(seen, now); )
+                {
+                }
+            ran[endpoint] = this_thread::get_id();
+            count[endpoint]++;
+            inside--;
+            }
+
+        void bindEndpoint(int)
+            {
+            bound = opened;
+            opened = NO_DEVICE;
+            }
+
+        void applyKnobs(void)
+            {
+            }
+    };
+
+/*
+**------------------------------------------------------------------------------
+** post:
+**
+** Posts the position of one knob
+**------------------------------------------------------------------------------
+*/
+static void post(int knob, int pos)
+    {
+    if (!knob)
+        {
+        postKnob(&board, MSGTYPE_SET_MASTER_VOL_PREC, 0, (uint16_t)pos, 0);
+        }
+    else
+        {
+        postKnob(&board, MSGTYPE_SET_CHANNEL_VOL_PREC, (uint8_t)(knob - 1), (uint16_t)pos, 0);
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testSwap:
+**------------------------------------------------------------------------------
+*/
+static void testSwap(void)
+    {
+    MockBackend mock;
+    atomic<int> changed(0);
+
+    //Nothing changed, the knobs are applied and the device stays
+    post(1, 10);
+    waitEndpoints(&mock, 1, &changed);
+    CHECK((mock.applied.size() == 1) && (mock.applied[0].device == 0));
+    CHECK(!mock.switches);
+
+    //A knob turned before the change goes to the old device
+    post(1, 11);
+    mock.systemDevice = 1;
+    wakeKnobs(&changed);
+    post(2, 20);
+    waitEndpoints(&mock, 1, &changed);
+    CHECK(!changed);
+    CHECK((mock.switches == 1) && (mock.bound == 1) && !mock.unwarmed);
+    CHECK((mock.applied.size() == 3) && (mock.applied[1].pos == 11) && (mock.applied[1].device == 0));
+
+    //Nothing to switch to, the bound device stays
+    mock.systemDevice = NO_DEVICE;
+    wakeKnobs(&changed);
+    waitEndpoints(&mock, 1, &changed);
+    CHECK(!changed);
+    CHECK((mock.switches == 1) && (mock.bound == 1));
+
+    //And back
+    mock.systemDevice = 0;
+    wakeKnobs(&changed);
+    CHECK(switchEndpoint(&mock, 0, &changed));
+    CHECK(!changed && (mock.bound == 0) && !mock.unwarmed);
+    CHECK(!switchEndpoint(&mock, 1, &changed));
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testSwapUnderLoad:
+**
+** The knobs are turned on their own threads while another thread keeps
+** changing the default device and the main thread waits as in the main loop.
+** A knob position may go to a device that was default before it was turned,
+** never to one that became default after. Every knob only moves forward and
+** its last position arrives.
+**------------------------------------------------------------------------------
+*/
+static void testSwapUnderLoad(void)
+    {
+    MockBackend mock;
+    atomic<int> changed(0);
+    atomic<int> done(0);
+    vector <thread> posters;
+    thread swapper;
+    vector <vector <int>> defaultAfter(KNOBS, vector <int>(TURNS));
+    int last[KNOBS];
+    int late = 0;
+    int backwards = 0;
+
+    for (int k = 0; k < KNOBS; k++)
+        {
+        last[k] = -1;
+        posters.push_back(thread([k, &mock, &done, &defaultAfter]
+            {
+            for (int pos = 0; pos < TURNS; pos++)
+                {
+                post(k, pos);
+                defaultAfter[k][pos] = mock.systemDevice;
+                }
+            done++;
+            }));
+        }
+
+    swapper = thread([&mock, &changed, &done]
+        {
+        for (int s = 1; s <= SWAPS; s++)
+            {
+            this_thread::sleep_for(chrono::microseconds(100));
+            mock.systemDevice = s;
+            wakeKnobs(&changed);
+            }
+        done++;
+        });
+
+    while (done < KNOBS + 1)
+        {
+        waitEndpoints(&mock, 1, &changed);
+        }
+    for (int k = 0; k < KNOBS; k++)
+        {
+        posters[k].join();
+        }
+    swapper.join();
+    waitEndpoints(&mock, 1, &changed);
+
+    for (size_t a = 0; a < mock.applied.size(); a++)
+        {
+        applied_t *ev = &mock.applied[a];
+
+        late += (ev->device > defaultAfter[ev->knob][ev->pos]);
+        backwards += (ev->pos <= last[ev->knob]);
+        last[ev->knob] = ev->pos;
+        }
+
+    CHECK(!late);
+    CHECK(!backwards);
+    CHECK(!mock.unwarmed);
+    CHECK((mock.switches > 0) && (mock.switches <= SWAPS));
+    CHECK(mock.bound == SWAPS);
+    for (int k = 0; k < KNOBS; k++)
+        {
+        CHECK(last[k] == TURNS - 1);
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testEndpoints:
+**------------------------------------------------------------------------------
+*/
+static void testEndpoints(void)
+    {
+    MultiBackend multi;
+    atomic<int> changed(0);
+
+    //All at once, each on its own thread, all done on return
+    multi.together = ENDPOINTS;
+    enumerateEndpoints(&multi, ENDPOINTS);
+    CHECK(multi.overlap == ENDPOINTS);
+    CHECK(!multi.inside);
+    multi.together = 1;
+    for (int e = 0; e < ENDPOINTS; e++)
+        {
+        CHECK(multi.count[e] == 1);
+        CHECK(multi.ran[e] != this_thread::get_id());
+        for (int f = 0; f < e; f++)
+            {
+            CHECK(multi.ran[e] != multi.ran[f]);
+            }
+        }
+
+    //The default output switches on its own, the others are left alone
+    wakeKnobs(&changed);
+    waitEndpoints(&multi, 1, &changed);
+    CHECK(!changed && (multi.bound == 1));
+    CHECK(multi.count[0] == 2);
+    for (int e = 1; e < ENDPOINTS; e++)
+        {
+        CHECK(multi.count[e] == 1);
+        }
+    CHECK(!switchEndpoint(&multi, 2, &changed));
+    CHECK(multi.count[2] == 1);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testOneEndpoint:
+**------------------------------------------------------------------------------
+*/
+static void testOneEndpoint(void)
+    {
+    MockBackend mock;
+    MultiBackend multi;
+
+    //No worker for a single endpoint
+    enumerateEndpoints(&multi, 1);
+    CHECK((multi.count[0] == 1) && (multi.ran[0] == this_thread::get_id()));
+    enumerateEndpoints(&mock, 1);
+    CHECK(mock.enumerated == 0);
+    }
+
+int main(void)
+    {
+    testEndpoints();
+    testOneEndpoint();
+    testSwap();
+    testSwapUnderLoad();
+
+    return CHECK_RESULT("test_endpoints");
+    }
@@ -0,0 +1,396 @@
+/*
+**------------------------------------------------------------------------------
+** test_framing:
+**
+** Tests the frame decoder of the host, both framings, and the length checks a
+** frame has to pass before its fields are read. Also runs the fuzz target on
+** random input, built with AddressSanitizer, see the Makefile.
+**------------------------------------------------------------------------------
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "framing.h"
+#include "check.h"
+
+using namespace std;
+
+const int RANDOM_INPUTS = 20000;        //Random inputs run through the fuzz target
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+/*
+**------------------------------------------------------------------------------
+** frameBody:
+**
+** Length, sequence number, data and CRC of a frame, before any framing. The
+** length field is the data length plus lenDelta.
+**------------------------------------------------------------------------------
+*/
+static vector <uint8_t> frameBody(const vector <uint8_t> &data, int lenDelta = 0)
+    {
+    vector <uint8_t> body(3 + data.size() + 2);
+
+    putLe16(&body[0], (uint16_t)(data.size() + lenDelta));
+    body[2] = 1;
+    if (!data.empty())
+        {
+        memcpy(&body[3], data.data(), data.size());
+        }
+    putLe16(&body[3 + data.size()], crc16(0xFFFF, body.data(), 3 + (int)data.size()));
+    return body;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** cat:
+**------------------------------------------------------------------------------
+*/
+static vector <uint8_t> cat(vector <uint8_t> a, const vector <uint8_t> &b)
+    {
+    a.insert(a.end(), b.begin(), b.end());
+    return a;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** dleFrame:
+**
+** Frames a body with STX and ETX, STX, ETX and DLE stuffed
+**------------------------------------------------------------------------------
+*/
+static vector <uint8_t> dleFrame(const vector <uint8_t> &body)
+    {
+    vector <uint8_t> wire;
+
+    wire.push_back(STX);
+    for (size_t i = 0; i < body.size(); i++)
+        {
+        if ((body[i] == STX) || (body[i] == ETX) || (body[i] == DLE))
+            {
+            wire.push_back(DLE);
+            wire.push_back(body[i] ^ DLE);
+            }
+        else
+            {
+            wire.push_back(body[i]);
+            }
+        }
+    wire.push_back(ETX);
+    return wire;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** cobsFrame:
+**
+** Frames a body with COBS between two delimiters
+**------------------------------------------------------------------------------
+*/
+static vector <uint8_t> cobsFrame(const vector <uint8_t> &body)
+    {
+    vector <uint8_t> wire(body.size() + body.size() / 254 + 3);
+    int n = cobsEncode(body.data(), (int)body.size(), &wire[1]);
+
+    wire[0] = COBS_DELIM;
+    wire[1 + n] = COBS_DELIM;
+    wire.resize(n + 2);
+    return wire;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** decode:
+**
+** Runs bytes through a decoder. Returns the number of frames it handed out,
+** the last one is left in the decoder.
+**------------------------------------------------------------------------------
+*/
+static int decode(frameDecoder_t *dec, const vector <uint8_t> &wire)
+    {
+    int frames = 0;
+
+    for (size_t i = 0; i < wire.size(); i++)
+        {
+        frames += decodeByte(dec, wire[i]);
+        }
+    return frames;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** decodes:
+**
+** Returns 1 if a fresh decoder hands out exactly one frame for the bytes, the
+** body given, length and CRC not checked
+**------------------------------------------------------------------------------
+*/
+static int decodes(const vector <uint8_t> &wire, const vector <uint8_t> &body)
+    {
+    frameDecoder_t dec;
+
+    decodeReset(&dec);
+    return (decode(&dec, wire) == 1) && (dec.len == (int)body.size()) && !memcmp(dec.buffer, body.data(), body.size());
+    }
+
+/*
+**------------------------------------------------------------------------------
+** dropped:
+**
+** Returns 1 if nothing in the bytes gets through as a good frame, and the
+** decoder still finds the good frames sent after them. The framing that
+** follows a broken frame is unknown, both are tried.
+**------------------------------------------------------------------------------
+*/
+static int dropped(const vector <uint8_t> &wire)
+    {
+    frameDecoder_t dec;
+    vector <uint8_t> body = frameBody({ MSGTYPE_HELLO });
+    vector <uint8_t> input = cat(cat(cat(wire, cobsFrame(body)), cobsFrame(body)), dleFrame(body));
+    int other = 0;
+    int last = 0;
+
+    decodeReset(&dec);
+    for (size_t i = 0; i < input.size(); i++)
+        {
+        if (decodeByte(&dec, input[i]) && ctrlChecksum(dec.buffer, dec.len))
+            {
+            last = (dec.len == (int)body.size()) && !memcmp(dec.buffer, body.data(), body.size());
+            other += !last;
+            }
+        }
+    return !other && last && (dec.state == MSGSTATE_IDLE);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testGood:
+**------------------------------------------------------------------------------
+*/
+static void testGood(void)
+    {
+    vector <uint8_t> reserved = { MSGTYPE_SET_CHANNEL_LABEL, STX, ETX, DLE, 0, DLE, DLE, 0xFF, 0 };
+    vector <uint8_t> body = frameBody(reserved);
+    frameDecoder_t dec;
+
+    //Reserved bytes and zeros go through either framing
+    CHECK(decodes(dleFrame(body), body));
+    CHECK(decodes(cobsFrame(body), body));
+    CHECK(ctrlChecksum(body.data(), (int)body.size()));
+
+    //Back to back, and line noise in between
+    decodeReset(&dec);
+    CHECK(decode(&dec, cat(cat(dleFrame(body), { 0x55, 0xAA }), cobsFrame(body))) == 2);
+    CHECK(decode(&dec, cat(cobsFrame(body), dleFrame(body))) == 2);
+    CHECK((dec.len == (int)body.size()) && !memcmp(dec.buffer, body.data(), body.size()));
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testDle:
+**------------------------------------------------------------------------------
+*/
+static void testDle(void)
+    {
+    vector <uint8_t> wire = dleFrame(frameBody({ MSGTYPE_HELLO, 7 }));
+    vector <uint8_t> broken;
+
+    //A DLE outside a frame is noise, the ETX after it closes nothing
+    CHECK(dropped({ DLE }));
+    CHECK(dropped({ DLE, 0x41, 0x42, ETX }));
+    CHECK(dropped({ DLE, ETX }));
+
+    //DLE DLE inside a frame drops it, up to the next STX
+    broken = wire;
+    broken.insert(broken.begin() + 3, { DLE, DLE });
+    CHECK(dropped(broken));
+
+    //A DLE right before the ETX drops it
+    broken = wire;
+    broken.insert(broken.end() - 1, DLE);
+    CHECK(dropped(broken));
+
+    //An STX starts over, whatever came before
+    CHECK(decodes(cat({ STX, 0x41, 0x42 }, wire), frameBody({ MSGTYPE_HELLO, 7 })));
+    CHECK(decodes(cat({ STX, 0x41, DLE }, wire), frameBody({ MSGTYPE_HELLO, 7 })));
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testLength:
+**------------------------------------------------------------------------------
+*/
+static void testLength(void)
+    {
+    vector <uint8_t> longest(MAX_MSG_LENGTH, 0x41);
+    vector <uint8_t> tooLong(MAX_MSG_LENGTH + 1, 0x41);
+    frameDecoder_t dec;
+    vector <uint8_t> body = frameBody({ MSGTYPE_HELLO, 7 });
+    vector <uint8_t> wire;
+
+    //MAX_MSG_LENGTH decoded bytes fit, one more drops the frame
+    CHECK(decodes(dleFrame(longest), longest));
+    CHECK(decodes(cobsFrame(longest), longest));
+    CHECK(dropped(dleFrame(tooLong)));
+    CHECK(dropped(cobsFrame(tooLong)));
+    decodeReset(&dec);
+    CHECK(!decode(&dec, dleFrame(tooLong)) && (dec.len == MAX_MSG_LENGTH));
+    decodeReset(&dec);
+    CHECK(!decode(&dec, cobsFrame(tooLong)) && (dec.len <= MAX_MSG_LENGTH));
+
+    //Stuffing does not count, the decoded bytes do
+    longest.assign(MAX_MSG_LENGTH, DLE);
+    CHECK(decodes(dleFrame(longest), longest));
+    tooLong.assign(MAX_MSG_LENGTH + 1, DLE);
+    CHECK(dropped(dleFrame(tooLong)));
+
+    //A length field that does not match what was received
+    CHECK(!ctrlChecksum(frameBody({ MSGTYPE_HELLO, 7 }, 1).data(), (int)body.size()));
+    CHECK(!ctrlChecksum(frameBody({ MSGTYPE_HELLO, 7 }, -1).data(), (int)body.size()));
+    CHECK(!ctrlChecksum(frameBody({ MSGTYPE_HELLO, 7 }, 0x100).data(), (int)body.size()));
+    CHECK(ctrlChecksum(body.data(), (int)body.size()));
+    CHECK(!ctrlChecksum(body.data(), (int)body.size() - 1));
+    CHECK(!ctrlChecksum(body.data(), 4));
+    CHECK(ctrlChecksum(frameBody({}).data(), 5));
+
+    //A byte lost on the wire, the decoder hands the frame out, the length
+    //check drops it
+    wire = body;
+    wire.erase(wire.begin() + 4);
+    CHECK(decodes(dleFrame(wire), wire));
+    CHECK(decodes(cobsFrame(wire), wire));
+    CHECK(!ctrlChecksum(wire.data(), (int)wire.size()));
+
+    //Damaged
+    body[3] ^= 0x01;
+    CHECK(!ctrlChecksum(body.data(), (int)body.size()));
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testCobs:
+**------------------------------------------------------------------------------
+*/
+static void testCobs(void)
+    {
+    vector <uint8_t> body = frameBody({ MSGTYPE_HELLO, 7 });
+    vector <uint8_t> wire = cobsFrame(body);
+    vector <uint8_t> cut;
+
+    //A block cut short by the delimiter drops the frame
+    cut = { COBS_DELIM, 6, 0x41, 0x42, COBS_DELIM };
+    CHECK(dropped(cut));
+    cut = wire;
+    cut.erase(cut.end() - 2);
+    CHECK(dropped(cut));
+
+    //Empty frames between delimiters are nothing
+    CHECK(dropped({ COBS_DELIM, COBS_DELIM, COBS_DELIM }));
+
+    //STX, ETX and DLE are data inside a COBS frame
+    body = frameBody({ MSGTYPE_HELLO, STX, DLE, ETX });
+    CHECK(decodes(cobsFrame(body), body));
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testFits:
+**------------------------------------------------------------------------------
+*/
+static void testFits(void)
+    {
+    uint8_t data[MAX_DATA_LENGTH];
+
+    memset(data, 0, sizeof(data));
+
+    //Nothing at all, not even the type
+    CHECK(!msgFits(data, 0));
+
+    //Every type, one byte short of its fields
+    for (int type = 0; type < 32; type++)
+        {
+        data[0] = (uint8_t)type;
+        CHECK(msgMinLength(data[0]) >= 1);
+        CHECK(msgFits(data, msgMinLength(data[0])));
+        CHECK(!msgFits(data, msgMinLength(data[0]) - 1));
+        }
+
+    //Fixed layouts
+    data[0] = MSGTYPE_SET_VOL_FINE;
+    CHECK(!msgFits(data, sizeof(struct msg_set_vol_fine) - 1));
+    data[0] = MSGTYPE_ACK;
+    CHECK(!msgFits(data, 1));
+    CHECK(msgFits(data, 2));
+    data[0] = MSGTYPE_SET_BAUD;
+    CHECK(!msgFits(data, sizeof(struct msg_set_baud) - 1));
+
+    //A partial master icon, the receiver would draw past it
+    data[0] = MSGTYPE_SET_MASTER_ICON;
+    CHECK(!msgFits(data, 1));
+    CHECK(!msgFits(data, 1 + MASTER_ICON_BYTES - 1));
+    CHECK(msgFits(data, 1 + MASTER_ICON_BYTES));
+    CHECK(msgFits(data, MAX_DATA_LENGTH));
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testRandom:
+**
+** Random bytes, with good frames and reserved bytes mixed in so the decoder
+** gets past its first state
+**------------------------------------------------------------------------------
+*/
+static void testRandom(void)
+    {
+    static const uint8_t special[] = { STX, ETX, DLE, COBS_DELIM, 0xFF };
+    vector <uint8_t> input;
+
+    srand(42);
+    for (int n = 0; n < RANDOM_INPUTS; n++)
+        {
+        int len = rand() % (3 * MAX_MSG_LENGTH);
+
+        input.clear();
+        while ((int)input.size() < len)
+            {
+            switch (rand() % 8)
+                {
+                case 0:
+                    {
+                    vector <uint8_t> data(1 + rand() % MAX_DATA_LENGTH);
+
+                    for (size_t i = 0; i < data.size(); i++)
+                        {
+                        data[i] = (uint8_t)rand();
+                        }
+                    data[0] %= 16;
+                    input = cat(input, (rand() & 1) ? dleFrame(frameBody(data)) : cobsFrame(frameBody(data)));
+                    break;
+                    }
+
+                case 1:
+                case 2:
+                    input.push_back(special[rand() % sizeof(special)]);
+                    break;
+
+                default:
+                    input.push_back((uint8_t)rand());
+                    break;
+                }
+            }
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+        }
+    }
+
+int main(void)
+    {
+    testGood();
+    testDle();
+    testLength();
+    testCobs();
+    testFits();
+    testRandom();
+
+    return CHECK_RESULT("test_framing");
+    }
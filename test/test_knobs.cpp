@@ -0,0 +1,251 @@
+/*
+**------------------------------------------------------------------------------
+** test_knobs:
+**
+** Tests the knob hand-over of the host: coalescing, the wait and the wake up,
+** and posting from several threads while the main thread applies. Built with
+** ThreadSanitizer, see the Makefile.
+**------------------------------------------------------------------------------
+*/
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "knobs.h"
+#include "check.h"
+
+using namespace std;
+
+const int POSTERS = 4;                  //RX threads, one receiver each
+const int KNOBS = 4;                    //Master and three channels per receiver
+const int TURNS = 20000;                //Positions posted per knob
+
+struct mixer_s
+    {
+    int id;
+    };
+
+static mixer_t boards[POSTERS];
+
+/*
+**------------------------------------------------------------------------------
+** knobIndex:
+**
+** Numbers the knobs of all receivers from 0
+**------------------------------------------------------------------------------
+*/
+static int knobIndex(const knobEvent_t *ev)
+    {
+    int knob = (ev->msgType == MSGTYPE_SET_MASTER_VOL_PREC) ? 0 : 1 + ev->channel;
+
+    return ev->mx->id * KNOBS + knob;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** post:
+**
+** Posts the position of one knob
+**------------------------------------------------------------------------------
+*/
+static void post(mixer_t *mx, int knob, int pos)
+    {
+    if (!knob)
+        {
+        postKnob(mx, MSGTYPE_SET_MASTER_VOL_PREC, 0, (uint16_t)pos, 0);
+        }
+    else
+        {
+        postKnob(mx, MSGTYPE_SET_CHANNEL_VOL_PREC, (uint8_t)(knob - 1), (uint16_t)pos, pos & 1);
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testCoalesce:
+**------------------------------------------------------------------------------
+*/
+static void testCoalesce(void)
+    {
+    vector <knobEvent_t> events;
+    uint32_t frames = knobFrames;
+
+    takeKnobs(&events);
+    CHECK(events.empty());
+
+    //The latest position of a knob replaces the one waiting, in its place
+    post(&boards[0], 1, 100);
+    post(&boards[0], 0, 200);
+    post(&boards[0], 1, 300);
+    post(&boards[1], 1, 400);
+    post(&boards[0], 2, 500);
+    CHECK(knobFrames == frames + 5);
+
+    takeKnobs(&events);
+    CHECK(events.size() == 4);
+    if (events.size() == 4)
+        {
+        CHECK((events[0].mx == &boards[0]) && (events[0].msgType == MSGTYPE_SET_CHANNEL_VOL_PREC) && (events[0].channel == 0) && (events[0].volVal == 300));
+        CHECK((events[1].mx == &boards[0]) && (events[1].msgType == MSGTYPE_SET_MASTER_VOL_PREC) && (events[1].volVal == 200));
+        CHECK((events[2].mx == &boards[1]) && (events[2].channel == 0) && (events[2].volVal == 400));
+        CHECK((events[3].mx == &boards[0]) && (events[3].channel == 1) && (events[3].volVal == 500));
+        }
+
+    //Taken means gone, whatever was in the vector before is dropped
+    takeKnobs(&events);
+    CHECK(events.empty());
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testWait:
+**------------------------------------------------------------------------------
+*/
+static void testWait(void)
+    {
+    vector <knobEvent_t> events;
+    atomic<int> flag(0);
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    thread waker;
+
+    //Nothing to do, up to the deadline
+    CHECK(!waitKnobEvents(t0 + chrono::milliseconds(20), &flag));
+    CHECK(chrono::steady_clock::now() - t0 >= chrono::milliseconds(20));
+    CHECK(!waitKnobEvents(chrono::steady_clock::now() + chrono::milliseconds(1), NULL));
+
+    //A pending change or the flag, at once
+    post(&boards[2], 0, 1);
+    CHECK(waitKnobEvents(chrono::steady_clock::now() + chrono::seconds(10), NULL));
+    takeKnobs(&events);
+
+    wakeKnobs(&flag);
+    CHECK(flag == 1);
+    CHECK(waitKnobEvents(chrono::steady_clock::now() + chrono::seconds(10), &flag));
+    CHECK(!waitKnobEvents(chrono::steady_clock::now() + chrono::milliseconds(1), NULL));
+    flag = 0;
+
+    //From other threads while waiting
+    t0 = chrono::steady_clock::now();
+    waker = thread([] { this_thread::sleep_for(chrono::milliseconds(20)); post(&boards[3], 2, 7); });
+    CHECK(waitKnobEvents(t0 + chrono::seconds(10), &flag));
+    CHECK(chrono::steady_clock::now() - t0 < chrono::seconds(5));
+    waker.join();
+    takeKnobs(&events);
+    CHECK((events.size() == 1) && (events[0].volVal == 7));
+
+    t0 = chrono::steady_clock::now();
+    waker = thread([&flag] { this_thread::sleep_for(chrono::milliseconds(20)); wakeKnobs(&flag); });
+    CHECK(waitKnobEvents(t0 + chrono::seconds(10), &flag));
+    CHECK(chrono::steady_clock::now() - t0 < chrono::seconds(5));
+    waker.join();
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testStress:
+**
+** Several RX threads turn their knobs while the main thread applies, as in
+** waitKnobs. Every knob must only ever move forward, no take may hold a knob
+** twice, and the last position of every knob must arrive.
+**------------------------------------------------------------------------------
+*/
+static void testStress(void)
+    {
+    vector <thread> posters;
+    vector <knobEvent_t> events;
+    atomic<int> done(0);
+    atomic<int> wake(0);
+    thread waker;
+    int last[POSTERS * KNOBS];
+    int backwards = 0;
+    int twice = 0;
+    int takes = 0;
+    uint32_t frames = knobFrames;
+
+    for (int k = 0; k < POSTERS * KNOBS; k++)
+        {
+        last[k] = -1;
+        }
+
+    for (int p = 0; p < POSTERS; p++)
+        {
+        posters.push_back(thread([p, &done]
+            {
+            for (int pos = 0; pos < TURNS; pos++)
+                {
+                post(&boards[p], pos % KNOBS, pos);
+                }
+            done++;
+            }));
+        }
+
+    //A device change notification thread
+    waker = thread([&done, &wake]
+        {
+        while (done < POSTERS)
+            {
+            wakeKnobs(&wake);
+            this_thread::sleep_for(chrono::microseconds(200));
+            }
+        });
+
+    for (int pass = 0; ; pass++)
+        {
+        int finished = (done == POSTERS);
+        int seen[POSTERS * KNOBS];
+
+        waitKnobEvents(chrono::steady_clock::now() + chrono::milliseconds(1), &wake);
+        wake = 0;
+
+        takeKnobs(&events);
+        takes += !events.empty();
+        memset(seen, 0, sizeof(seen));
+        for (size_t e = 0; e < events.size(); e++)
+            {
+            int k = knobIndex(&events[e]);
+
+            twice += seen[k]++;
+            backwards += (events[e].volVal <= last[k]);
+            last[k] = events[e].volVal;
+            }
+
+        //One more pass after the last post
+        if (finished)
+            {
+            break;
+            }
+        }
+
+    for (size_t p = 0; p < posters.size(); p++)
+        {
+        posters[p].join();
+        }
+    waker.join();
+
+    CHECK(!backwards);
+    CHECK(!twice);
+    CHECK(takes > 0);
+    CHECK(knobFrames == frames + POSTERS * TURNS);
+    for (int p = 0; p < POSTERS; p++)
+        {
+        for (int knob = 0; knob < KNOBS; knob++)
+            {
+            CHECK(last[p * KNOBS + knob] == TURNS - KNOBS + knob);
+            }
+        }
+    }
+
+int main(void)
+    {
+    for (int p = 0; p < POSTERS; p++)
+        {
+        boards[p].id = p;
+        }
+
+    testCoalesce();
+    testWait();
+    testStress();
+
+    return CHECK_RESULT("test_knobs");
+    }
@@ -0,0 +1,158 @@
+/*
+**------------------------------------------------------------------------------
+** test_labels:
+**
+** Tests the label code of the host: CP437 transliteration, its cache and
+** shortening labels to fit a display
+**------------------------------------------------------------------------------
+*/
+#include <string.h>
+#include <wchar.h>
+#include <string>
+#include "labels.h"
+#include "check.h"
+
+using namespace std;
+
+/*
+**------------------------------------------------------------------------------
+** shortened:
+**
+** Returns label after shortenLabel to fit characters
+**------------------------------------------------------------------------------
+*/
+static string shortened(const char *label, size_t fit)
+    {
+    char buf[128];
+
+    strncpy(buf, label, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    shortenLabel(buf, fit);
+
+    return buf;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testTransliteration:
+**------------------------------------------------------------------------------
+*/
+static void testTransliteration(void)
+    {
+    const wchar_t pair[] = { 'a', 0xD83D, 0xDE00, 'b', 0 };    //UTF-16 surrogate pair, an emoji
+    const wchar_t astral[] = { 'a', (wchar_t)0x1F600, 'b', 0 }; //The same as one code point, 32 bit wchar_t
+
+    //Printable ASCII passes, control characters become spaces
+    CHECK(labelCp437(L"Spotify 1.2") == "Spotify 1.2");
+    CHECK(labelCp437(L"a\tb\nc") == "a b c");
+
+    //In CP437
+    CHECK(labelCp437(L"Café") == "Caf\x82");
+    CHECK(labelCp437(L"Ångström") == "\x8Fngstr\x94m");
+    CHECK(labelCp437(L"±°") == "\xF1\xF8");
+
+    //Stand-ins
+    CHECK(labelCp437(L"Ørsted") == "Orsted");
+    CHECK(labelCp437(L"Привет") == "Privet");
+    CHECK(labelCp437(L"“Hi” – €5…") == "\"Hi\" - EUR5...");
+    CHECK(labelCp437(L"Àžỹ") == "Azy");
+    CHECK(labelCp437(L"\xFEFFx\x200B") == "x");    //Byte order mark, zero width space
+
+    //Nothing to stand in
+    CHECK(labelCp437(L"中文") == "??");
+    CHECK(labelCp437(pair) == "a?b");
+    if (sizeof(wchar_t) > 2)
+        {
+        CHECK(labelCp437(astral) == "a?b");
+        }
+
+    //Every CP437 glyph above 0x7F maps back to its own code
+    for (int c = 0; c < 128; c++)
+        {
+        wchar_t one[2] = { CP437_HIGH[c], 0 };
+        CHECK(labelCp437(one) == string(1, (char)(0x80 + c)));
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testCache:
+**------------------------------------------------------------------------------
+*/
+static void testCache(void)
+    {
+    wchar_t name[16];
+    const string *first;
+
+    //A hit returns the cached string itself
+    first = &labelCp437(L"cached");
+    CHECK(&labelCp437(L"cached") == first);
+
+    //Fill it up to the limit, the next new label starts it over
+    for (int i = 0; labelCacheSize() < (size_t)LABEL_CACHE_MAX; i++)
+        {
+        swprintf(name, sizeof(name) / sizeof(name[0]), L"fill%d", i);
+        CHECK(labelCp437(name) == "fill" + to_string(i));
+        }
+    CHECK(labelCacheSize() == (size_t)LABEL_CACHE_MAX);
+
+    CHECK(labelCp437(L"cached") == "cached");
+    CHECK(labelCacheSize() == (size_t)LABEL_CACHE_MAX);
+
+    CHECK(labelCp437(L"one more") == "one more");
+    CHECK(labelCacheSize() == 1);
+
+    //Dropped with the rest, and still right when it comes back
+    CHECK(labelCp437(L"cached") == "cached");
+    CHECK(labelCacheSize() == 2);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testShorten:
+**------------------------------------------------------------------------------
+*/
+static void testShorten(void)
+    {
+    //5 px glyphs with a 1 px gap, none after the last
+    CHECK(labelFit(0) == 0);
+    CHECK(labelFit(-6) == 0);
+    CHECK(labelFit(5) == 1);
+    CHECK(labelFit(11) == 2);
+    CHECK(labelFit(128) == 21);
+
+    //Fits, or the display size is not known, left alone
+    CHECK(shortened("  Spotify  ", 20) == "  Spotify  ");
+    CHECK(shortened("A long title - Google Chrome", 0) == "A long title - Google Chrome");
+
+    //Spaces first, that may be enough
+    CHECK(shortened("  Teams   Call  ", 10) == "Teams Call");
+
+    //Notification counts, then the rules
+    CHECK(shortened("(12) Inbox - Slack", 8) == "Inbox");
+    CHECK(shortened("(12)", 2) == "(12)");
+    CHECK(shortened("Spotify Premium", 10) == "Spotify");
+    CHECK(shortened("News - YouTube - Google Chrome", 10) == "News");
+    CHECK(shortened("Zoom Meeting", 4) == "Zoom");
+
+    //A rule never empties a label
+    CHECK(shortened(" - Discord", 5) == "- Discord");
+
+    //Trailing parts, the song stays
+    CHECK(shortened("Song - Artist - Album", 13) == "Song - Artist");
+    CHECK(shortened("Song - Artist - Album", 10) == "Song");
+    CHECK(shortened("Chat | Team | Org", 4) == "Chat");
+
+    //Nothing to take away, the receiver scrolls it
+    CHECK(shortened("Averyverylongname", 5) == "Averyverylongname");
+    CHECK(shortened("- Intro -", 3) == "- Intro -");
+    }
+
+int main(void)
+    {
+    testTransliteration();
+    testCache();
+    testShorten();
+
+    return CHECK_RESULT("test_labels");
+    }
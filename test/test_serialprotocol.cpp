@@ -0,0 +1,184 @@
+/*
+**------------------------------------------------------------------------------
+** test_serialprotocol:
+**
+** Tests the framing helpers both ends share: COBS encoding, the CRC-16 and
+** the sequence number window
+**------------------------------------------------------------------------------
+*/
+#include <stdint.h>
+#include <string.h>
+#include "serialprotocol.h"
+#include "check.h"
+
+/*
+**------------------------------------------------------------------------------
+** cobsDecode:
+**
+** Reference decoder for the round trip tests. Returns the decoded length, or
+** -1 for a malformed frame.
+**------------------------------------------------------------------------------
+*/
+static int cobsDecode(const uint8_t *src, int n, uint8_t *dst)
+    {
+    int out = 0;
+    int i = 0;
+
+    while (i < n)
+        {
+        int code = src[i++];
+
+        if (!code || (i + code - 1 > n))
+            {
+            return -1;
+            }
+        for (int k = 1; k < code; k++)
+            {
+            dst[out++] = src[i++];
+            }
+        if ((code < 0xFF) && (i < n))
+            {
+            dst[out++] = 0;
+            }
+        }
+
+    return out;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** cobsCheck:
+**
+** Encodes src and compares the result with the expected bytes
+**------------------------------------------------------------------------------
+*/
+static int cobsCheck(const uint8_t *src, int n, const uint8_t *expected, int expectedLen)
+    {
+    uint8_t enc[16];
+    int len = cobsEncode(src, n, enc);
+
+    return (len == expectedLen) && !memcmp(enc, expected, len);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testCobs:
+**------------------------------------------------------------------------------
+*/
+static void testCobs(void)
+    {
+    static const uint8_t zero[] = { 0x00 };
+    static const uint8_t zeroEnc[] = { 0x01, 0x01 };
+    static const uint8_t zeros[] = { 0x00, 0x00 };
+    static const uint8_t zerosEnc[] = { 0x01, 0x01, 0x01 };
+    static const uint8_t mid[] = { 0x11, 0x22, 0x00, 0x33 };
+    static const uint8_t midEnc[] = { 0x03, 0x11, 0x22, 0x02, 0x33 };
+    static const uint8_t none[] = { 0x11, 0x22, 0x33, 0x44 };
+    static const uint8_t noneEnc[] = { 0x05, 0x11, 0x22, 0x33, 0x44 };
+    static const uint8_t tail[] = { 0x11, 0x00, 0x00, 0x00 };
+    static const uint8_t tailEnc[] = { 0x02, 0x11, 0x01, 0x01, 0x01 };
+    static const uint8_t emptyEnc[] = { 0x01 };
+
+    CHECK(cobsCheck(NULL, 0, emptyEnc, sizeof(emptyEnc)));
+    CHECK(cobsCheck(zero, sizeof(zero), zeroEnc, sizeof(zeroEnc)));
+    CHECK(cobsCheck(zeros, sizeof(zeros), zerosEnc, sizeof(zerosEnc)));
+    CHECK(cobsCheck(mid, sizeof(mid), midEnc, sizeof(midEnc)));
+    CHECK(cobsCheck(none, sizeof(none), noneEnc, sizeof(noneEnc)));
+    CHECK(cobsCheck(tail, sizeof(tail), tailEnc, sizeof(tailEnc)));
+
+    //Longer than one block, with and without zeros, up to a full frame
+    for (int n = 1; n <= MAX_MSG_LENGTH * 3; n++)
+        {
+        for (int pattern = 0; pattern < 3; pattern++)
+            {
+            uint8_t src[MAX_MSG_LENGTH * 3];
+            uint8_t enc[MAX_MSG_LENGTH * 3 + MAX_MSG_LENGTH * 3 / 254 + 1];
+            uint8_t dec[sizeof(enc)];
+            int len;
+
+            for (int i = 0; i < n; i++)
+                {
+                src[i] = (pattern == 0) ? (uint8_t)(i % 255 + 1) : (pattern == 1) ? (uint8_t)(i * 7) : 0;
+                }
+
+            len = cobsEncode(src, n, enc);
+            CHECK(len <= n + n / 254 + 1);
+            CHECK(memchr(enc, 0, len) == NULL);
+            CHECK(cobsDecode(enc, len, dec) == n);
+            CHECK(!memcmp(src, dec, n));
+            }
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testCrc16:
+**------------------------------------------------------------------------------
+*/
+static void testCrc16(void)
+    {
+    const uint8_t check[] = "123456789";
+    uint16_t crc;
+
+    //The CRC-16/CCITT-FALSE check value
+    CHECK(crc16(0xFFFF, check, 9) == 0x29B1);
+    CHECK(crc16(0xFFFF, check, 0) == 0xFFFF);
+
+    //Running it in parts gives the same result
+    crc = crc16(0xFFFF, check, 4);
+    CHECK(crc16(crc, check + 4, 5) == 0x29B1);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testSeq:
+**------------------------------------------------------------------------------
+*/
+static void testSeq(void)
+    {
+    seqWindow_t w = { 0, 0 };
+
+    CHECK(seqNext(1) == 2);
+    CHECK(seqNext(254) == 255);
+    CHECK(seqNext(255) == 1);
+    CHECK(seqDistance(255, 1) == 1);
+    CHECK(seqDistance(10, 10) == 0);
+
+    //The first frame starts the window, wherever it is
+    CHECK(seqAccept(&w, 10) == 0);
+    CHECK(seqAccept(&w, 10) == -1);
+    CHECK(seqAccept(&w, 11) == 0);
+
+    //A gap reports the frames missing, the resends fill it once
+    CHECK(seqAccept(&w, 15) == 3);
+    CHECK(seqAccept(&w, 13) == 0);
+    CHECK(seqAccept(&w, 13) == -1);
+    CHECK(seqAccept(&w, 12) == 0);
+    CHECK(seqAccept(&w, 14) == 0);
+    CHECK(seqAccept(&w, 15) == -1);
+
+    //Across the wrap, 0 is never used
+    w = { 0, 0 };
+    CHECK(seqAccept(&w, 254) == 0);
+    CHECK(seqAccept(&w, 255) == 0);
+    CHECK(seqAccept(&w, 1) == 0);
+    CHECK(seqAccept(&w, 3) == 1);
+    CHECK(seqAccept(&w, 2) == 0);
+    CHECK(seqAccept(&w, 255) == -1);
+
+    //Too old to tell, taken as a duplicate
+    w = { 0, 0 };
+    CHECK(seqAccept(&w, 100) == 0);
+    CHECK(seqAccept(&w, 140) == 39);
+    CHECK(seqAccept(&w, 105) == -1);
+    CHECK(seqAccept(&w, 110) == 0);
+    }
+
+int main(void)
+    {
+    testCobs();
+    testCrc16();
+    testSeq();
+
+    return CHECK_RESULT("test_serialprotocol");
+    }
@@ -0,0 +1,222 @@
+/*
+**------------------------------------------------------------------------------
+** test_volcurve:
+**
+** Tests the volume curves of the host: parsing curve points, compiling the
+** curves and converting between knob steps and audio scalars both ways
+**------------------------------------------------------------------------------
+*/
+#include <string.h>
+#include <math.h>
+#include "volcurve.h"
+#include "check.h"
+
+static volCurve_t linear;
+static volCurve_t db;
+static volCurve_t custom;
+
+/*
+**------------------------------------------------------------------------------
+** parsed:
+**
+** Returns 1 if text parses into exactly the expected points
+**------------------------------------------------------------------------------
+*/
+static int parsed(const wchar_t *text, const uint8_t (*expected)[2])
+    {
+    uint8_t points[CURVE_MAX_POINTS][2];
+
+    memset(points, 0xEE, sizeof(points));
+    return curveParse(points, text) && !memcmp(points, expected, sizeof(points));
+    }
+
+/*
+**------------------------------------------------------------------------------
+** rejected:
+**
+** Returns 1 if text does not parse and the points are left alone
+**------------------------------------------------------------------------------
+*/
+static int rejected(const wchar_t *text)
+    {
+    uint8_t points[CURVE_MAX_POINTS][2];
+    uint8_t before[CURVE_MAX_POINTS][2];
+
+    memset(points, 0xEE, sizeof(points));
+    memcpy(before, points, sizeof(points));
+    return !curveParse(points, text) && !memcmp(points, before, sizeof(points));
+    }
+
+/*
+**------------------------------------------------------------------------------
+** roundTrip:
+**
+** Returns 1 if every knob step of a curve reads back as itself
+**------------------------------------------------------------------------------
+*/
+static int roundTrip(const volCurve_t *curve)
+    {
+    for (int n = 0; n <= VOL_FINE_MAX; n++)
+        {
+        if (curveFine(curve, curveScalar(curve, n)) != n)
+            {
+            return 0;
+            }
+        }
+    return 1;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** rising:
+**
+** Returns 1 if every knob step of a curve is louder than the one before
+**------------------------------------------------------------------------------
+*/
+static int rising(const volCurve_t *curve)
+    {
+    for (int n = 1; n <= VOL_FINE_MAX; n++)
+        {
+        if (!(curveScalar(curve, n) > curveScalar(curve, n - 1)))
+            {
+            return 0;
+            }
+        }
+    return 1;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testParse:
+**------------------------------------------------------------------------------
+*/
+static void testParse(void)
+    {
+    static const uint8_t one[CURVE_MAX_POINTS][2] = { { 50, 20 }, { 100, 100 } };
+    static const uint8_t three[CURVE_MAX_POINTS][2] = { { 25, 10 }, { 50, 30 }, { 75, 60 }, { 100, 100 } };
+    static const uint8_t ends[CURVE_MAX_POINTS][2] = { { 50, 20 }, { 100, 90 } };
+    static const uint8_t none[CURVE_MAX_POINTS][2] = { { 100, 100 } };
+    static const uint8_t full[CURVE_MAX_POINTS][2] =
+        { { 10, 1 }, { 20, 2 }, { 30, 3 }, { 40, 4 }, { 50, 5 }, { 60, 6 }, { 70, 7 }, { 100, 100 } };
+
+    //0:0 is implied, and 100:100 unless the last point is at 100
+    CHECK(parsed(L"50:20", one));
+    CHECK(parsed(L"25:10,50:30,75:60", three));
+    CHECK(parsed(L"50:20,100:90", ends));
+    CHECK(parsed(L"", none));
+    CHECK(parsed(L"10:1,20:2,30:3,40:4,50:5,60:6,70:7,100:100", full));
+
+    //Both have to rise
+    CHECK(rejected(L"50:20,40:30"));
+    CHECK(rejected(L"50:20,60:20"));
+    CHECK(rejected(L"0:0"));
+    CHECK(rejected(L"50:100"));
+
+    //Percent only
+    CHECK(rejected(L"101:50"));
+    CHECK(rejected(L"50:101"));
+    CHECK(rejected(L"-5:10"));
+
+    //Room for CURVE_MAX_POINTS, the implied 100:100 included
+    CHECK(rejected(L"10:1,20:2,30:3,40:4,50:5,60:6,70:7,80:8"));
+    CHECK(rejected(L"10:1,20:2,30:3,40:4,50:5,60:6,70:7,80:8,100:100"));
+
+    //Malformed
+    CHECK(rejected(L"50"));
+    CHECK(rejected(L"50:"));
+    CHECK(rejected(L":20"));
+    CHECK(rejected(L"a:b"));
+    CHECK(rejected(L"50:20x"));
+    CHECK(rejected(L"50:20;75:60"));
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testBuild:
+**------------------------------------------------------------------------------
+*/
+static void testBuild(void)
+    {
+    uint8_t points[CURVE_MAX_POINTS][2];
+
+    CHECK(curveBuild(&linear, CURVE_LINEAR, NULL));
+    CHECK(curveBuild(&db, CURVE_DB, NULL));
+    CHECK(curveParse(points, L"50:20"));
+    CHECK(curveBuild(&custom, CURVE_POINTS, points));
+
+    //Every step reads back exactly, so a knob echo never drifts
+    CHECK(roundTrip(&linear));
+    CHECK(roundTrip(&db));
+    CHECK(roundTrip(&custom));
+    CHECK(rising(&linear));
+    CHECK(rising(&db));
+    CHECK(rising(&custom));
+
+    //Linear is the plain conversion
+    for (int n = 0; n <= VOL_FINE_MAX; n++)
+        {
+        CHECK(volFine(curveScalar(&linear, n)) == n);
+        }
+
+    //dB: silence, then even steps from -CURVE_DB_RANGE up to 0 dB
+    CHECK(curveScalar(&db, 0) == 0.0f);
+    CHECK(fabs(curveScalar(&db, 1) - pow(10.0, -0.999 * CURVE_DB_RANGE / 20.0)) < 1e-7);
+    CHECK(fabs(curveScalar(&db, VOL_FINE_MAX / 2) - pow(10.0, -CURVE_DB_RANGE / 40.0)) < 1e-6);
+    CHECK(curveScalar(&db, VOL_FINE_MAX) == 1.0f);
+
+    //Points: straight lines in between
+    CHECK(curveScalar(&custom, 0) == 0.0f);
+    CHECK(fabs(curveScalar(&custom, 250) - 0.10) < 1e-6);
+    CHECK(fabs(curveScalar(&custom, 500) - 0.20) < 1e-6);
+    CHECK(fabs(curveScalar(&custom, 750) - 0.60) < 1e-6);
+    CHECK(curveScalar(&custom, VOL_FINE_MAX) == 1.0f);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** testFine:
+**------------------------------------------------------------------------------
+*/
+static void testFine(void)
+    {
+    //Without a curve, the plain conversion
+    for (int n = 0; n <= VOL_FINE_MAX; n++)
+        {
+        CHECK(volFine(volScalar(n)) == n);
+        CHECK(curveFine(NULL, volScalar(n)) == n);
+        CHECK(curveScalar(NULL, n) == volScalar(n));
+        }
+
+    //Out of range and not a number
+    CHECK(curveFine(&db, -0.5f) == 0);
+    CHECK(curveFine(&db, NAN) == 0);
+    CHECK(curveFine(&db, 1.5f) == VOL_FINE_MAX);
+    CHECK(volFine(-0.5f) == 0);
+    CHECK(volFine(NAN) == 0);
+    CHECK(volFine(1.5f) == VOL_FINE_MAX);
+    CHECK(curveScalar(&custom, -5) == curveScalar(&custom, 0));
+    CHECK(curveScalar(&custom, VOL_FINE_MAX + 5) == curveScalar(&custom, VOL_FINE_MAX));
+
+    //A volume set elsewhere goes to the nearest step, rounded not truncated
+    CHECK(curveFine(&linear, 0.5004f) == 500);
+    CHECK(curveFine(&linear, 0.5006f) == 501);
+    CHECK(volFine(0.5004f) == 500);
+    CHECK(volFine(0.5006f) == 501);
+    for (int n = 0; n < VOL_FINE_MAX; n++)
+        {
+        float lo = curveScalar(&db, n);
+        float hi = curveScalar(&db, n + 1);
+
+        CHECK(curveFine(&db, lo + (hi - lo) * 0.25f) == n);
+        CHECK(curveFine(&db, lo + (hi - lo) * 0.75f) == n + 1);
+        }
+    }
+
+int main(void)
+    {
+    testParse();
+    testBuild();
+    testFine();
+
+    return CHECK_RESULT("test_volcurve");
+    }
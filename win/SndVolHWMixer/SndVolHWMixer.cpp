@@ -13,6 +13,11 @@
 */
 #include "pch.h"
 #include "rs232.h"
+#include "labels.h"
+#include "volcurve.h"
+#include "knobs.h"
+#include "framing.h"
+#include "endpoints.h"
 #include <mmdeviceapi.h>
 #include <tchar.h>
 #include <endpointvolume.h>
@@ -20,8 +25,19 @@
 #include <Psapi.h>
 #include <Functiondiscoverykeys_devpkey.h>
 #include <conio.h>
+#include <io.h>
 #include <list>
+#include <vector>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdarg>
+#include <cmath>
+#include <cwctype>
+#include <string>
+#include <unordered_map>
 
 #include "../../common/serialprotocol.h"
 
@@ -39,7 +55,7 @@
 ** Constants
 **------------------------------------------------------------------------------
 */
-const uint8_t corsair[] =
+const uint8_t corsair[MASTER_ICON_BYTES] =
     {
     0x00, 0x00,
     0x00, 0x20,
@@ -59,6 +75,16 @@ const uint8_t corsair[] =
     0x00, 0x00
     };
 
+const int SYNC_PERIOD_MS = 2000;            //Session enumeration and label update period
+const int METER_PERIOD_MS = 33;             //Peak meter sample period, ~30 Hz
+const int LINK_REPLY_TIMEOUT_MS = 250;      //Wait for an answer to a link control message
+const int HELLO_PERIOD_MS = 100;            //HELLO repeat rate while waiting for the receiver
+const int CONNECT_TIMEOUT_MS = 4000;        //Give up waiting for CAPS, covers the bootloader and display setup
+const int DISCOVERY_PERIOD_MS = 2000;       //Port scan rate, also picks up added receivers
+const int MAX_MIXERS = 8;                   //Receivers driven at once
+const int MAX_MSGTYPES = 16;                //Per type metrics, covers every MSGTYPE
+const int TX_IDLE_WAIT_MS = 5;              //TX worker sleep when there is nothing to send, a send wakes it up
+const int CAPS_MIN_DATA = sizeof(struct msg_set_channel_label) + 2; //Smallest maxData taken from CAPS, a one character label
 
 /*
 **------------------------------------------------------------------------------
@@ -68,13 +94,15 @@ const uint8_t corsair[] =
 typedef struct
     {    
     IAudioEndpointVolume    *pEndpointVolume;
+    IAudioMeterInformation  *pMeter;                //Peak meter of the endpoint
     IAudioSessionEnumerator *pSessionEnumerator;
     GUID					guid;                   //guid for this device
     WCHAR					deviceName[MAX_PATH * 2]; //Pretty name, the final name sent to the receiver
 
-    float                   prevVolume;             //previous volume value
+    int                     prevVolume;             //previous volume value, 0..VOL_FINE_MAX
     BOOL                    prevMute;               //previous mute status
     int                     update;                 //update flag
+    ULONGLONG               knobTime;               //Tick count of the last change made with a knob
     }deviceData_t;
 
 typedef struct
@@ -82,18 +110,240 @@ typedef struct
     IAudioSessionControl	*pSessionControl;       //SessionControl for this stream
     IAudioSessionControl2	*pSessionControl2;      //SessionControl2 for this stream
     ISimpleAudioVolume		*pVolumeControl;        //AudioVolume for this stream
+    IAudioEndpointVolume    *pEndpointVolume;       //Set instead for a whole endpoint, see --endpoint
+    IAudioMeterInformation  *pMeter;                //Peak meter for this stream
     GUID					guid;                   //guid for this stream
 
     PWSTR					displayName;            //Obtained by IAudioSessionControl.GetDisplayName, don't forget to release after use
     WCHAR					prettyName[MAX_PATH * 2]; //Pretty name, the final name sent to the receiver
 
-    float                   prevVolume;             //previous volume value
+    int                     prevVolume;             //previous volume value, 0..VOL_FINE_MAX
     BOOL                    prevMute;               //previous mute status
     int                     update;                 //update flag
+    ULONGLONG               knobTime;               //Tick count of the last change made with a knob
+    int                     endpoint;               //0 for the default render endpoint, else 1 + index in extraEndpoints
+    int                     app;                    //Index in storeRecords, -1 until the executable is known
+    const volCurve_t        *curve;                 //Knob to volume, NULL for linear
 
     }groupData_t;
 
+typedef struct
+    {
+    uint8_t                 seq;                    //Sequence number waiting for an ACK, 0 if the slot is free
+    uint16_t                key;                    //Message type and channel, a newer frame with the same key replaces this one
+    int                     retries;                //Resends so far
+    ULONGLONG               sentAt;                 //Tick count of the last send
+    int                     len;                    //Data layer length
+    uint8_t                 data[MAX_MSG_LENGTH];   //Data layer copy, for resending
+    }txPending_t;
+
+typedef struct
+    {
+    uint8_t                 protoVersion;
+    uint8_t                 numChannels;            //Channels besides the master
+    uint8_t                 masterWidth;            //Display geometry in pixels
+    uint8_t                 masterHeight;
+    uint8_t                 channelWidth;
+    uint8_t                 channelHeight;
+    uint8_t                 msgTypes[4];            //Bit n set: MSGTYPE n is handled
+    uint8_t                 maxData;                //Longest data layer accepted
+    char                    build[32];              //Firmware build ID
+    }deviceCaps_t;
+
+typedef enum
+    {
+    TX_LANE_VOLUME = 0,                             //Volume, mute and link control, sent first
+    TX_LANE_LABEL,                                  //Labels
+    TX_LANE_BULK,                                   //Icons and meters, sent when nothing else is waiting
+    TX_LANES
+    }txLane_t;
+
+typedef enum
+    {
+    MIXER_FREE = 0,                                 //Slot not in use
+    MIXER_CONNECTING,                               //Port open, waiting for CAPS
+    MIXER_ACTIVE                                    //Connected, part of the channel layout
+    }mixerState_t;
+
+typedef struct mixer_s
+    {
+    mixerState_t            state;
+    int                     cport_nr;               //Serial port index
+    int                     bdrate;                 //Baud rate, raised by negotiateBaud
+    int                     probing;                //Opened by a port scan, not known to be a receiver yet
+    int                     synced;                 //Full state sent and ACKed
+    ULONGLONG               syncTime;               //Last syncDevice, a failed one is retried after DISCOVERY_PERIOD_MS
+    int                     chBase;                 //First group shown on this receiver
+    deviceCaps_t            caps;                   //What the receiver can do
+
+    std::atomic<int>        rxActive;               //The RX thread polls the port
+    std::atomic<int>        rxBusy;                 //The RX thread is inside a poll of this port, see closeDevice
+    std::atomic<int>        lost;                   //Set by the RX thread when the port goes away, e.g. unplugged
+    frameDecoder_t          rx;                     //RX thread only
+    int                     checksumErrors;
+
+    std::mutex              lock;                   //Guards the TX buffers and the link state below
+    uint8_t                 msgBuffer[MAX_MSG_LENGTH];
+    uint8_t                 txBuffer[MAX_RXTX_BUFFER_LENGTH];
+    txPending_t             txPending[LINK_TX_WINDOW]; //Sequenced frames waiting for an ACK
+    uint8_t                 txSeq;                  //Last sequence number sent
+    std::vector<uint16_t>   txDropped;              //Keys of frames dropped unACKed, flagged again by linkService
+    seqWindow_t             rxWindow;               //Sequence numbers received
+
+    std::atomic<uint32_t>   baudReply;              //Last rate reported by a SET_BAUD answer
+    std::atomic<int>        probeReply;             //Sequence number of the last correctly echoed probe
+    std::atomic<int>        capsReply;              //Set when CAPS has been received
+    std::atomic<int>        txCobs;                 //The receiver decodes COBS frames, from CAPS
+    std::atomic<ULONGLONG>  capsTime;               //Tick count of the last CAPS, the keepalive answer
+    std::atomic<int>        resyncRequest;          //Set when the receiver reports STATE_LOST
+    std::atomic<int>        stateAcked;             //A master volume was ACKed, STATE_LOST now means a reset
+    std::atomic<int>        baudFallback;           //Set by the RX thread on checksum errors, linkCheck drops the rate
+    ULONGLONG               helloTime;              //Last keepalive sent
+
+    uint8_t                 prevLevels[MAX_METER_LEVELS]; //Last meter frame sent
+    int                     prevCount;
+
+    std::atomic<int>        txQueued;               //Frames handed to the TX worker, not on the wire yet
+    std::atomic<uint32_t>   session;                //Bumped by linkReset, frames queued before are dropped
+
+    int                     replay;                 //replayDir_t, a --replay decoder only counts the frames
+    uint64_t                replayFrames;
+    }mixer_t;
+
+typedef struct txItem_s
+    {
+    std::atomic<struct txItem_s *> next;            //MPSC queue link
+    mixer_t                 *mx;                    //Receiver to send to
+    uint32_t                session;                //mx->session when queued
+    int                     lane;                   //txLane_t
+    uint16_t                key;                    //Message type and channel, a newer frame with the same key replaces this one
+    int                     retries;                //Resends so far, for sequenced frames
+    std::chrono::steady_clock::time_point queuedAt; //For the lane latency statistics
+    int                     len;                    //Data layer length
+    uint8_t                 data[MAX_MSG_LENGTH];   //Data layer copy
+    }txItem_t;
+
+typedef struct
+    {
+    uint32_t                frames;                 //Frames sent
+    uint32_t                coalesced;              //Frames replaced by a newer one before they were sent
+    uint64_t                totalUs;                //Queue to wire time, summed
+    uint32_t                maxUs;
+    }txLaneStats_t;
+
+typedef enum
+    {
+    LOG_ERROR = 0,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG,
+    LOG_LEVELS
+    }logLevel_t;
+
+//Level gated, nothing is formatted for a level that is off. Defined here, the
+//Group class logs too.
+extern int logLevel;
+void logPrint(int, const char *, const char *, ...);
+#define logMsg(_level, _event, ...)    do { if ((_level) <= logLevel) { logPrint(_level, _event, __VA_ARGS__); } } while (0)
+
+//Serial capture, see --capture and --replay. The file starts with CAPTURE_MAGIC
+//followed by records of a captureRecord_t header and len bytes of raw wire data.
+const char CAPTURE_MAGIC[8] = { 'S', 'V', 'C', 'A', 'P', '1', 0, 0 };
+const uint8_t CAPTURE_RX = 0x80;                    //Record flags, received from the receiver, else sent to it
+const uint8_t CAPTURE_PORT = 0x3F;                  //Record flags, serial port index
+const int CAPTURE_MAX_RECORD = 255;
+const int CAPTURE_GAP_US = 1000;                    //Received bytes closer than this share a record
+
+const int BENCH_MIN_MS = 200;                       //--bench, shortest timed pass
+const int BENCH_SYNC_CHANNELS[] = { 4, 8, 15 };     //--bench, receiver sizes for the sync cases
+
+#pragma pack(push, 1)
+typedef struct
+    {
+    uint32_t                deltaUs;                //Since the previous record
+    uint8_t                 flags;
+    uint8_t                 len;
+    }captureRecord_t;
+#pragma pack(pop)
+
+typedef enum
+    {
+    REPLAY_OFF = 0,                                 //A live receiver
+    REPLAY_TX,                                      //Decodes the host frames of a capture
+    REPLAY_RX                                       //Decodes the receiver frames of a capture
+    }replayDir_t;
+
+//Per application store, see --store and --pref. The file is a storeHeader_t
+//followed by count records of recordSize bytes. Version 2 added the curve
+//points, a version 1 store is converted when it is read. A store from a newer
+//version is not read.
+const char STORE_MAGIC[6] = { 'S', 'V', 'S', 'T', 'O', 'R' };
+const uint16_t STORE_VERSION = 2;
+const uint16_t STORE_VERSION_V1 = 1;                //Records end before points
+const int STORE_MAX_APPS = 256;                     //Records kept, one without preferences makes room for a new app
+const int STORE_NO_SLOT = -1;
+
+#pragma pack(push, 1)
+typedef struct
+    {
+    char                    magic[6];
+    uint8_t                 version[2];             //LE16, STORE_VERSION
+    uint8_t                 recordSize[2];          //LE16, sizeof(storeRecord_t) of the writer
+    uint8_t                 count[2];               //LE16, records that follow
+    uint8_t                 masterVolume[2];        //LE16, 0..VOL_FINE_MAX, last known
+    uint8_t                 masterMute;
+    char                    masterLabel[64];        //Endpoint name last shown, CP437
+    }storeHeader_t;
+
+typedef struct
+    {
+    char                    app[32];                //Executable name without the extension, lower case, the key
+    char                    label[32];              //Custom label, CP437, empty to use the session name
+    char                    lastLabel[64];          //Label last shown, CP437
+    int8_t                  slot;                   //Preferred channel, STORE_NO_SLOT for none
+    int8_t                  lastSlot;               //Channel last shown on, STORE_NO_SLOT if not shown
+    uint8_t                 curve;                  //curveType_t
+    uint8_t                 lastMute;
+    uint8_t                 lastVolume[2];          //LE16, 0..VOL_FINE_MAX
+    uint8_t                 points[CURVE_MAX_POINTS][2]; //CURVE_POINTS, knob and volume percent, both rising, zeros after the last
+    }storeRecord_t;
+#pragma pack(pop)
+
+//Latency histogram bucket bounds in ms, the +Inf bucket is implied
+const double METRIC_BUCKETS_MS[] = { 0.1, 0.5, 1, 2.5, 5, 10, 25, 50, 100, 250, 1000, 5000 };
+const int METRIC_BUCKETS = sizeof(METRIC_BUCKETS_MS) / sizeof(METRIC_BUCKETS_MS[0]);
+
+typedef struct
+    {
+    std::atomic<uint64_t>   bucket[METRIC_BUCKETS + 1]; //Observations per bucket, not cumulative, the last is +Inf
+    std::atomic<uint64_t>   count;
+    std::atomic<uint64_t>   sumUs;
+    }metricHistogram_t;
 
+typedef struct
+    {
+    std::atomic<uint64_t>   framesTx[MAX_MSGTYPES]; //Frames put on the wire, per MSGTYPE
+    std::atomic<uint64_t>   framesRx[MAX_MSGTYPES]; //Good frames received, per MSGTYPE
+    std::atomic<uint64_t>   bytesTx;                //Bytes on the wire, framing and stuffing included
+    std::atomic<uint64_t>   bytesRx;
+    std::atomic<uint64_t>   checksumErrors;
+    std::atomic<uint64_t>   resends;                //Sequenced frames sent again after a NAK or timeout
+    std::atomic<uint64_t>   giveUps;                //Sequenced frames never ACKed
+    std::atomic<uint64_t>   resyncs;                //Full state resends after a reset or a link loss
+    std::atomic<uint64_t>   labelsSent;
+    std::atomic<uint64_t>   labelsScrolling;        //Labels still too wide after shortenLabel, the receiver scrolls them
+    metricHistogram_t       enumerate;              //getGroups
+    metricHistogram_t       labels;                 //getLabels
+    metricHistogram_t       sync;                   //Connect to full display, syncDevice
+    }metrics_t;
+
+//Called by the DeviceNotifier on a system thread, the main thread rebinds
+void postDeviceChange(void);
+
+//The interfaces of a group are plain pointers, a copy shares them and there is
+//no destructor. A worker of enumerateEndpoints fills only its own list, the main thread
+//takes it over after the join. From then on the entry in groupList owns the
+//interfaces and freeAll releases them once, when it is dropped.
 class Group
     {
     public:
@@ -114,13 +364,19 @@ class Group
             g.pSessionControl = NULL;
             g.pSessionControl2 = NULL;
             g.pVolumeControl = NULL;
+            g.pEndpointVolume = NULL;
+            g.pMeter = NULL;
             g.guid = GUID_NULL;
 
             g.displayName = NULL;
             g.prettyName[0] = '\0';
-            g.prevVolume = NAN;
+            g.prevVolume = -1;
             g.prevMute = -1;
             g.update = true;
+            g.knobTime = 0;
+            g.endpoint = 0;
+            g.app = -1;
+            g.curve = NULL;
             }
 
         /*
@@ -148,6 +404,16 @@ class Group
                 g.pVolumeControl->Release();
                 }
 
+            if (g.pEndpointVolume)
+                {
+                g.pEndpointVolume->Release();
+                }
+
+            if (g.pMeter)
+                {
+                g.pMeter->Release();
+                }
+
             if (g.displayName)
                 {
                 CoTaskMemFree(g.displayName);
@@ -175,17 +441,158 @@ class Group
             //Get volume control
             g.pSessionControl->QueryInterface(__uuidof(ISimpleAudioVolume), (void**)&g.pVolumeControl);
 
+            //Get peak meter
+            g.pSessionControl->QueryInterface(__uuidof(IAudioMeterInformation), (void**)&g.pMeter);
+
             //Get displayname
             g.pSessionControl->GetDisplayName(&g.displayName);
 
             OLECHAR* guidString;
             StringFromCLSID(g.guid, &guidString);
-            printf("Stream: %S, displayName: \"%S\"\n",
+            logMsg(LOG_DEBUG, "stream", "guid=%S displayName=\"%S\"",
                 guidString,
                 g.displayName);
             CoTaskMemFree(guidString);
 
             }
+
+        /*
+        **----------------------------------------------------------------------
+        ** getVolume method:
+        **
+        ** Gets the volume scalar and mute status, of the session or endpoint
+        **----------------------------------------------------------------------
+        */
+        void getVolume(float *fvol, BOOL *mute)
+            {
+            if (g.pEndpointVolume)
+                {
+                g.pEndpointVolume->GetMasterVolumeLevelScalar(fvol);
+                g.pEndpointVolume->GetMute(mute);
+                return;
+                }
+
+            g.pVolumeControl->GetMasterVolume(fvol);
+            g.pVolumeControl->GetMute(mute);
+            }
+
+        /*
+        **----------------------------------------------------------------------
+        ** setVolume method:
+        **
+        ** Sets the volume scalar and mute status, of the session or endpoint
+        **----------------------------------------------------------------------
+        */
+        void setVolume(float fvol, BOOL mute)
+            {
+            if (g.pEndpointVolume)
+                {
+                g.pEndpointVolume->SetMasterVolumeLevelScalar(fvol, &g.guid);
+                g.pEndpointVolume->SetMute(mute, &g.guid);
+                return;
+                }
+
+            g.pVolumeControl->SetMasterVolume(fvol, &g.guid);
+            g.pVolumeControl->SetMute(mute, &g.guid);
+            }
+    };
+
+class DeviceNotifier : public IMMNotificationClient
+    {
+    public:
+        /*
+        **----------------------------------------------------------------------
+        ** DeviceNotifier constructor:
+        **
+        ** A single static instance, never deleted, the count is only kept for
+        ** COM
+        **----------------------------------------------------------------------
+        */
+        DeviceNotifier(void)
+            {
+            refs = 1;
+            }
+
+        ULONG STDMETHODCALLTYPE AddRef(void)
+            {
+            return ++refs;
+            }
+
+        ULONG STDMETHODCALLTYPE Release(void)
+            {
+            return --refs;
+            }
+
+        HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppv)
+            {
+            if (IsEqualIID(riid, __uuidof(IUnknown)) || IsEqualIID(riid, __uuidof(IMMNotificationClient)))
+                {
+                AddRef();
+                *ppv = (IMMNotificationClient *)this;
+                return S_OK;
+                }
+
+            *ppv = NULL;
+            return E_NOINTERFACE;
+            }
+
+        /*
+        **----------------------------------------------------------------------
+        ** OnDefaultDeviceChanged method:
+        **
+        ** The master follows the default console render endpoint, the others
+        ** are of no interest
+        **----------------------------------------------------------------------
+        */
+        HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(EDataFlow flow, ERole role, LPCWSTR id)
+            {
+            if ((flow == eRender) && (role == eConsole))
+                {
+                postDeviceChange();
+                }
+            return S_OK;
+            }
+
+        HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(LPCWSTR id, DWORD state)
+            {
+            return S_OK;
+            }
+
+        HRESULT STDMETHODCALLTYPE OnDeviceAdded(LPCWSTR id)
+            {
+            return S_OK;
+            }
+
+        HRESULT STDMETHODCALLTYPE OnDeviceRemoved(LPCWSTR id)
+            {
+            return S_OK;
+            }
+
+        HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(LPCWSTR id, const PROPERTYKEY key)
+            {
+            return S_OK;
+            }
+
+    private:
+        std::atomic<ULONG> refs;
+    };
+
+//The WASAPI side of endpoints.cpp. Only the default output follows a device
+//change, an --endpoint device stays on the device it was opened on.
+class WasapiBackend : public EndpointBackend
+    {
+    public:
+        std::vector <std::list <Group>> found;      //Streams per endpoint, taken by getGroups and bindEndpoint
+
+        int openEndpoint(int);
+        void enumerateEndpoint(int);
+        void bindEndpoint(int);
+        void applyKnobs(void);
+
+    private:
+        deviceData_t fresh;                         //The new default device, not bound yet
+        int opened = 0;                             //fresh is open
+        std::chrono::steady_clock::time_point t0;   //Start of the switch, for the log
     };
 
 /*
@@ -196,11 +603,48 @@ class Group
 using namespace std;
 list <Group> groupList;                     //Group data
 deviceData_t deviceData;
-
-int cport_nr = 5;                           //Serial port index
-int bdrate = 19200;                         //Baud rate
-int cPortOpen = 0;
-int cPortRxActive = 0;
+IMMDeviceEnumerator *deviceEnumerator = NULL; //Kept for the default device notifications
+DeviceNotifier deviceNotifier;
+vector <deviceData_t> extraEndpoints;       //--endpoint, more endpoints with channels of their own
+atomic<int> deviceChanged(0);               //The default render endpoint changed, set by deviceNotifier
+WasapiBackend wasapiBackend;                //Main thread only, see waitKnobs
+
+mixer_t mixers[MAX_MIXERS];                 //Receivers, each with its own port, link state and channel bank
+uint8_t portSilent[64];                     //Ports that opened but did not answer, skipped until they disappear
+
+txItem_t txStub;                            //MPSC queue feeding the TX worker, lock free for the producers
+atomic<txItem_t *> txHead(&txStub);         //Producers push here
+txItem_t *txTail = &txStub;                 //The TX worker pops here
+mutex txWakeLock;
+condition_variable txWake;
+txLaneStats_t txStats[TX_LANES];            //TX worker only
+
+metrics_t metrics;                          //Written from every thread, read by metricsWrite
+const char *metricsPath = NULL;             //--metrics, Prometheus text file rewritten every sync cycle
+int logLevel = LOG_INFO;                    //--log, messages above this level are not even formatted
+mutex logLock;
+ULONGLONG logStart = GetTickCount64();
+int noCobs = 0;                             //--no-cobs, STX/ETX frames both ways
+int telemetryPeriodMs = 0;                  //--telemetry, how often to ask the receivers for MSGTYPE_TELEMETRY, 0 for never
+uint32_t echoSuppressed = 0;               //Volume updates held back as knob echoes, main thread only
+FILE *captureFile = NULL;                   //--capture, the serial traffic in both directions
+mutex captureLock;                          //Guards the capture state, the TX worker and the RX thread both write
+chrono::steady_clock::time_point captureTime; //Start of the last record written
+chrono::steady_clock::time_point captureRxTime; //Start of the pending RX record
+uint8_t captureRx[CAPTURE_MAX_RECORD];      //Received bytes not written yet
+int captureRxLen = 0;
+uint8_t captureRxFlags = 0;
+char storePath[MAX_PATH] = "";              //--store, the per application preferences and the last layout
+storeHeader_t storeHead;                    //Master part of the last layout
+vector <storeRecord_t> storeRecords;        //Main thread only
+int storeDirty = 0;                         //storeRecords changed since the last storeWrite
+vector <uint8_t> storeHeld;                 //storeRecords a group holds or storeApp handed out this pass, never spare
+int storeShown = 0;                         //Channels shown from the store at startup, not yet reconciled
+
+const deviceCaps_t defaultCaps =            //What a receiver can do, assume everything until it says otherwise
+    {
+    PROTOCOL_VERSION, MAX_METER_LEVELS - 1, 0, 0, 0, 0, { 0xFF, 0xFF, 0xFF, 0xFF }, MAX_DATA_LENGTH, ""
+    };
 
 /*
 **------------------------------------------------------------------------------
@@ -208,15 +652,96 @@ int cPortRxActive = 0;
 **------------------------------------------------------------------------------
 */
 HRESULT initDevice(deviceData_t *);
-int getGroups(IAudioSessionEnumerator *);
+HRESULT openEndpoint(deviceData_t *, const WCHAR *);
+HRESULT findEndpoint(const WCHAR *, IMMDevice **);
+void closeEndpoint(deviceData_t *);
+deviceData_t *endpointData(int);
+void addEndpointGroup(int);
+int getGroups(void);
+void enumerateEndpoint(IAudioSessionEnumerator *, int, list <Group> *);
+void dropDuplicates(void);
 void getLabels(void);
 void sendChannelInfo(int, float);
 void sendMasterInfo(void);
+void sendMeters(int);
+void sendChannelVol(mixer_t *, int, uint16_t, BOOL);
+void sendChannelLabel(mixer_t *, int, const WCHAR *);
+void sendMasterVol(mixer_t *, uint16_t, BOOL);
+void sendMasterIcon(mixer_t *);
+void sendMasterLabel(mixer_t *);
+void sendSnapshot(mixer_t *);
+mixer_t *channelMixer(int, int *);
+void layoutMixers(void);
+void resyncDevice(mixer_t *);
+void linkCheck(void);
+void linkReset(mixer_t *);
+int syncDevice(mixer_t *);
+int findDevices(void);
+int openDevice(int);
+void closeDevice(mixer_t *);
+void trimToFrame(mixer_t *, char *, size_t);
+uint8_t helloVersion(void);
+int connectDevices(void);
+void negotiateBaud(mixer_t *);
+int requestBaud(mixer_t *, uint32_t);
+int probeLink(mixer_t *);
+uint8_t probePattern(uint8_t, int);
+void protocolTxData(mixer_t *, void *, int);
+void protocolTxFrame(mixer_t *, uint8_t, void *, int);
+int protocolEncodeFrame(mixer_t *, uint8_t, void *, int);
+int setLinkBaud(mixer_t *, int);
+void txPush(txItem_t *);
+txItem_t *txPop(void);
+void txWorker(void);
+void txLaneAdd(list <txItem_t *> *, txItem_t *);
+void txSend(txItem_t *);
+int txLane(msgtype_t);
+void printTxStats(void);
+void metricObserve(metricHistogram_t *, chrono::steady_clock::time_point);
+void metricsWrite(void);
+void metricsWriteHistogram(FILE *, const char *, const char *, metricHistogram_t *);
+int captureOpen(const char *);
+void captureData(int, uint8_t, const uint8_t *, int);
+void captureWrite(chrono::steady_clock::time_point, uint8_t, const uint8_t *, int);
+void captureFlush(void);
+int replayCapture(const char *, int);
+const uint8_t *mapFile(const char *, size_t *);
+void unmapFile(const uint8_t *);
+void storeOpen(void);
+void storeWrite(void);
+int storeApp(const WCHAR *);
+int storeHold(int);
+void storePref(const WCHAR *, const WCHAR *);
+void storeLayout(int);
+void storeWiden(WCHAR *, size_t, const char *);
+void sendStoredLayout(void);
+void replayFrame(mixer_t *);
+int benchProtocol(const char *);
+void benchCase(FILE *, const char *, vector <vector <uint8_t>> &, int *);
+void benchFraming(FILE *, const char *, vector <vector <uint8_t>> &, int, int *);
+void benchFrame(vector <vector <uint8_t>> *, msgtype_t, const void *, int);
+const volCurve_t *curveFor(int);
+int knobEcho(ULONGLONG, int, BOOL, int, BOOL);
+void applyKnobs(void);
+void waitKnobs(int);
+void linkSleep(int);
+void linkService(void);
+void telemetryService(void);
+void printTelemetry(mixer_t *, struct msg_telemetry *);
+void linkResend(mixer_t *, txPending_t *);
+void linkDrop(mixer_t *, txPending_t *);
+void linkFlag(mixer_t *, uint16_t);
+void linkAck(mixer_t *, uint8_t);
+void linkNak(mixer_t *, uint8_t);
+int linkRxFrame(mixer_t *, uint8_t);
+void sendAck(mixer_t *, msgtype_t, uint8_t);
 
 serialProtocol_t * allocProtocolBuf(msgtype_t, size_t);
 void freeProtocolBuf(serialProtocol_t **);
 void serialRxCb(void);
-void getCmds(uint8_t *, uint16_t);
+void rxByte(mixer_t *, uint8_t);
+void rxFrame(mixer_t *);
+void getCmds(mixer_t *, uint8_t *, uint16_t);
 void setGroupVolume(int, int, int);
 void setMasterVolume(int, int);
 
@@ -225,7 +750,7 @@ void setMasterVolume(int, int);
 ** Macros
 **------------------------------------------------------------------------------
 */
-#define serialSendBuffer(_dPtr, _dCount)	RS232_SendBuf(cport_nr, _dPtr, _dCount)
+#define serialSendBuffer(_mx, _dPtr, _dCount)	RS232_SendBuf((_mx)->cport_nr, _dPtr, _dCount)
 
 /*
 **------------------------------------------------------------------------------
@@ -270,83 +795,96 @@ BOOL CALLBACK EnumWindowsProcMy(HWND hwnd, LPARAM lParam)
 **------------------------------------------------------------------------------
 ** serialRxCb:
 **
-** Polls the serial port for data
+** Polls all open serial ports for data, one byte from each in turn
 **------------------------------------------------------------------------------
 */
 thread serialRxThread(serialRxCb);
 void serialRxCb(void)
     {
-    RS232_flushRXTX(cport_nr);
-
     uint8_t ch;
-    static int msgLen = 0;
-    static msgState_t msgState = MSGSTATE_IDLE;
-    static uint8_t *msgPtr;
+    int n;
+    mixer_t *mx;
 
     while (true)
         {
-        if (cPortOpen && cPortRxActive)
+        for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
             {
-            if (RS232_PollComport(cport_nr, &ch, 1))
-                {             
-                
-                if (msgLen >= MAX_RXTX_BUFFER_LENGTH)
+            //Set before rxActive is read, closeDevice waits for it to clear
+            mx->rxBusy = 1;
+            if (mx->rxActive)
+                {
+                n = RS232_PollComport(mx->cport_nr, &ch, 1);
+                if (n < 0)
                     {
-                    //Not enough room, stop
-                    msgState = MSGSTATE_IDLE;
-                    msgLen = 0;
+                    //Gone, let the main thread close it and look for it again
+                    mx->rxActive = 0;
+                    mx->lost = 1;
                     }
-
-                switch (ch)
+                else if (n)
                     {
-                    case STX:
-                        //Message starting
-                        msgState = MSGSTATE_ACTIVE;
-                        msgLen = 0;
-                        msgPtr = rxBuffer;
-                        break;
-
-                    case ETX:
-                        //Message ending
-                        if (msgState == MSGSTATE_ACTIVE)
-                            {
-                            if (ctrlChecksum(rxBuffer))
-                                {
-                                getCmds(rxBuffer + 2, msgLen - 2);
-                                }
-                            msgState = MSGSTATE_IDLE;
-                            }
-                        break;
-
-                    case DLE:
-                        //Stuff byte
-                        if (MSGSTATE_ACTIVE)
-                            {
-                            msgState = MSGSTATE_DLE;
-                            }
-                        break;
-
-                    default:
-                        //Copy data
-                        if (msgState == MSGSTATE_DLE)
-                            {
-                            *msgPtr++ = ch ^ DLE;
-                            msgState = MSGSTATE_ACTIVE;
-                            msgLen++;
-                            }
-                        else if (msgState == MSGSTATE_ACTIVE)
-                            {
-                            *msgPtr++ = ch;
-                            msgLen++;
-                            }
-                        break;
+                    metrics.bytesRx++;
+                    if (captureFile)
+                        {
+                        captureData(mx->cport_nr, CAPTURE_RX, &ch, 1);
+                        }
+                    rxByte(mx, ch);
                     }
                 }
+            mx->rxBusy = 0;
             }
         std::this_thread::yield();
         }
     }
 
+/*
+**------------------------------------------------------------------------------
+** rxFrame:
+**
+** Handles a complete frame from the receivers decoder, either framing
+**------------------------------------------------------------------------------
+*/
+void rxFrame(mixer_t *mx)
+    {
+    if (ctrlChecksum(mx->rx.buffer, mx->rx.len))
+        {
+        mx->checksumErrors = 0;
+        metrics.framesRx[mx->rx.buffer[3] % MAX_MSGTYPES]++;
+        if (mx->replay)
+            {
+            replayFrame(mx);
+            }
+        else if (linkRxFrame(mx, mx->rx.buffer[2]))
+            {
+            getCmds(mx, mx->rx.buffer + 3, getLe16(mx->rx.buffer));
+            }
+        }
+    else
+        {
+        metrics.checksumErrors++;
+        if (++mx->checksumErrors >= LINK_MAX_CHECKSUM_ERRORS)
+            {
+            //The link is not holding up, the main thread owns the baud rate
+            mx->baudFallback = 1;
+            mx->checksumErrors = 0;
+            }
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** rxByte:
+**
+** Runs one received byte through the receivers frame decoder
+**------------------------------------------------------------------------------
+*/
+void rxByte(mixer_t *mx, uint8_t ch)
+    {
+    if (decodeByte(&mx->rx, ch))
+        {
+        rxFrame(mx);
+        }
+    }
+
 /*
 **------------------------------------------------------------------------------
 ** Main function
@@ -356,26 +894,154 @@ int _tmain(int argc, _TCHAR* argv[])
     {
     HRESULT hr;
 
-    double newVolume;
     int groupCount = 0;
 
     int i = 0;
-    char mode[] = { '8','N','1',0 };
-    char str[2][512];
+    char replayPath[MAX_PATH] = "";
+    int replayFast = 0;
+    char benchPath[MAX_PATH] = "";
+    int bench = 0;
+    vector <int> prefArgs;
+    vector <int> endpointArgs;
+    int firstCycle = 1;
+
+    for (int a = 1; a < argc; a++)
+        {
+        if (!_tcscmp(argv[a], _T("--telemetry")))
+            {
+            //Seconds between reports, default 1
+            telemetryPeriodMs = 1000 * (((a + 1) < argc) ? _tstoi(argv[++a]) : 1);
+            }
+        else if (!_tcscmp(argv[a], _T("--metrics")) && ((a + 1) < argc))
+            {
+            static char path[MAX_PATH];
+            size_t numconv;
+            wcstombs_s(&numconv, path, argv[++a], _countof(path) - 1);
+            metricsPath = path;
+            }
+        else if (!_tcscmp(argv[a], _T("--log")) && ((a + 1) < argc))
+            {
+            const _TCHAR *levels[LOG_LEVELS] = { _T("error"), _T("warn"), _T("info"), _T("debug") };
+            a++;
+            for (int l = 0; l < LOG_LEVELS; l++)
+                {
+                if (!_tcscmp(argv[a], levels[l]))
+                    {
+                    logLevel = l;
+                    }
+                }
+            }
+        else if (!_tcscmp(argv[a], _T("--capture")) && ((a + 1) < argc))
+            {
+            char path[MAX_PATH];
+            size_t numconv;
+            wcstombs_s(&numconv, path, argv[++a], _countof(path) - 1);
+            captureOpen(path);
+            }
+        else if (!_tcscmp(argv[a], _T("--replay")) && ((a + 1) < argc))
+            {
+            size_t numconv;
+            wcstombs_s(&numconv, replayPath, argv[++a], _countof(replayPath) - 1);
+            }
+        else if (!_tcscmp(argv[a], _T("--fast")))
+            {
+            replayFast = 1;
+            }
+        else if (!_tcscmp(argv[a], _T("--no-cobs")))
+            {
+            noCobs = 1;
+            }
+        else if (!_tcscmp(argv[a], _T("--store")) && ((a + 1) < argc))
+            {
+            size_t numconv;
+            wcstombs_s(&numconv, storePath, argv[++a], _countof(storePath) - 1);
+            }
+        else if (!_tcscmp(argv[a], _T("--endpoint")) && ((a + 1) < argc))
+            {
+            //Opened once COM is up
+            endpointArgs.push_back(++a);
+            }
+        else if (!_tcscmp(argv[a], _T("--pref")) && ((a + 2) < argc))
+            {
+            //Applied once the store is read
+            prefArgs.push_back(a);
+            a += 2;
+            }
+        else if (!_tcscmp(argv[a], _T("--bench")))
+            {
+            //Results to stdout unless a file is given
+            size_t numconv;
+            bench = 1;
+            if (((a + 1) < argc) && _tcsncmp(argv[a + 1], _T("--"), 2))
+                {
+                wcstombs_s(&numconv, benchPath, argv[++a], _countof(benchPath) - 1);
+                }
+            }
+        }
 
-    if (RS232_OpenComport(cport_nr, bdrate, mode))
+    //Benchmark the protocol and quit
+    if (bench)
         {
-        printf("Can not open serial port\n");
+        return benchProtocol(benchPath[0] ? benchPath : NULL);
         }
-    else
+
+    //Replay a capture and quit, no receiver or audio device needed
+    if (replayPath[0])
+        {
+        return replayCapture(replayPath, replayFast);
+        }
+
+    storeOpen();
+    for (size_t p = 0; p < prefArgs.size(); p++)
         {
-        printf("Serial port %d opened\n", cport_nr + 1);
-        cPortOpen = 1;
+        storePref(argv[prefArgs[p] + 1], argv[prefArgs[p] + 2]);
+        }
+    storeWrite();
 
-        Sleep(2000); //Wait for the arduino to reset
+    //Look for the receivers, linkCheck syncs them and keeps looking for more
+    if (!findDevices())
+        {
+        logMsg(LOG_WARN, "no_receiver", "");
         }
 
+    //Show what was there last time while the sessions are enumerated
+    sendStoredLayout();
+
     hr = initDevice(&deviceData);
+    if (FAILED(hr))
+        {
+        //Nothing to mix without the default output device
+        logMsg(LOG_ERROR, "no_audio_device", "hr=0x%08lx", (unsigned long)hr);
+        if (deviceEnumerator)
+            {
+            deviceEnumerator->UnregisterEndpointNotificationCallback(&deviceNotifier);
+            deviceEnumerator->Release();
+            }
+        for (i = 0; i < MAX_MIXERS; i++)
+            {
+            if (mixers[i].state != MIXER_FREE)
+                {
+                closeDevice(&mixers[i]);
+                }
+            }
+        CoUninitialize();
+        return 1;
+        }
+
+    for (size_t e = 0; e < endpointArgs.size(); e++)
+        {
+        deviceData_t dev;
+
+        memset(&dev, 0, sizeof(dev));
+        if (FAILED(openEndpoint(&dev, argv[endpointArgs[e]])))
+            {
+            logMsg(LOG_WARN, "endpoint_not_found", "name=\"%S\"", argv[endpointArgs[e]]);
+            continue;
+            }
+        extraEndpoints.push_back(dev);
+        addEndpointGroup(extraEndpoints.size());
+        logMsg(LOG_INFO, "endpoint", "index=%d name=\"%S\"", (int)extraEndpoints.size(), dev.deviceName);
+        }
       
 
     //Enter main loop
@@ -385,23 +1051,34 @@ int _tmain(int argc, _TCHAR* argv[])
         sendMasterInfo();
                 
         //Get data and list info about streams		
-        groupCount = getGroups(deviceData.pSessionEnumerator);
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        groupCount = getGroups();
+        metricObserve(&metrics.enumerate, t0);
 
+        t0 = chrono::steady_clock::now();
         getLabels();
+        metricObserve(&metrics.labels, t0);
+        storeLayout(firstCycle);
+        firstCycle = 0;
+        metricsWrite();
+        storeWrite();
+        captureFlush();
 
-
-        int channelIx = 0;
         for (int i = 0; i < groupCount; i++)
             {
             sendChannelInfo(i, -1);
             }
 
-        Sleep(2000);
-
-        if (cPortOpen)
+        //Stream the peak meters until the next sync cycle
+        for (int t = 0; t < SYNC_PERIOD_MS; t += METER_PERIOD_MS)
             {
-            cPortRxActive = 1;
+            sendMeters(groupCount);
+            linkService();
+            linkCheck();
+            telemetryService();
+            waitKnobs(METER_PERIOD_MS);
             }
+
         }
 
     //Let the controls remain active for another keypress
@@ -412,14 +1089,37 @@ int _tmain(int argc, _TCHAR* argv[])
         {
         // Master volume
         sendMasterInfo();
-        Sleep(2000);
+        metricsWrite();
+        captureFlush();
+        for (int t = 0; t < SYNC_PERIOD_MS; t += METER_PERIOD_MS)
+            {
+            linkService();
+            linkCheck();
+            telemetryService();
+            waitKnobs(METER_PERIOD_MS);
+            }
         }
 
+    printTxStats();
+    captureFlush();
+    storeWrite();
+
     //Clean up
-    deviceData.pEndpointVolume->Release();
-    deviceData.pSessionEnumerator->Release();        
+    deviceEnumerator->UnregisterEndpointNotificationCallback(&deviceNotifier);
+    deviceEnumerator->Release();
+    closeEndpoint(&deviceData);
+    for (size_t e = 0; e < extraEndpoints.size(); e++)
+        {
+        closeEndpoint(&extraEndpoints[e]);
+        }
 
-    RS232_CloseComport(cport_nr);
+    for (i = 0; i < MAX_MIXERS; i++)
+        {
+        if (mixers[i].state != MIXER_FREE)
+            {
+            closeDevice(&mixers[i]);
+            }
+        }
 
     CoUninitialize();
     return 0;
@@ -430,25 +1130,56 @@ int _tmain(int argc, _TCHAR* argv[])
 **------------------------------------------------------------------------------
 ** initDevice:
 **
-** Initializes the audio endpoint
+** Initializes COM and the audio endpoint, and asks to be told when the user
+** picks another default device. The main thread joins the multithreaded
+** apartment, the enumerateEndpoint workers join it too, so the interfaces
+** they get are used here without marshalling.
 **------------------------------------------------------------------------------
 */
 HRESULT initDevice(deviceData_t *dev)
     {
     HRESULT hr;
 
+    CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL, CLSCTX_ALL, __uuidof(IMMDeviceEnumerator), (LPVOID *)&deviceEnumerator);
+    if (FAILED(hr))
+        {
+        return hr;
+        }
+
+    hr = deviceEnumerator->RegisterEndpointNotificationCallback(&deviceNotifier);
+    if (FAILED(hr))
+        {
+        logMsg(LOG_WARN, "device_notify_failed", "hr=0x%08lx", (unsigned long)hr);
+        }
+
+    return openEndpoint(dev, NULL);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** openEndpoint:
+**
+** Gets the volume control, peak meter, name and session enumerator of an
+** endpoint, see findEndpoint
+**------------------------------------------------------------------------------
+*/
+HRESULT openEndpoint(deviceData_t *dev, const WCHAR *spec)
+    {
+    HRESULT hr;
+
     /*
     **--------------------------------------------------------------------------
     ** Get the device instance
     **--------------------------------------------------------------------------
     */
-    CoInitialize(NULL);
-    IMMDeviceEnumerator *deviceEnumerator = NULL;
-    hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL, CLSCTX_ALL, __uuidof(IMMDeviceEnumerator), (LPVOID *)&deviceEnumerator);
     IMMDevice *defaultDevice = NULL;
-    hr = deviceEnumerator->GetDefaultAudioEndpoint(eRender, eConsole, &defaultDevice);
-    deviceEnumerator->Release(); //Enumerator is no longer needed
-    deviceEnumerator = NULL;
+    hr = findEndpoint(spec, &defaultDevice);
+    if (FAILED(hr))
+        {
+        //No such device, e.g. the last output was unplugged
+        return hr;
+        }
 
     /*
     **--------------------------------------------------------------------------
@@ -458,6 +1189,14 @@ HRESULT initDevice(deviceData_t *dev)
     dev->pEndpointVolume = NULL;
     hr = defaultDevice->Activate(__uuidof(IAudioEndpointVolume), CLSCTX_ALL, NULL, (LPVOID *)&dev->pEndpointVolume);
 
+    /*
+    **--------------------------------------------------------------------------
+    ** Get the peak meter
+    **--------------------------------------------------------------------------
+    */
+    dev->pMeter = NULL;
+    hr = defaultDevice->Activate(__uuidof(IAudioMeterInformation), CLSCTX_ALL, NULL, (LPVOID *)&dev->pMeter);
+
     /*
     **--------------------------------------------------------------------------
     ** Get the device name
@@ -500,88 +1239,392 @@ HRESULT initDevice(deviceData_t *dev)
 
     pSessionManager->Release();
 
-    dev->prevVolume = NAN;
+    dev->prevVolume = -1;
     dev->prevMute = -1;
+    dev->knobTime = 0;
 
     return S_OK;
     }
 
 /*
 **------------------------------------------------------------------------------
-** getGroups:
+** findEndpoint:
 **
-** Gets all streams and groups them up per guid
+** Finds an endpoint: the default render endpoint for NULL, the default capture
+** endpoint for "mic", else the first active endpoint, render or capture, with
+** spec in its name. The case is ignored.
 **------------------------------------------------------------------------------
 */
-int getGroups(IAudioSessionEnumerator *pEnumerator)
+HRESULT findEndpoint(const WCHAR *spec, IMMDevice **device)
     {
+    IMMDeviceCollection *collection = NULL;
+    WCHAR want[MAX_PATH];
     HRESULT hr;
-    int currentStreamCount = 0;
+    UINT count = 0;
+    size_t i;
 
-    hr = pEnumerator->GetCount(&currentStreamCount);
+    if (!spec)
+        {
+        return deviceEnumerator->GetDefaultAudioEndpoint(eRender, eConsole, device);
+        }
 
-    printf("Current number of streams %d\n", currentStreamCount);
+    if (!_wcsicmp(spec, L"mic"))
+        {
+        return deviceEnumerator->GetDefaultAudioEndpoint(eCapture, eConsole, device);
+        }
+
+    for (i = 0; spec[i] && (i + 1 < _countof(want)); i++)
+        {
+        want[i] = towlower(spec[i]);
+        }
+    want[i] = '\0';
+
+    hr = deviceEnumerator->EnumAudioEndpoints(eAll, DEVICE_STATE_ACTIVE, &collection);
+    if (FAILED(hr))
+        {
+        return hr;
+        }
+    collection->GetCount(&count);
+
+    hr = E_FAIL;
+    for (UINT d = 0; (d < count) && FAILED(hr); d++)
+        {
+        IMMDevice *candidate = NULL;
+        IPropertyStore *pProps = NULL;
+        PROPVARIANT varName;
+        WCHAR name[MAX_PATH] = L"";
+
+        if (FAILED(collection->Item(d, &candidate)))
+            {
+            continue;
+            }
+
+        PropVariantInit(&varName);
+        if (SUCCEEDED(candidate->OpenPropertyStore(STGM_READ, &pProps)) && SUCCEEDED(pProps->GetValue(PKEY_Device_FriendlyName, &varName)))
+            {
+            for (i = 0; varName.pwszVal[i] && (i + 1 < _countof(name)); i++)
+                {
+                name[i] = towlower(varName.pwszVal[i]);
+                }
+            name[i] = '\0';
+            }
+        PropVariantClear(&varName);
+        if (pProps)
+            {
+            pProps->Release();
+            }
+
+        if (wcsstr(name, want))
+            {
+            *device = candidate;
+            hr = S_OK;
+            }
+        else
+            {
+            candidate->Release();
+            }
+        }
+
+    collection->Release();
+    return hr;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** endpointData:
+**
+** Returns the endpoint a group belongs to
+**------------------------------------------------------------------------------
+*/
+deviceData_t *endpointData(int endpoint)
+    {
+    return endpoint ? &extraEndpoints[endpoint - 1] : &deviceData;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** addEndpointGroup:
+**
+** Adds a channel for the volume of a whole endpoint, e.g. a mic mute knob.
+** It is labeled with the endpoint name and never goes away.
+**------------------------------------------------------------------------------
+*/
+void addEndpointGroup(int endpoint)
+    {
+    deviceData_t *dev = endpointData(endpoint);
+    Group group;
+
+    group.g.endpoint = endpoint;
+    group.g.pEndpointVolume = dev->pEndpointVolume;
+    group.g.pEndpointVolume->AddRef();
+    group.g.pMeter = dev->pMeter;
+    if (group.g.pMeter)
+        {
+        group.g.pMeter->AddRef();
+        }
+    wcscpy_s(group.g.prettyName, dev->deviceName);
+
+    groupList.push_back(group);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** closeEndpoint:
+**
+** Releases what openEndpoint got
+**------------------------------------------------------------------------------
+*/
+void closeEndpoint(deviceData_t *dev)
+    {
+    dev->pEndpointVolume->Release();
+    if (dev->pMeter)
+        {
+        dev->pMeter->Release();
+        }
+    dev->pSessionEnumerator->Release();
+    }
+
+/*
+**------------------------------------------------------------------------------
+** WasapiBackend::openEndpoint:
+**
+** Opens the new default endpoint next to the bound one, see switchEndpoint
+**------------------------------------------------------------------------------
+*/
+int WasapiBackend::openEndpoint(int endpoint)
+    {
+    t0 = chrono::steady_clock::now();
+    opened = 0;
+
+    memset(&fresh, 0, sizeof(fresh));
+    if (endpoint || FAILED(::openEndpoint(&fresh, NULL)))
+        {
+        logMsg(LOG_WARN, "device_switch_failed", "");
+        return 0;
+        }
+
+    opened = 1;
+    if (found.empty())
+        {
+        found.resize(1);
+        }
+    return 1;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** WasapiBackend::enumerateEndpoint:
+**
+** Gets the sessions of an endpoint, of the new default one before anything is
+** replaced. Runs on a worker of enumerateEndpoints, which fills only its own
+** list in found.
+**------------------------------------------------------------------------------
+*/
+void WasapiBackend::enumerateEndpoint(int endpoint)
+    {
+    ::enumerateEndpoint((opened && !endpoint) ? fresh.pSessionEnumerator : endpointData(endpoint)->pSessionEnumerator, endpoint, &found[endpoint]);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** WasapiBackend::bindEndpoint:
+**
+** Moves the master and the channels over to the new default endpoint. Its
+** sessions are labeled before anything is replaced, then every channel that
+** still shows the same thing keeps its change tracking so only the
+** differences are sent. Main thread only.
+**------------------------------------------------------------------------------
+*/
+void WasapiBackend::bindEndpoint(int endpoint)
+    {
+    vector <Group> shown(groupList.begin(), groupList.end());
+    list <Group> old;
+    list <Group>::iterator grp;
+    list <Group>::iterator next;
+    int count;
+    int ch;
+
+    if (!opened || endpoint)
+        {
+        return;
+        }
+    opened = 0;
+
+    //The sessions of the new endpoint replace those of the old one, the other
+    //endpoints stay. Laid out like the last cycle.
+    for (grp = groupList.begin(); grp != groupList.end(); grp = next)
+        {
+        next = grp;
+        next++;
+        if (!(*grp).g.endpoint)
+            {
+            old.splice(old.end(), groupList, grp);
+            }
+        }
+    groupList.splice(groupList.end(), found[0]);
+    dropDuplicates();
+    count = groupList.size();
+    getLabels();
+    storeShown = shown.size();
+    storeLayout(1);
+
+    //Channels that still show the same thing keep their change tracking
+    for (grp = groupList.begin(), ch = 0; (grp != groupList.end()) && (ch < (int)shown.size()); grp++, ch++)
+        {
+        if (!(*grp).g.endpoint && !wcscmp((*grp).g.prettyName, shown[ch].g.prettyName))
+            {
+            (*grp).g.prevVolume = shown[ch].g.prevVolume;
+            (*grp).g.prevMute = shown[ch].g.prevMute;
+            (*grp).g.update = false;
+            }
+        }
+
+    fresh.prevVolume = deviceData.prevVolume;
+    fresh.prevMute = deviceData.prevMute;
+    fresh.update = (wcscmp(fresh.deviceName, deviceData.deviceName) != 0);
+
+    for (grp = old.begin(); grp != old.end(); grp++)
+        {
+        (*grp).freeAll();
+        }
+    closeEndpoint(&deviceData);
+    deviceData = fresh;
+
+    logMsg(LOG_INFO, "device_switch", "name=\"%S\" groups=%d ms=%d", deviceData.deviceName, count,
+        (int)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0).count());
+
+    sendMasterInfo();
+    for (int i = 0; i < count; i++)
+        {
+        sendChannelInfo(i, -1);
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** WasapiBackend::applyKnobs:
+**------------------------------------------------------------------------------
+*/
+void WasapiBackend::applyKnobs(void)
+    {
+    ::applyKnobs();
+    }
+
+/*
+**------------------------------------------------------------------------------
+** postDeviceChange:
+**
+** Hands a default device change from the notification thread to the main
+** thread, waking it up if it is waiting for knobs
+**------------------------------------------------------------------------------
+*/
+void postDeviceChange(void)
+    {
+    wakeKnobs(&deviceChanged);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** getGroups:
+**
+** Gets all streams of all endpoints and groups them up per endpoint and guid.
+** The session managers are asked in parallel, see enumerateEndpoints, the
+** groups are added in endpoint order.
+**------------------------------------------------------------------------------
+*/
+int getGroups(void)
+    {
+    int endpoints = 1 + extraEndpoints.size();
+
+    wasapiBackend.found.resize(endpoints);
+    enumerateEndpoints(&wasapiBackend, endpoints);
+
+    for (int e = 0; e < endpoints; e++)
+        {
+        groupList.splice(groupList.end(), wasapiBackend.found[e]);
+        }
+    dropDuplicates();
+
+    logMsg(LOG_DEBUG, "groups", "count=%d", (int)groupList.size());
+
+    return groupList.size();
+    }
+
+/*
+**------------------------------------------------------------------------------
+** enumerateEndpoint:
+**
+** Gets the streams of one endpoint. Runs on a worker of enumerateEndpoints that
+** joins the multithreaded apartment of the main thread, see initDevice. The
+** apartment lives as long as the main thread is in it, so the interfaces in
+** found stay valid after the worker leaves.
+**------------------------------------------------------------------------------
+*/
+void enumerateEndpoint(IAudioSessionEnumerator *pEnumerator, int endpoint, list <Group> *found)
+    {
+    HRESULT co;
+    int currentStreamCount = 0;
+
+    //S_FALSE on the main thread, which is in the apartment already
+    co = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+    pEnumerator->GetCount(&currentStreamCount);
+
+    logMsg(LOG_DEBUG, "streams", "endpoint=%d count=%d", endpoint, currentStreamCount);
 
-    //Get guids of all streams    
+    //Get guids of all streams
     for (int i = 0; i < currentStreamCount; i++)
         {
         Group group;
 
         //Get guid, sessioncontrol, sessioncontrol2, etc...
+        group.g.endpoint = endpoint;
         group.getSessionData(pEnumerator, i);
 
         //Add to the list
-        groupList.push_back(group);
+        found->push_back(group);
         }
 
-    //Find stream groups
+    if (SUCCEEDED(co))
+        {
+        CoUninitialize();
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** dropDuplicates:
+**
+** Keeps the first group of every endpoint and guid, the streams of a group
+** after it and the ones found again by a later enumeration are freed
+**------------------------------------------------------------------------------
+*/
+void dropDuplicates(void)
+    {
     list <Group>::iterator grp;
     list <Group>::iterator cmp;
-    int dupe = 0;
 
-    //Iterate through the list of streams
-    for (grp = groupList.begin(); grp != groupList.end(); grp++, dupe++)
+    for (grp = groupList.begin(); grp != groupList.end(); grp++)
         {
-        //Compare grp to all other list items, except null guids
-        for (cmp = groupList.begin(); cmp != groupList.end(); cmp++)
+        if ((*grp).g.guid == GUID_NULL)
             {
-            if (((*cmp).g.guid != GUID_NULL) && (cmp != grp) && IsEqualGUID((*grp).g.guid, (*cmp).g.guid))
-                {
-                //Mark the duplicate
-                (*cmp).duplicate = dupe;
-                }
+            //Endpoint channels and streams without a group
+            continue;
             }
-        }
 
-    //Get rid of the dupes
-    for (grp = groupList.begin(); grp != groupList.end(); grp++)
-        {
-        dupe = (*grp).duplicate;
-        if (dupe >= 0)
+        for (cmp = grp, cmp++; cmp != groupList.end(); )
             {
-            cmp = grp;
-
-            for (cmp++; cmp != groupList.end(); cmp++)
+            if (((*cmp).g.endpoint == (*grp).g.endpoint) && IsEqualGUID((*grp).g.guid, (*cmp).g.guid))
                 {
-                if ((*cmp).duplicate == dupe)
-                    {
-                    //Free memory occupied by the duplicate list item
-                    (*cmp).freeAll();
-
-                    //Remove the duplicate list item
-                    groupList.erase(cmp);
-
-                    //cmp is now invalid, so restart at grp+1
-                    cmp = grp;
-                    cmp++;
-                    }
+                (*cmp).freeAll();
+                cmp = groupList.erase(cmp);
+                }
+            else
+                {
+                cmp++;
                 }
             }
         }
-
-    printf("Current number of groups %d\n", groupList.size());
-
-    return groupList.size();
     }
 
 /*
@@ -597,111 +1640,146 @@ void getLabels(void)
     int label;
     list <Group>::iterator grp;
 
-    //Find the groups that fo not have a good label already
+    //A record a group holds is not spare, storeApp adds the ones it hands out
+    storeHeld.assign(storeRecords.size(), 0);
     for (grp = groupList.begin(); grp != groupList.end(); grp++)
         {
-        label = 0;
-        if (!wcscmp((*grp).g.displayName, L""))
+        if ((*grp).g.app >= 0)
             {
-            OLECHAR* guidString;
-            StringFromCLSID((*grp).g.guid, &guidString);
-
-            printf("Group %S has no label", guidString);
-
-            CoTaskMemFree(guidString);
+            storeHeld[(*grp).g.app] = 1;
             }
-        else
-            {
-
-            OLECHAR* guidString;
-            StringFromCLSID((*grp).g.guid, &guidString);
-
-            printf("Group %S has a label: \"%S\"", guidString, (*grp).g.displayName);
+        }
 
-            CoTaskMemFree(guidString);
+    //Find the groups that fo not have a good label already
+    for (grp = groupList.begin(); grp != groupList.end(); grp++)
+        {
+        WCHAR prevName[_countof((*grp).g.prettyName)];
+        wcscpy_s(prevName, (*grp).g.prettyName);
 
-            wcscpy_s((*grp).g.prettyName, _countof((*grp).g.prettyName), (*grp).g.displayName);
-            label = 1;
+        //Only for the log line
+        WCHAR exeName[256] = L"";
+        WCHAR windowText[MAX_PATH] = L"";
 
-            if (wcsstr((*grp).g.prettyName, L"AudioSrv.Dll") != NULL)
-                {
-                wsprintfW((*grp).g.prettyName, L"System Sounds");
-                }
+        if ((*grp).g.pEndpointVolume)
+            {
+            //A whole endpoint, it goes by its name
+            wcscpy_s((*grp).g.prettyName, _countof((*grp).g.prettyName), endpointData((*grp).g.endpoint)->deviceName);
+            wcsncpy_s(exeName, _countof(exeName), (*grp).g.prettyName, _TRUNCATE);
             }
-
-        //Get process id
-        DWORD pid;
-        hr = (*grp).g.pSessionControl2->GetProcessId(&pid);
-
-        //Get imagename
-        HANDLE Handle = OpenProcess(
-            PROCESS_QUERY_INFORMATION | PROCESS_VM_READ,
-            FALSE,
-            pid
-        );
-        if (Handle)
+        else
             {
-            WCHAR Buffer[MAX_PATH];
-            if (GetProcessImageFileNameW(Handle, Buffer, _countof(Buffer)))
+            label = 0;
+            if (wcscmp((*grp).g.displayName, L""))
                 {
+                wcscpy_s((*grp).g.prettyName, _countof((*grp).g.prettyName), (*grp).g.displayName);
+                label = 1;
 
-                //WCHAR label[MAX_PATH];
-                //hr = GetWindowText((HWND)Handle, label, _countof(label));
-                // At this point, buffer contains the full path to the executable
-                //printf("%S, ", Buffer);
-
-                wchar_t *res_p;
-                TCHAR fullpath[MAX_PATH];
-                res_p = _wfullpath(fullpath, Buffer, _countof(fullpath));
-
-                //printf("%S, ", fullpath);
-
-                TCHAR drive[3];
-                TCHAR dir[256];
-                TCHAR fname[256];
-                TCHAR ext[256];
-                _tsplitpath_s(
-                    fullpath,
-                    drive,
-                    _countof(drive),
-                    dir,
-                    _countof(dir),
-                    fname,
-                    _countof(fname),
-                    ext,
-                    _countof(ext));
-                printf(", executable name: \"%S\"", fname);
-
-                if (wcslen(fname) && !label)
+                if (wcsstr((*grp).g.prettyName, L"AudioSrv.Dll") != NULL)
                     {
-                    wcscpy_s((*grp).g.prettyName, _countof((*grp).g.prettyName), fname);
-                    memset(fname, 0, sizeof(fname));
+                    wsprintfW((*grp).g.prettyName, L"System Sounds");
                     }
+                }
 
-                if (!EnumWindows(EnumWindowsProcMy, pid))
+            //Get process id
+            DWORD pid;
+            hr = (*grp).g.pSessionControl2->GetProcessId(&pid);
+
+            //Get imagename
+            HANDLE Handle = OpenProcess(
+                PROCESS_QUERY_INFORMATION | PROCESS_VM_READ,
+                FALSE,
+                pid
+            );
+            if (Handle)
+                {
+                WCHAR Buffer[MAX_PATH];
+                if (GetProcessImageFileNameW(Handle, Buffer, _countof(Buffer)))
                     {
-                    if (GetWindowText(g_HWND, Buffer, _countof(Buffer)))
+
+                    //WCHAR label[MAX_PATH];
+                    //hr = GetWindowText((HWND)Handle, label, _countof(label));
+                    // At this point, buffer contains the full path to the executable
+                    //printf("%S, ", Buffer);
+
+                    wchar_t *res_p;
+                    TCHAR fullpath[MAX_PATH];
+                    res_p = _wfullpath(fullpath, Buffer, _countof(fullpath));
+
+                    //printf("%S, ", fullpath);
+
+                    TCHAR drive[3];
+                    TCHAR dir[256];
+                    TCHAR fname[256];
+                    TCHAR ext[256];
+                    _tsplitpath_s(
+                        fullpath,
+                        drive,
+                        _countof(drive),
+                        dir,
+                        _countof(dir),
+                        fname,
+                        _countof(fname),
+                        ext,
+                        _countof(ext));
+                    wcscpy_s(exeName, fname);
+
+                    if (wcslen(fname) && !label)
+                        {
+                        wcscpy_s((*grp).g.prettyName, _countof((*grp).g.prettyName), fname);
+                        memset(fname, 0, sizeof(fname));
+                        }
+
+                    if (!EnumWindows(EnumWindowsProcMy, pid))
                         {
-                        printf(", window text: \"%S\"", Buffer);
-                        if (wcslen(Buffer))
+                        if (GetWindowText(g_HWND, Buffer, _countof(Buffer)))
                             {
-                            wcscpy_s((*grp).g.prettyName, _countof((*grp).g.prettyName), Buffer);
-                            memset(Buffer, 0, sizeof(Buffer));
+                            wcscpy_s(windowText, Buffer);
+                            if (wcslen(Buffer))
+                                {
+                                wcscpy_s((*grp).g.prettyName, _countof((*grp).g.prettyName), Buffer);
+                                memset(Buffer, 0, sizeof(Buffer));
+                                }
                             }
                         }
                     }
+                else
+                    {
+                    // You better call GetLastError() here
+                    }
+                CloseHandle(Handle);
                 }
-            else
-                {
-                // You better call GetLastError() here
-                }
-            CloseHandle(Handle);
             }
 
-        (*grp).g.update = true;
+        //A custom label from the store wins
+        if (exeName[0])
+            {
+            (*grp).g.app = storeApp(exeName);
+            }
+        if (((*grp).g.app >= 0) && storeRecords[(*grp).g.app].label[0])
+            {
+            storeWiden((*grp).g.prettyName, _countof((*grp).g.prettyName), storeRecords[(*grp).g.app].label);
+            }
+        (*grp).g.curve = curveFor((*grp).g.app);
+
+        //Only resend when the label changed, lost frames are handled by the link
+        if (wcscmp(prevName, (*grp).g.prettyName))
+            {
+            (*grp).g.update = true;
+            }
 
-        printf(", prettyName: \"%S\"", (*grp).g.prettyName);
-        printf("\n");
+        if (logLevel >= LOG_DEBUG)
+            {
+            OLECHAR* guidString;
+            StringFromCLSID((*grp).g.guid, &guidString);
+            logMsg(LOG_DEBUG, "label", "endpoint=%d guid=%S displayName=\"%S\" exe=\"%S\" window=\"%S\" prettyName=\"%S\"",
+                (*grp).g.endpoint,
+                guidString,
+                (*grp).g.displayName ? (*grp).g.displayName : L"",
+                exeName,
+                windowText,
+                (*grp).g.prettyName);
+            CoTaskMemFree(guidString);
+            }
         }
     }
 
@@ -709,18 +1787,23 @@ void getLabels(void)
 **------------------------------------------------------------------------------
 ** sendChannelInfo:
 **
-** Sends the specified channel information to the receiver
+** Sends the specified channel information to the receiver showing it
 **------------------------------------------------------------------------------
 */
 void sendChannelInfo(int ch, float masterVolume)
     {
-    size_t numconv;
-    char charName[64+1];
-    uint8_t vol;
+    uint16_t vol;
     BOOL mute;
     float fvol;
-    serialProtocol_t *msg;
-    int chnum = ch;
+    int chnum;
+    mixer_t *mx;
+
+    mx = channelMixer(ch, &chnum);
+    if (!mx)
+        {
+        //No hardware for this one
+        return;
+        }
 
     list <Group>::iterator i;
     for (i = groupList.begin(); ch; i++, ch--)
@@ -728,14 +1811,20 @@ void sendChannelInfo(int ch, float masterVolume)
         //do nothing
         }
 
-    (*i).g.pVolumeControl->GetMasterVolume(&fvol);
-    if (fvol != (*i).g.prevVolume)
+    (*i).getVolume(&fvol, &mute);
+    vol = curveFine((*i).g.curve, fvol);
+    if (knobEcho((*i).g.knobTime, (*i).g.prevVolume, (*i).g.prevMute, vol, mute))
+        {
+        //Checked again once the knob has settled
+        return;
+        }
+
+    if (vol != (*i).g.prevVolume)
         {
         (*i).g.update = true;
-        (*i).g.prevVolume = fvol;
+        (*i).g.prevVolume = vol;
         }
 
-    (*i).g.pVolumeControl->GetMute(&mute);
     if (mute != (*i).g.prevMute)
         {
         (*i).g.update = true;
@@ -746,193 +1835,2910 @@ void sendChannelInfo(int ch, float masterVolume)
         {
         (*i).g.update = false;
 
-        vol = fvol * 100;
-        if (masterVolume >= 0.0)
+        if (masterVolume >= 0.0)
+            {
+            vol *= masterVolume;
+            }
+
+        sendChannelVol(mx, chnum, vol, mute);
+        sendChannelLabel(mx, chnum, (*i).g.prettyName);
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** sendChannelVol:
+**
+** Sends a channel volume, 0..VOL_FINE_MAX, and mute status. Receivers without
+** MSGTYPE_SET_VOL_FINE get it rounded to whole percents.
+**------------------------------------------------------------------------------
+*/
+void sendChannelVol(mixer_t *mx, int chnum, uint16_t vol, BOOL mute)
+    {
+    serialProtocol_t *msg;
+
+    if (capsHasMsg(mx->caps.msgTypes, MSGTYPE_SET_VOL_FINE))
+        {
+        msg = allocProtocolBuf(MSGTYPE_SET_VOL_FINE, sizeof(struct msg_set_vol_fine));
+        msg->msg_set_vol_fine.channel = chnum;
+        putLe16(msg->msg_set_vol_fine.volVal, vol);
+        msg->msg_set_vol_fine.muteStatus = mute;
+        protocolTxData(mx, msg, sizeof(struct msg_set_vol_fine));
+        freeProtocolBuf(&msg);
+        return;
+        }
+
+    msg = allocProtocolBuf(MSGTYPE_SET_CHANNEL_VOL_PREC, sizeof(struct msg_set_channel_vol_prec));
+    msg->msg_set_channel_vol_prec.channel = chnum;
+    msg->msg_set_channel_vol_prec.volVal = (vol + 5) / 10;
+    msg->msg_set_channel_vol_prec.muteStatus = mute;
+    protocolTxData(mx, msg, sizeof(struct msg_set_channel_vol_prec));
+    freeProtocolBuf(&msg);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** sendChannelLabel:
+**
+** Sends a channel label
+**------------------------------------------------------------------------------
+*/
+void sendChannelLabel(mixer_t *mx, int chnum, const WCHAR *name)
+    {
+    char charName[MAX_PATH];
+    serialProtocol_t *msg;
+    size_t fit = labelFit(mx->caps.channelWidth);
+
+    if (!capsHasMsg(mx->caps.msgTypes, MSGTYPE_SET_CHANNEL_LABEL))
+        {
+        return;
+        }
+
+    strncpy_s(charName, sizeof(charName), labelCp437(name).c_str(), _TRUNCATE);
+    shortenLabel(charName, fit);
+    trimToFrame(mx, charName, sizeof(struct msg_set_channel_label));
+
+    metrics.labelsSent++;
+    if (fit && (strlen(charName) > fit))
+        {
+        metrics.labelsScrolling++;
+        }
+
+    int len = sizeof(struct msg_set_channel_label) + strlen(charName) + 1;
+    msg = allocProtocolBuf(MSGTYPE_SET_CHANNEL_LABEL, len);
+    msg->msg_set_channel_label.channel = chnum;
+    memcpy_s(msg->msg_set_channel_label.str, strlen(charName) + 1, charName, strlen(charName) + 1);
+    msg->msg_set_channel_label.strLen = strlen(charName);
+
+    protocolTxData(mx, msg, len);
+    freeProtocolBuf(&msg);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** sendMasterInfo:
+**
+** Sends the audio endpoint master volume to all receivers
+**------------------------------------------------------------------------------
+*/
+void sendMasterInfo(void)
+    {
+    BOOL mute;
+    float fvol;    
+    mixer_t *mx;
+
+    deviceData.pEndpointVolume->GetMasterVolumeLevelScalar(&fvol);    
+    deviceData.pEndpointVolume->GetMute(&mute);
+    if (knobEcho(deviceData.knobTime, deviceData.prevVolume, deviceData.prevMute, volFine(fvol), mute))
+        {
+        //Checked again once the knob has settled
+        return;
+        }
+
+    if ((volFine(fvol) != deviceData.prevVolume) || (mute != deviceData.prevMute))
+        {
+        logMsg(LOG_DEBUG, "master_volume", "scalar=%f mute=%d", fvol, mute);
+        deviceData.update = true;
+        deviceData.prevVolume = volFine(fvol);
+        deviceData.prevMute = mute;
+        }
+
+    if (deviceData.update)
+        {
+        deviceData.update = false;
+
+        for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+            {
+            if (mx->state == MIXER_ACTIVE)
+                {
+                sendMasterVol(mx, volFine(fvol), mute);
+                sendMasterIcon(mx);
+                sendMasterLabel(mx);
+                }
+            }
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** sendMasterVol:
+**
+** Sends the master volume, 0..VOL_FINE_MAX, and mute status
+**------------------------------------------------------------------------------
+*/
+void sendMasterVol(mixer_t *mx, uint16_t vol, BOOL mute)
+    {
+    serialProtocol_t *msg;
+
+    if (capsHasMsg(mx->caps.msgTypes, MSGTYPE_SET_VOL_FINE))
+        {
+        msg = allocProtocolBuf(MSGTYPE_SET_VOL_FINE, sizeof(struct msg_set_vol_fine));
+        msg->msg_set_vol_fine.channel = VOL_FINE_MASTER;
+        putLe16(msg->msg_set_vol_fine.volVal, vol);
+        msg->msg_set_vol_fine.muteStatus = mute;
+        protocolTxData(mx, msg, sizeof(struct msg_set_vol_fine));
+        freeProtocolBuf(&msg);
+        return;
+        }
+
+    msg = allocProtocolBuf(MSGTYPE_SET_MASTER_VOL_PREC, sizeof(struct msg_set_master_vol_prec));
+    msg->msg_set_master_vol_prec.volVal = (vol + 5) / 10;
+    msg->msg_set_master_vol_prec.muteStatus = mute;
+    protocolTxData(mx, msg, sizeof(struct msg_set_master_vol_prec));
+    freeProtocolBuf(&msg);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** sendMasterIcon:
+**
+** Sends the master icon
+**------------------------------------------------------------------------------
+*/
+void sendMasterIcon(mixer_t *mx)
+    {
+    serialProtocol_t *msg;
+
+    if (!capsHasMsg(mx->caps.msgTypes, MSGTYPE_SET_MASTER_ICON))
+        {
+        return;
+        }
+
+    int size = sizeof(struct msg_set_master_icon) + sizeof(corsair);
+    msg = allocProtocolBuf(MSGTYPE_SET_MASTER_ICON, size);
+    memcpy(msg->msg_set_master_icon.icon, corsair, sizeof(corsair));
+    protocolTxData(mx, msg, size);
+    freeProtocolBuf(&msg);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** sendMasterLabel:
+**
+** Sends the master label, the endpoint name
+**------------------------------------------------------------------------------
+*/
+void sendMasterLabel(mixer_t *mx)
+    {
+    char charName[MAX_PATH];
+    serialProtocol_t *msg;
+    size_t fit;
+
+    if (!capsHasMsg(mx->caps.msgTypes, MSGTYPE_SET_MASTER_LABEL))
+        {
+        return;
+        }
+
+    //The app icon shares the first text line
+    fit = labelFit(mx->caps.masterWidth - (capsHasMsg(mx->caps.msgTypes, MSGTYPE_SET_MASTER_ICON) ? MASTER_ICON_PX : 0));
+
+    strncpy_s(charName, sizeof(charName), labelCp437(deviceData.deviceName).c_str(), _TRUNCATE);
+    shortenLabel(charName, fit);
+    trimToFrame(mx, charName, sizeof(struct msg_set_master_label));
+
+    metrics.labelsSent++;
+    if (fit && (strlen(charName) > fit))
+        {
+        metrics.labelsScrolling++;
+        }
+
+    int len = sizeof(struct msg_set_master_label) + strlen(charName) + 1;
+    msg = allocProtocolBuf(MSGTYPE_SET_MASTER_LABEL, len);
+    memcpy_s(msg->msg_set_master_label.str, strlen(charName) + 1, charName, strlen(charName) + 1);
+    msg->msg_set_master_label.strLen = strlen(charName);
+
+    protocolTxData(mx, msg, len);
+    freeProtocolBuf(&msg);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** sendSnapshot:
+**
+** Sends the full state after the receiver lost it. The volumes go first so the
+** knobs are usable right away, then the labels and last the icon. The change
+** tracking is left alone, the other receivers still need their updates.
+**------------------------------------------------------------------------------
+*/
+void sendSnapshot(mixer_t *mx)
+    {
+    BOOL mute;
+    float fvol;
+    int ch;
+    list <Group>::iterator first;
+    list <Group>::iterator i;
+
+    deviceData.pEndpointVolume->GetMasterVolumeLevelScalar(&fvol);
+    deviceData.pEndpointVolume->GetMute(&mute);
+    sendMasterVol(mx, volFine(fvol), mute);
+
+    //Skip to the channel bank of this receiver
+    for (first = groupList.begin(), ch = 0; (first != groupList.end()) && (ch < mx->chBase); first++, ch++)
+        {
+        //do nothing
+        }
+
+    for (i = first, ch = 0; (i != groupList.end()) && (ch < mx->caps.numChannels); i++, ch++)
+        {
+        (*i).getVolume(&fvol, &mute);
+        sendChannelVol(mx, ch, curveFine((*i).g.curve, fvol), mute);
+        }
+
+    sendMasterLabel(mx);
+
+    for (i = first, ch = 0; (i != groupList.end()) && (ch < mx->caps.numChannels); i++, ch++)
+        {
+        sendChannelLabel(mx, ch, (*i).g.prettyName);
+        }
+
+    sendMasterIcon(mx);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** channelMixer:
+**
+** Finds the receiver showing a group, and the channel it is shown on there.
+** Returns NULL if no receiver has room for it.
+**------------------------------------------------------------------------------
+*/
+mixer_t *channelMixer(int ch, int *chnum)
+    {
+    mixer_t *mx;
+
+    for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+        {
+        if ((mx->state == MIXER_ACTIVE) && (ch >= mx->chBase) && (ch < mx->chBase + mx->caps.numChannels))
+            {
+            *chnum = ch - mx->chBase;
+            return mx;
+            }
+        }
+
+    return NULL;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** layoutMixers:
+**
+** Hands out the groups to the receivers in port order, each gets as many as
+** it has channels. If the layout changed everything is sent again.
+**------------------------------------------------------------------------------
+*/
+void layoutMixers(void)
+    {
+    mixer_t *mx;
+    mixer_t *next;
+    int base = 0;
+    int prevPort = -1;
+    int changed = 0;
+
+    while (true)
+        {
+        //Next receiver in port order
+        next = NULL;
+        for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+            {
+            if ((mx->state == MIXER_ACTIVE) && (mx->cport_nr > prevPort) && (!next || (mx->cport_nr < next->cport_nr)))
+                {
+                next = mx;
+                }
+            }
+
+        if (!next)
+            {
+            break;
+            }
+
+        if (next->chBase != base)
+            {
+            next->chBase = base;
+            changed = 1;
+            }
+        logMsg(LOG_INFO, "layout", "port=%d first=%d last=%d", next->cport_nr + 1, base, base + next->caps.numChannels - 1);
+
+        base += next->caps.numChannels;
+        prevPort = next->cport_nr;
+        }
+
+    if (changed)
+        {
+        deviceData.update = true;
+
+        list <Group>::iterator i;
+        for (i = groupList.begin(); i != groupList.end(); i++)
+            {
+            (*i).g.update = true;
+            }
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** sendMeters:
+**
+** Samples the master and channel peak meters and sends them to each receiver as
+** one packed frame, one byte per channel. Nothing is sent to a receiver if
+** none of its levels changed.
+**------------------------------------------------------------------------------
+*/
+void sendMeters(int groupCount)
+    {
+    uint8_t master;
+    uint8_t levels[MAX_METER_LEVELS];
+    int count;
+    int ch;
+    float peak;
+    mixer_t *mx;
+    serialProtocol_t *msg;
+    list <Group>::iterator i;
+
+    peak = 0;
+    if (deviceData.pMeter)
+        {
+        deviceData.pMeter->GetPeakValue(&peak);
+        }
+    master = (uint8_t)(peak * 100 + 0.5f);
+
+    for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+        {
+        if ((mx->state != MIXER_ACTIVE) || !capsHasMsg(mx->caps.msgTypes, MSGTYPE_SET_METERS))
+            {
+            continue;
+            }
+
+        count = 0;
+        levels[count++] = master;
+
+        for (i = groupList.begin(), ch = 0; (i != groupList.end()) && (ch < mx->chBase); i++, ch++)
+            {
+            //do nothing
+            }
+
+        for ( ; (i != groupList.end()) && (ch < groupCount) && (count <= mx->caps.numChannels) && (count < MAX_METER_LEVELS); i++, ch++)
+            {
+            peak = 0;
+            if ((*i).g.pMeter)
+                {
+                (*i).g.pMeter->GetPeakValue(&peak);
+                }
+            levels[count++] = (uint8_t)(peak * 100 + 0.5f);
+            }
+
+        if ((count == mx->prevCount) && !memcmp(levels, mx->prevLevels, count))
+            {
+            continue;
+            }
+        memcpy(mx->prevLevels, levels, count);
+        mx->prevCount = count;
+
+        int len = sizeof(struct msg_set_meters) + count;
+        msg = allocProtocolBuf(MSGTYPE_SET_METERS, len);
+        msg->msg_set_meters.count = count;
+        memcpy(msg->msg_set_meters.level, levels, count);
+        protocolTxData(mx, msg, len);
+        freeProtocolBuf(&msg);
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** trimToFrame:
+**
+** Cuts a label so that the message fits the receivers largest frame
+**------------------------------------------------------------------------------
+*/
+void trimToFrame(mixer_t *mx, char *str, size_t header)
+    {
+    size_t room = (mx->caps.maxData > header + 1) ? mx->caps.maxData - header - 1 : 0;
+
+    if (strlen(str) > room)
+        {
+        str[room] = 0;
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** helloVersion:
+**
+** The protocol version put in HELLO. With --no-cobs it is the last one before
+** PROTOCOL_COBS, so the receiver does not send COBS frames either.
+**------------------------------------------------------------------------------
+*/
+uint8_t helloVersion(void)
+    {
+    return noCobs ? PROTOCOL_COBS - 1 : PROTOCOL_VERSION;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** connectDevices:
+**
+** Says HELLO to all receivers waiting to connect until they answer with their
+** capabilities. The arduino resets when the port is opened, so this returns as
+** soon as all of them are up. A receiver that does not answer is closed, and
+** remembered as silent if it was found by a port scan.
+** Returns the number of receivers that answered.
+**------------------------------------------------------------------------------
+*/
+int connectDevices(void)
+    {
+    serialProtocol_t *msg;
+    ULONGLONG start = GetTickCount64();
+    mixer_t *mx;
+    int waiting;
+    int connected = 0;
+
+    //A HELLO without HELLO_KEEPALIVE starts a new session on the receiver
+    msg = allocProtocolBuf(MSGTYPE_HELLO, sizeof(struct msg_hello));
+    msg->msg_hello.protoVersion = helloVersion();
+    msg->msg_hello.flags = 0;
+
+    for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+        {
+        if (mx->state == MIXER_CONNECTING)
+            {
+            mx->capsReply = 0;
+            }
+        }
+
+    do
+        {
+        waiting = 0;
+        for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+            {
+            if ((mx->state == MIXER_CONNECTING) && !mx->capsReply)
+                {
+                protocolTxData(mx, msg, sizeof(struct msg_hello));
+                waiting++;
+                }
+            }
+
+        for (int t = 0; (t < HELLO_PERIOD_MS) && waiting; t++)
+            {
+            linkSleep(1);
+            }
+        } while (waiting && (GetTickCount64() - start < CONNECT_TIMEOUT_MS));
+
+    freeProtocolBuf(&msg);
+
+    for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+        {
+        if (mx->state != MIXER_CONNECTING)
+            {
+            continue;
+            }
+
+        if (!mx->capsReply)
+            {
+            if (mx->probing)
+                {
+                portSilent[mx->cport_nr] = 1;
+                }
+            else
+                {
+                logMsg(LOG_WARN, "no_answer", "port=%d", mx->cport_nr + 1);
+                }
+            closeDevice(mx);
+            continue;
+            }
+
+        logMsg(LOG_INFO, "connected", "build=\"%s\" port=%d ms=%d protocol=%d channels=%d master=%dx%d channel=%dx%d",
+            mx->caps.build,
+            mx->cport_nr + 1,
+            (int)(GetTickCount64() - start),
+            mx->caps.protoVersion,
+            mx->caps.numChannels,
+            mx->caps.masterWidth,
+            mx->caps.masterHeight,
+            mx->caps.channelWidth,
+            mx->caps.channelHeight);
+
+        mx->state = MIXER_ACTIVE;
+        mx->probing = 0;
+        connected++;
+        }
+
+    return connected;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** linkCheck:
+**
+** Keeps the links alive with a HELLO every LINK_KEEPALIVE_MS. Resyncs a
+** receiver when it reports STATE_LOST, or when it has not answered for a
+** while, e.g. after a reset left it at the default baud rate. Drops a link to
+** the default rate when the RX thread has seen too many checksum errors.
+** Closes the ports that are gone and scans for receivers every
+** DISCOVERY_PERIOD_MS. Every connected receiver that is not synced yet, from
+** startup or from a scan, gets the baud rate and the full state here.
+**------------------------------------------------------------------------------
+*/
+void linkCheck(void)
+    {
+    static ULONGLONG scanTime = 0;
+    static ULONGLONG lostTime = 0;
+    ULONGLONG now = GetTickCount64();
+    ULONGLONG caps;
+    serialProtocol_t *msg;
+    mixer_t *mx;
+    int layout = 0;
+
+    for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+        {
+        if (mx->state != MIXER_ACTIVE)
+            {
+            continue;
+            }
+
+        //A resync of an earlier receiver can take seconds, the RX thread kept
+        //stamping CAPS meanwhile
+        now = GetTickCount64();
+        caps = mx->capsTime;
+
+        if (mx->lost)
+            {
+            logMsg(LOG_WARN, "port_lost", "port=%d", mx->cport_nr + 1);
+            closeDevice(mx);
+            lostTime = now;
+            layout = 1;
+            continue;
+            }
+
+        if (mx->baudFallback)
+            {
+            //Go back to the safe rate, the receiver does the same on its own
+            mx->baudFallback = 0;
+            if (mx->bdrate != LINK_DEFAULT_BAUD)
+                {
+                logMsg(LOG_WARN, "baud_fallback", "port=%d baud=%d reason=checksum_errors", mx->cport_nr + 1, LINK_DEFAULT_BAUD);
+                setLinkBaud(mx, LINK_DEFAULT_BAUD);
+                mx->bdrate = LINK_DEFAULT_BAUD;
+                }
+            }
+
+        if (mx->resyncRequest)
+            {
+            logMsg(LOG_INFO, "resync", "port=%d reason=state_lost", mx->cport_nr + 1);
+            resyncDevice(mx);
+            layout |= (mx->state != MIXER_ACTIVE);
+            continue;
+            }
+
+        if ((now > caps) && (now - caps > LINK_KEEPALIVE_TIMEOUT_MS))
+            {
+            logMsg(LOG_WARN, "resync", "port=%d reason=keepalive_timeout", mx->cport_nr + 1);
+            resyncDevice(mx);
+            layout |= (mx->state != MIXER_ACTIVE);
+            continue;
+            }
+
+        if (now - mx->helloTime >= LINK_KEEPALIVE_MS)
+            {
+            mx->helloTime = now;
+            msg = allocProtocolBuf(MSGTYPE_HELLO, sizeof(struct msg_hello));
+            msg->msg_hello.protoVersion = helloVersion();
+            msg->msg_hello.flags = HELLO_KEEPALIVE;
+            protocolTxData(mx, msg, sizeof(struct msg_hello));
+            freeProtocolBuf(&msg);
+            }
+        }
+
+    if (layout)
+        {
+        layoutMixers();
+        }
+
+    //There is no hotplug notification, the scan picks up ports that came or went
+    if (now - scanTime >= DISCOVERY_PERIOD_MS)
+        {
+        findDevices();
+        scanTime = GetTickCount64();
+        }
+
+    for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+        {
+        if ((mx->state != MIXER_ACTIVE) || mx->synced || (GetTickCount64() - mx->syncTime < DISCOVERY_PERIOD_MS))
+            {
+            continue;
+            }
+
+        if (syncDevice(mx) && lostTime)
+            {
+            logMsg(LOG_INFO, "reconnected", "port=%d ms_since_loss=%d", mx->cport_nr + 1, (int)(GetTickCount64() - lostTime));
+            }
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** linkReset:
+**
+** Drops the sequencing state, whatever was in flight or queued belongs to the
+** old session. openDevice and resyncDevice both start here.
+**------------------------------------------------------------------------------
+*/
+void linkReset(mixer_t *mx)
+    {
+    lock_guard<mutex> lock(mx->lock);
+
+    mx->session++;
+
+    for (int i = 0; i < LINK_TX_WINDOW; i++)
+        {
+        mx->txPending[i].seq = 0;
+        }
+    mx->txDropped.clear();
+    mx->stateAcked = 0;
+    mx->rxWindow = { 0 };
+    mx->prevCount = 0;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** resyncDevice:
+**
+** Starts the link over from the default baud rate and sends the full state.
+** Closes the port if the receiver does not answer, so linkCheck looks for it.
+**------------------------------------------------------------------------------
+*/
+void resyncDevice(mixer_t *mx)
+    {
+    mx->resyncRequest = 0;
+    metrics.resyncs++;
+
+    linkReset(mx);
+
+    if (mx->bdrate != LINK_DEFAULT_BAUD)
+        {
+        setLinkBaud(mx, LINK_DEFAULT_BAUD);
+        mx->bdrate = LINK_DEFAULT_BAUD;
+        }
+    RS232_flushRX(mx->cport_nr);
+
+    mx->state = MIXER_CONNECTING;
+    if (!connectDevices())
+        {
+        return;
+        }
+
+    syncDevice(mx);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** syncDevice:
+**
+** Raises the baud rate and sends the full state to a receiver that answered
+** HELLO. The only place the rate is negotiated, see linkCheck and
+** resyncDevice. Logs the time until the receiver has ACKed all of it.
+** Returns 1 if everything was ACKed.
+**------------------------------------------------------------------------------
+*/
+int syncDevice(mixer_t *mx)
+    {
+    ULONGLONG start = GetTickCount64();
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    int pending;
+
+    if (capsHasMsg(mx->caps.msgTypes, MSGTYPE_SET_BAUD))
+        {
+        negotiateBaud(mx);
+        }
+
+    sendSnapshot(mx);
+
+    do
+        {
+        linkSleep(1);
+        linkService();
+
+        lock_guard<mutex> lock(mx->lock);
+        pending = 0;
+        for (int i = 0; i < LINK_TX_WINDOW; i++)
+            {
+            pending += (mx->txPending[i].seq != 0);
+            }
+        pending += mx->txQueued;
+        } while (pending && (GetTickCount64() - start < CONNECT_TIMEOUT_MS * 2));
+
+    metricObserve(&metrics.sync, t0);
+    logMsg(LOG_INFO, "synced", "port=%d ms=%d acked=%d", mx->cport_nr + 1, (int)(GetTickCount64() - start), !pending);
+
+    mx->synced = !pending;
+    mx->syncTime = GetTickCount64();
+    return mx->synced;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** findDevices:
+**
+** Looks for new receivers on the ports of the comports table that exist. All
+** candidates are opened and greeted at once, and the layout is redone for the
+** ones that answered. They stay at the default baud rate until linkCheck
+** syncs them.
+** Returns the number of receivers found.
+**------------------------------------------------------------------------------
+*/
+int findDevices(void)
+    {
+    int port;
+    int found;
+
+    for (port = 0; port < RS232_GetPortCount(); port++)
+        {
+        openDevice(port);
+        }
+
+    found = connectDevices();
+    if (!found)
+        {
+        return 0;
+        }
+
+    layoutMixers();
+
+    return found;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** openDevice:
+**
+** Opens a port in a free receiver slot, ready for connectDevices. Skips the
+** ports in use and the silent ones, a silent port is tried again once it has
+** disappeared and come back. Returns 1 if the port was opened.
+**------------------------------------------------------------------------------
+*/
+int openDevice(int port)
+    {
+    char mode[] = { '8','N','1',0 };
+    mixer_t *mx;
+    mixer_t *slot = NULL;
+
+    if (port >= _countof(portSilent))
+        {
+        return 0;
+        }
+
+    if (!RS232_PortExists(port))
+        {
+        portSilent[port] = 0;
+        return 0;
+        }
+
+    if (portSilent[port])
+        {
+        return 0;
+        }
+
+    for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+        {
+        if (mx->state == MIXER_FREE)
+            {
+            slot = slot ? slot : mx;
+            }
+        else if (mx->cport_nr == port)
+            {
+            return 0;
+            }
+        }
+
+    if (!slot)
+        {
+        return 0;
+        }
+
+    if (RS232_OpenComport(port, LINK_DEFAULT_BAUD, mode))
+        {
+        //In use by someone else or no access, no need to try every scan
+        portSilent[port] = 1;
+        return 0;
+        }
+
+    slot->cport_nr = port;
+    slot->bdrate = LINK_DEFAULT_BAUD;
+    slot->probing = 1;
+    slot->synced = 0;
+    slot->syncTime = 0;
+    slot->chBase = -1;
+    slot->caps = defaultCaps;
+    decodeReset(&slot->rx);
+    slot->checksumErrors = 0;
+    slot->capsTime = GetTickCount64();
+    slot->txCobs = 0;
+    slot->resyncRequest = 0;
+    slot->baudFallback = 0;
+    slot->helloTime = 0;
+    slot->lost = 0;
+    linkReset(slot);
+    slot->state = MIXER_CONNECTING;
+
+    //Talk to the arduino as soon as it is out of reset
+    slot->rxActive = 1;
+
+    return 1;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** closeDevice:
+**
+** Stops the RX thread polling the port, closes it and frees the slot. Frames
+** still queued for it are dropped by the TX worker.
+**------------------------------------------------------------------------------
+*/
+void closeDevice(mixer_t *mx)
+    {
+    //Once rxBusy is seen clear, the RX thread has left the port and sees rxActive clear
+    mx->rxActive = 0;
+    while (mx->rxBusy)
+        {
+        this_thread::yield();
+        }
+
+    lock_guard<mutex> lock(mx->lock);
+    RS232_CloseComport(mx->cport_nr);
+    mx->lost = 0;
+    mx->state = MIXER_FREE;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** negotiateBaud:
+**
+** Steps the link up through LINK_BAUD_RATES and stays at the highest rate that
+** passes the probe test. Starts above the current rate, a link that is up
+** already is not stepped down. See serial_protocol.md for the sequence.
+**------------------------------------------------------------------------------
+*/
+void negotiateBaud(mixer_t *mx)
+    {
+    uint32_t rate;
+
+    for (int r = 0; r < _countof(LINK_BAUD_RATES); r++)
+        {
+        rate = LINK_BAUD_RATES[r];
+        if (rate <= (uint32_t)mx->bdrate)
+            {
+            continue;
+            }
+
+        //Ask at the current rate, the MCU switches after answering
+        if (!requestBaud(mx, rate))
+            {
+            break;
+            }
+
+        if (setLinkBaud(mx, rate))
+            {
+            //Not supported here, let the MCU time out and revert
+            linkSleep(LINK_BAUD_CONFIRM_MS * 2);
+            break;
+            }
+
+        //Probe the new rate and confirm it
+        if (probeLink(mx) && requestBaud(mx, rate))
+            {
+            mx->bdrate = rate;
+            continue;
+            }
+
+        //Not good enough, go back and let the MCU time out and revert
+        setLinkBaud(mx, mx->bdrate);
+        linkSleep(LINK_BAUD_CONFIRM_MS * 2);
+        RS232_flushRX(mx->cport_nr);
+        break;
+        }
+
+    //Checksum errors while switching rates are expected
+    mx->baudFallback = 0;
+
+    logMsg(LOG_INFO, "baud", "port=%d baud=%d", mx->cport_nr + 1, mx->bdrate);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** requestBaud:
+**
+** Sends a baud rate request, returns 1 if the receiver accepted the rate
+**------------------------------------------------------------------------------
+*/
+int requestBaud(mixer_t *mx, uint32_t rate)
+    {
+    serialProtocol_t *msg;
+
+    mx->baudReply = 0;
+
+    msg = allocProtocolBuf(MSGTYPE_SET_BAUD, sizeof(struct msg_set_baud));
+    putLe32(msg->msg_set_baud.baud, rate);
+    protocolTxData(mx, msg, sizeof(struct msg_set_baud));
+    freeProtocolBuf(&msg);
+
+    for (int t = 0; (t < LINK_REPLY_TIMEOUT_MS) && !mx->baudReply; t++)
+        {
+        linkSleep(1);
+        }
+
+    return (mx->baudReply == rate);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** probeLink:
+**
+** Sends LINK_PROBE_COUNT probes one at a time and counts the correct echoes.
+** Returns 1 if the link is good enough to use.
+**------------------------------------------------------------------------------
+*/
+int probeLink(mixer_t *mx)
+    {
+    serialProtocol_t *msg;
+    int errors = 0;
+    int len = sizeof(struct msg_link_probe) + LINK_PROBE_LENGTH;
+
+    msg = allocProtocolBuf(MSGTYPE_LINK_PROBE, len);
+
+    for (int seq = 0; (seq < LINK_PROBE_COUNT) && (errors <= LINK_PROBE_MAX_ERRORS); seq++)
+        {
+        msg->msg_link_probe.seq = seq;
+        for (int i = 0; i < LINK_PROBE_LENGTH; i++)
+            {
+            msg->msg_link_probe.pattern[i] = probePattern(seq, i);
+            }
+
+        mx->probeReply = -1;
+        protocolTxData(mx, msg, len);
+
+        int t;
+        for (t = 0; (t < LINK_REPLY_TIMEOUT_MS) && (mx->probeReply != seq); t++)
+            {
+            linkSleep(1);
+            }
+
+        if (t >= LINK_REPLY_TIMEOUT_MS)
+            {
+            errors++;
+            }
+        }
+
+    freeProtocolBuf(&msg);
+
+    return (errors <= LINK_PROBE_MAX_ERRORS);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** probePattern:
+**
+** Probe payload, walks through all byte values, reserved symbols included
+**------------------------------------------------------------------------------
+*/
+uint8_t probePattern(uint8_t seq, int ix)
+    {
+    return (uint8_t)(seq * 31 + ix * 7);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** allocProtocolBuf:
+**
+** Allocates memory for the specified message
+**------------------------------------------------------------------------------
+*/
+serialProtocol_t * allocProtocolBuf(msgtype_t msgType, size_t bytes)
+    {
+    serialProtocol_t *blockPtr = 0;
+
+    blockPtr = (serialProtocol_t*)malloc(bytes);
+
+    blockPtr->msgType = msgType;
+
+    return blockPtr;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** freeProtocolBuf:
+**
+** Frees up a previously allocated buffer
+**------------------------------------------------------------------------------
+*/
+void freeProtocolBuf(serialProtocol_t **blockBtr)
+    {
+    free(*blockBtr);
+    *blockBtr = NULL;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** protocolTxData:
+**
+** Hands a message for a receiver to the TX worker. Safe to call from any
+** thread, it does not block.
+**------------------------------------------------------------------------------
+*/
+void protocolTxData(mixer_t *mx, void *dataPtr, int dataLength)
+    {
+    uint8_t *data = (uint8_t *)dataPtr;
+    txItem_t *item = new txItem_t;
+
+    item->mx = mx;
+    item->session = mx->session;
+    item->lane = txLane(data[0]);
+    item->retries = 0;
+    item->len = dataLength;
+    memcpy_s(item->data, sizeof(item->data), dataPtr, dataLength);
+
+    //Channel messages carry the channel in the first data byte. Only state and
+    //meters are replaced by newer frames, link control is sent as is.
+    item->key = data[0] << 8;
+    if ((data[0] == MSGTYPE_SET_CHANNEL_VOL_PREC) || (data[0] == MSGTYPE_SET_CHANNEL_LABEL) || (data[0] == MSGTYPE_SET_VOL_FINE))
+        {
+        item->key |= data[1];
+        }
+    else if (!msgSequenced(data[0]) && (data[0] != MSGTYPE_SET_METERS))
+        {
+        item->key = 0xFFFF;
+        }
+
+    mx->txQueued++;
+    txPush(item);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** txLane:
+**
+** Picks the lane for a message type, the knobs must not wait for an icon
+**------------------------------------------------------------------------------
+*/
+int txLane(msgtype_t msgType)
+    {
+    switch (msgType)
+        {
+        case MSGTYPE_SET_MASTER_LABEL:
+        case MSGTYPE_SET_CHANNEL_LABEL:
+            return TX_LANE_LABEL;
+
+        case MSGTYPE_SET_MASTER_ICON:
+        case MSGTYPE_SET_METERS:
+        case MSGTYPE_TELEMETRY:
+            return TX_LANE_BULK;
+
+        default:
+            return TX_LANE_VOLUME;
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** txPush:
+**
+** Adds a frame to the TX queue and wakes the worker. Lock free, any number of
+** threads may push.
+**------------------------------------------------------------------------------
+*/
+void txPush(txItem_t *item)
+    {
+    item->queuedAt = chrono::steady_clock::now();
+    item->next.store(NULL, memory_order_relaxed);
+
+    txItem_t *prev = txHead.exchange(item, memory_order_acq_rel);
+    prev->next.store(item, memory_order_release);
+
+    if (item != &txStub)
+        {
+        txWake.notify_one();
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** txPop:
+**
+** Takes the oldest frame off the TX queue, TX worker only. Returns NULL if the
+** queue is empty, or if a push is half way done, the worker comes back for it.
+**------------------------------------------------------------------------------
+*/
+txItem_t *txPop(void)
+    {
+    txItem_t *tail = txTail;
+    txItem_t *next = tail->next.load(memory_order_acquire);
+
+    if (tail == &txStub)
+        {
+        if (!next)
+            {
+            return NULL;
+            }
+        txTail = next;
+        tail = next;
+        next = next->next.load(memory_order_acquire);
+        }
+
+    if (next)
+        {
+        txTail = next;
+        return tail;
+        }
+
+    if (tail != txHead.load(memory_order_acquire))
+        {
+        return NULL;
+        }
+
+    //Last one, put the stub back behind it so it can be taken
+    txPush(&txStub);
+    next = tail->next.load(memory_order_acquire);
+    if (next)
+        {
+        txTail = next;
+        return tail;
+        }
+
+    return NULL;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** txWorker:
+**
+** The only thread writing to the serial ports. Drains the queue into the
+** lanes, then sends one frame from the most urgent lane and drains again, so a
+** knob update never waits for more than the frame on the wire.
+**------------------------------------------------------------------------------
+*/
+thread txThread(txWorker);
+void txWorker(void)
+    {
+    list <txItem_t *> lanes[TX_LANES];
+    txItem_t *item;
+    int lane;
+
+    while (true)
+        {
+        while ((item = txPop()) != NULL)
+            {
+            txLaneAdd(&lanes[item->lane], item);
+            }
+
+        for (lane = 0; (lane < TX_LANES) && lanes[lane].empty(); lane++)
+            {
+            //do nothing
+            }
+
+        if (lane == TX_LANES)
+            {
+            unique_lock<mutex> lock(txWakeLock);
+            txWake.wait_for(lock, chrono::milliseconds(TX_IDLE_WAIT_MS));
+            continue;
+            }
+
+        item = lanes[lane].front();
+        lanes[lane].pop_front();
+        txSend(item);
+
+        chrono::microseconds waited = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - item->queuedAt);
+        txStats[lane].frames++;
+        txStats[lane].totalUs += waited.count();
+        txStats[lane].maxUs = max(txStats[lane].maxUs, (uint32_t)waited.count());
+
+        item->mx->txQueued--;
+        delete item;
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** txLaneAdd:
+**
+** Queues a frame in its lane. A frame still waiting for the same receiver and
+** key is superseded, the new one takes its place in the line.
+**------------------------------------------------------------------------------
+*/
+void txLaneAdd(list <txItem_t *> *lane, txItem_t *item)
+    {
+    list <txItem_t *>::iterator i;
+
+    if (item->key != 0xFFFF)
+        {
+        for (i = lane->begin(); i != lane->end(); i++)
+            {
+            if (((*i)->mx == item->mx) && ((*i)->key == item->key))
+                {
+                txStats[item->lane].coalesced++;
+                item->queuedAt = (*i)->queuedAt;
+                item->mx->txQueued--;
+                delete *i;
+                *i = item;
+                return;
+                }
+            }
+        }
+
+    lane->push_back(item);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** txSend:
+**
+** Puts a frame on the wire. State messages get a sequence number and are kept
+** until ACKed, replacing any older frame for the same channel.
+**------------------------------------------------------------------------------
+*/
+void txSend(txItem_t *item)
+    {
+    mixer_t *mx = item->mx;
+    txPending_t *slot = NULL;
+    int i;
+
+    lock_guard<mutex> lock(mx->lock);
+
+    if ((mx->state == MIXER_FREE) || (item->session != mx->session))
+        {
+        //Closed, reused for another port or resynced while the frame was waiting
+        return;
+        }
+
+    if (!msgSequenced(item->data[0]))
+        {
+        protocolTxFrame(mx, 0, item->data, item->len);
+        return;
+        }
+
+    //Replace a frame for the same key, else take a free slot, else the oldest
+    for (i = 0; i < LINK_TX_WINDOW; i++)
+        {
+        if (mx->txPending[i].seq && (mx->txPending[i].key == item->key))
+            {
+            slot = &mx->txPending[i];
+            break;
+            }
+
+        if (!slot || (slot->seq && (!mx->txPending[i].seq || (mx->txPending[i].sentAt < slot->sentAt))))
+            {
+            slot = &mx->txPending[i];
+            }
+        }
+
+    if (slot->seq && (slot->key != item->key))
+        {
+        //Window full, the oldest frame is sent again from the next sync cycle
+        logMsg(LOG_WARN, "tx_window_full", "port=%d type=%d", mx->cport_nr + 1, slot->key >> 8);
+        linkDrop(mx, slot);
+        }
+
+    slot->key = item->key;
+    slot->retries = item->retries;
+    slot->len = item->len;
+    memcpy_s(slot->data, sizeof(slot->data), item->data, item->len);
+
+    mx->txSeq = seqNext(mx->txSeq);
+    slot->seq = mx->txSeq;
+    slot->sentAt = GetTickCount64();
+    protocolTxFrame(mx, slot->seq, slot->data, slot->len);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** setLinkBaud:
+**
+** Changes the port baud rate between two frames. Returns 0 on success.
+**------------------------------------------------------------------------------
+*/
+int setLinkBaud(mixer_t *mx, int rate)
+    {
+    lock_guard<mutex> lock(mx->lock);
+
+    return RS232_SetBaudrate(mx->cport_nr, rate);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** printTxStats:
+**
+** Prints the TX lane statistics, how long frames waited to go on the wire, and
+** how many knob echoes were held back
+**------------------------------------------------------------------------------
+*/
+void printTxStats(void)
+    {
+    const char *names[TX_LANES] = { "volume", "label", "bulk" };
+
+    for (int lane = 0; lane < TX_LANES; lane++)
+        {
+        printf("TX lane %-6s: %u frames, %u superseded, wait avg %.2f ms, max %.2f ms\n",
+            names[lane],
+            txStats[lane].frames,
+            txStats[lane].coalesced,
+            txStats[lane].frames ? txStats[lane].totalUs / 1000.0 / txStats[lane].frames : 0.0,
+            txStats[lane].maxUs / 1000.0);
+        }
+
+    printf("Knob echoes suppressed: %u\n", echoSuppressed);
+    printf("Knob frames received: %u\n", (unsigned)knobFrames);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** logPrint:
+**
+** Prints one log line: time since start, level, event name and the event
+** fields as key=value pairs. Use logMsg, it skips levels that are off.
+**------------------------------------------------------------------------------
+*/
+void logPrint(int level, const char *event, const char *fmt, ...)
+    {
+    const char *names[LOG_LEVELS] = { "error", "warn", "info", "debug" };
+    va_list args;
+
+    lock_guard<mutex> lock(logLock);
+
+    printf("ts=%.3f level=%s event=%s", (GetTickCount64() - logStart) / 1000.0, names[level], event);
+    if (*fmt)
+        {
+        printf(" ");
+        va_start(args, fmt);
+        vprintf(fmt, args);
+        va_end(args);
+        }
+    printf("\n");
+    }
+
+/*
+**------------------------------------------------------------------------------
+** metricObserve:
+**
+** Adds the time since start to a latency histogram
+**------------------------------------------------------------------------------
+*/
+void metricObserve(metricHistogram_t *h, chrono::steady_clock::time_point start)
+    {
+    uint64_t us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    int b;
+
+    for (b = 0; (b < METRIC_BUCKETS) && (us > METRIC_BUCKETS_MS[b] * 1000); b++)
+        {
+        //do nothing
+        }
+
+    h->bucket[b]++;
+    h->count++;
+    h->sumUs += us;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** metricsWriteHistogram:
+**
+** Writes one latency histogram in the Prometheus text format, in seconds
+**------------------------------------------------------------------------------
+*/
+void metricsWriteHistogram(FILE *f, const char *name, const char *help, metricHistogram_t *h)
+    {
+    uint64_t cumulative = 0;
+    int b;
+
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (b = 0; b < METRIC_BUCKETS; b++)
+        {
+        cumulative += h->bucket[b];
+        fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", name, METRIC_BUCKETS_MS[b] / 1000, (unsigned long long)cumulative);
+        }
+    cumulative += h->bucket[METRIC_BUCKETS];
+    fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+    fprintf(f, "%s_sum %g\n", name, h->sumUs / 1e6);
+    fprintf(f, "%s_count %llu\n", name, (unsigned long long)h->count);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** metricsWrite:
+**
+** Writes the metrics to the --metrics file in the Prometheus text format, for
+** the node exporter textfile collector or anything else that reads it. The
+** file is replaced in one go, a reader never sees half of it. It is not
+** flushed to disk, a crash may leave an older copy, the next cycle rewrites it.
+**------------------------------------------------------------------------------
+*/
+void metricsWrite(void)
+    {
+    char tmpPath[MAX_PATH];
+    FILE *f;
+    int t;
+
+    if (!metricsPath)
+        {
+        return;
+        }
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", metricsPath);
+    if (fopen_s(&f, tmpPath, "w") || !f)
+        {
+        logMsg(LOG_WARN, "metrics_write_failed", "path=\"%s\"", tmpPath);
+        return;
+        }
+
+    fprintf(f, "# HELP sndvol_frames_tx_total Frames sent to the receivers.\n# TYPE sndvol_frames_tx_total counter\n");
+    for (t = 0; t < MAX_MSGTYPES; t++)
+        {
+        if (metrics.framesTx[t])
+            {
+            fprintf(f, "sndvol_frames_tx_total{type=\"%d\"} %llu\n", t, (unsigned long long)metrics.framesTx[t]);
+            }
+        }
+
+    fprintf(f, "# HELP sndvol_frames_rx_total Good frames received from the receivers.\n# TYPE sndvol_frames_rx_total counter\n");
+    for (t = 0; t < MAX_MSGTYPES; t++)
+        {
+        if (metrics.framesRx[t])
+            {
+            fprintf(f, "sndvol_frames_rx_total{type=\"%d\"} %llu\n", t, (unsigned long long)metrics.framesRx[t]);
+            }
+        }
+
+    fprintf(f, "# HELP sndvol_wire_bytes_total Bytes on the serial links, framing included.\n# TYPE sndvol_wire_bytes_total counter\n");
+    fprintf(f, "sndvol_wire_bytes_total{dir=\"tx\"} %llu\n", (unsigned long long)metrics.bytesTx);
+    fprintf(f, "sndvol_wire_bytes_total{dir=\"rx\"} %llu\n", (unsigned long long)metrics.bytesRx);
+
+    fprintf(f, "# HELP sndvol_checksum_errors_total Received frames with a bad CRC.\n# TYPE sndvol_checksum_errors_total counter\n");
+    fprintf(f, "sndvol_checksum_errors_total %llu\n", (unsigned long long)metrics.checksumErrors);
+    fprintf(f, "# HELP sndvol_resends_total Sequenced frames sent again.\n# TYPE sndvol_resends_total counter\n");
+    fprintf(f, "sndvol_resends_total %llu\n", (unsigned long long)metrics.resends);
+    fprintf(f, "# HELP sndvol_give_ups_total Sequenced frames never ACKed.\n# TYPE sndvol_give_ups_total counter\n");
+    fprintf(f, "sndvol_give_ups_total %llu\n", (unsigned long long)metrics.giveUps);
+    fprintf(f, "# HELP sndvol_resyncs_total Full state resends to a receiver.\n# TYPE sndvol_resyncs_total counter\n");
+    fprintf(f, "sndvol_resyncs_total %llu\n", (unsigned long long)metrics.resyncs);
+    fprintf(f, "# HELP sndvol_labels_sent_total Labels sent to the receivers.\n# TYPE sndvol_labels_sent_total counter\n");
+    fprintf(f, "sndvol_labels_sent_total %llu\n", (unsigned long long)metrics.labelsSent);
+    fprintf(f, "# HELP sndvol_labels_scrolling_total Labels sent too wide for the display, scrolled by the receiver.\n# TYPE sndvol_labels_scrolling_total counter\n");
+    fprintf(f, "sndvol_labels_scrolling_total %llu\n", (unsigned long long)metrics.labelsScrolling);
+    fprintf(f, "# HELP sndvol_knob_echoes_suppressed_total Volume updates held back as knob echoes.\n# TYPE sndvol_knob_echoes_suppressed_total counter\n");
+    fprintf(f, "sndvol_knob_echoes_suppressed_total %u\n", echoSuppressed);
+
+    metricsWriteHistogram(f, "sndvol_enumerate_seconds", "Audio session enumeration time.", &metrics.enumerate);
+    metricsWriteHistogram(f, "sndvol_labels_seconds", "Label resolution time for all groups.", &metrics.labels);
+    metricsWriteHistogram(f, "sndvol_sync_seconds", "Receiver connect to full display time.", &metrics.sync);
+
+    fclose(f);
+
+    if (!MoveFileExA(tmpPath, metricsPath, MOVEFILE_REPLACE_EXISTING))
+        {
+        logMsg(LOG_WARN, "metrics_write_failed", "path=\"%s\" error=%lu", metricsPath, (unsigned long)GetLastError());
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** captureOpen:
+**
+** Starts the --capture file, every byte sent or received is recorded from here
+**------------------------------------------------------------------------------
+*/
+int captureOpen(const char *path)
+    {
+    if (fopen_s(&captureFile, path, "wb") || !captureFile)
+        {
+        logMsg(LOG_ERROR, "capture_open_failed", "path=\"%s\"", path);
+        captureFile = NULL;
+        return 0;
+        }
+
+    fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), captureFile);
+    captureTime = chrono::steady_clock::now();
+    logMsg(LOG_INFO, "capture", "path=\"%s\"", path);
+    return 1;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** captureWrite:
+**
+** Writes one record, split if it does not fit. Called with captureLock held.
+**------------------------------------------------------------------------------
+*/
+void captureWrite(chrono::steady_clock::time_point t, uint8_t flags, const uint8_t *data, int len)
+    {
+    captureRecord_t rec;
+    uint32_t delta = 0;
+
+    if (t > captureTime)
+        {
+        delta = (uint32_t)chrono::duration_cast<chrono::microseconds>(t - captureTime).count();
+        captureTime = t;
+        }
+
+    while (len > 0)
+        {
+        rec.deltaUs = delta;
+        rec.flags = flags;
+        rec.len = (uint8_t)min(len, CAPTURE_MAX_RECORD);
+        fwrite(&rec, 1, sizeof(rec), captureFile);
+        fwrite(data, 1, rec.len, captureFile);
+        data += rec.len;
+        len -= rec.len;
+        delta = 0;
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** captureData:
+**
+** Records serial traffic. A frame sent is one record, the RX thread hands over
+** a byte at a time so those are gathered until the port goes quiet.
+**------------------------------------------------------------------------------
+*/
+void captureData(int port, uint8_t dir, const uint8_t *data, int len)
+    {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    uint8_t flags = dir | (port & CAPTURE_PORT);
+    lock_guard<mutex> guard(captureLock);
+
+    if (!captureFile)
+        {
+        return;
+        }
+
+    //Anything else in between ends the pending RX record
+    if (captureRxLen &&
+        ((flags != captureRxFlags) || (captureRxLen + len > CAPTURE_MAX_RECORD) ||
+         (now - captureRxTime > chrono::microseconds(CAPTURE_GAP_US))))
+        {
+        captureWrite(captureRxTime, captureRxFlags, captureRx, captureRxLen);
+        captureRxLen = 0;
+        }
+
+    if (!(dir & CAPTURE_RX))
+        {
+        captureWrite(now, flags, data, len);
+        return;
+        }
+
+    if (!captureRxLen)
+        {
+        captureRxTime = now;
+        captureRxFlags = flags;
+        }
+    memcpy(captureRx + captureRxLen, data, len);
+    captureRxLen += len;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** captureFlush:
+**
+** Puts everything recorded so far in the capture file, called every sync cycle
+** so not much is lost if the program is killed
+**------------------------------------------------------------------------------
+*/
+void captureFlush(void)
+    {
+    lock_guard<mutex> guard(captureLock);
+
+    if (!captureFile)
+        {
+        return;
+        }
+
+    if (captureRxLen)
+        {
+        captureWrite(captureRxTime, captureRxFlags, captureRx, captureRxLen);
+        captureRxLen = 0;
+        }
+    fflush(captureFile);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** replayFrame:
+**
+** Called by rxByte for every good frame in a --replay
+**------------------------------------------------------------------------------
+*/
+void replayFrame(mixer_t *mx)
+    {
+    mx->replayFrames++;
+    logMsg(LOG_DEBUG, "frame", "dir=%s port=%d type=%d seq=%d len=%d",
+        (mx->replay == REPLAY_RX) ? "rx" : "tx", mx->cport_nr + 1, mx->rx.buffer[3], mx->rx.buffer[2], getLe16(mx->rx.buffer));
+    }
+
+/*
+**------------------------------------------------------------------------------
+** replayCapture:
+**
+** Runs a --capture file through the frame decoder, both directions, and reports
+** what was found. Paced like the original unless fast is set, then it doubles
+** as a decoder benchmark. The file is mapped, not read, so big captures start
+** at once.
+**------------------------------------------------------------------------------
+*/
+int replayCapture(const char *path, int fast)
+    {
+    mixer_t *decoders[CAPTURE_PORT + 1][2] = { { NULL } };
+    const uint8_t *file;
+    size_t size;
+    size_t pos;
+    uint64_t bytes[2] = { 0, 0 };
+    uint64_t frames[2] = { 0, 0 };
+    uint64_t records = 0;
+    chrono::steady_clock::time_point start;
+    chrono::steady_clock::time_point due;
+    double elapsedMs;
+
+    file = mapFile(path, &size);
+    if (!file)
+        {
+        logMsg(LOG_ERROR, "replay_open_failed", "path=\"%s\"", path);
+        return 1;
+        }
+
+    if ((size < sizeof(CAPTURE_MAGIC)) || memcmp(file, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)))
+        {
+        logMsg(LOG_ERROR, "replay_bad_file", "path=\"%s\"", path);
+        size = 0;
+        }
+
+    start = chrono::steady_clock::now();
+    due = start;
+    for (pos = sizeof(CAPTURE_MAGIC); pos + sizeof(captureRecord_t) <= size; )
+        {
+        const captureRecord_t *rec = (const captureRecord_t *)(file + pos);
+        int rx = (rec->flags & CAPTURE_RX) ? 1 : 0;
+        mixer_t *mx;
+
+        pos += sizeof(captureRecord_t);
+        if (pos + rec->len > size)
+            {
+            logMsg(LOG_WARN, "replay_truncated", "offset=%llu", (unsigned long long)pos);
+            break;
+            }
+
+        mx = decoders[rec->flags & CAPTURE_PORT][rx];
+        if (!mx)
+            {
+            mx = new mixer_t();
+            mx->cport_nr = rec->flags & CAPTURE_PORT;
+            mx->bdrate = LINK_DEFAULT_BAUD;
+            mx->replay = rx ? REPLAY_RX : REPLAY_TX;
+            decoders[rec->flags & CAPTURE_PORT][rx] = mx;
+            }
+
+        if (!fast)
+            {
+            due += chrono::microseconds(rec->deltaUs);
+            this_thread::sleep_until(due);
+            }
+
+        for (int b = 0; b < rec->len; b++)
+            {
+            rxByte(mx, file[pos + b]);
+            }
+        bytes[rx] += rec->len;
+        pos += rec->len;
+        records++;
+        }
+    elapsedMs = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count() / 1000.0;
+
+    for (int p = 0; p <= CAPTURE_PORT; p++)
+        {
+        for (int d = 0; d < 2; d++)
+            {
+            if (decoders[p][d])
+                {
+                frames[d] += decoders[p][d]->replayFrames;
+                delete decoders[p][d];
+                }
+            }
+        }
+
+    unmapFile(file);
+
+    printf("Replay %s: %llu records\n", path, (unsigned long long)records);
+    printf("  tx %10llu bytes %8llu frames\n", (unsigned long long)bytes[0], (unsigned long long)frames[0]);
+    printf("  rx %10llu bytes %8llu frames\n", (unsigned long long)bytes[1], (unsigned long long)frames[1]);
+    printf("  %llu checksum errors, %.1f ms, %.2f MB/s\n", (unsigned long long)metrics.checksumErrors, elapsedMs,
+        (elapsedMs > 0) ? (bytes[0] + bytes[1]) / (elapsedMs * 1000.0) : 0.0);
+    return 0;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** mapFile:
+**
+** Maps a whole file read only. Returns NULL if it cannot be opened or is
+** empty, else the view and its size, for unmapFile.
+**------------------------------------------------------------------------------
+*/
+const uint8_t *mapFile(const char *path, size_t *size)
+    {
+    LARGE_INTEGER fileSize = { 0 };
+    HANDLE hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    HANDLE hMap = NULL;
+    LPVOID view = NULL;
+
+    if ((hFile != INVALID_HANDLE_VALUE) && GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart)
+        {
+        hMap = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        }
+    if (hMap)
+        {
+        view = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(hMap);
+        }
+    if (hFile != INVALID_HANDLE_VALUE)
+        {
+        CloseHandle(hFile);
+        }
+    if (!view)
+        {
+        return NULL;
+        }
+    *size = (size_t)fileSize.QuadPart;
+
+    return (const uint8_t *)view;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** unmapFile:
+**
+** Releases a view from mapFile
+**------------------------------------------------------------------------------
+*/
+void unmapFile(const uint8_t *view)
+    {
+    UnmapViewOfFile(view);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** storeOpen:
+**
+** Reads the per application store, %APPDATA%\SndVolHWMixer.store unless
+** --store says otherwise. A missing or unreadable store is started over.
+**------------------------------------------------------------------------------
+*/
+void storeOpen(void)
+    {
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    const storeHeader_t *head;
+    const uint8_t *file;
+    size_t size;
+    size_t recordSize;
+    size_t known;
+    int version;
+    int count;
+
+    memset(&storeHead, 0, sizeof(storeHead));
+    memcpy(storeHead.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+    putLe16(storeHead.version, STORE_VERSION);
+    storeRecords.clear();
+
+    if (!storePath[0])
+        {
+        const char *dirVar = "APPDATA";
+        const char *name = "\\SndVolHWMixer.store";
+        DWORD len = GetEnvironmentVariableA(dirVar, storePath, sizeof(storePath));
+        if (!len || (len + strlen(name) >= sizeof(storePath)))
+            {
+            storePath[0] = '\0';
+            logMsg(LOG_WARN, "store_no_path", "variable=%s", dirVar);
+            return;
+            }
+        strcat_s(storePath, sizeof(storePath), name);
+        }
+
+    file = mapFile(storePath, &size);
+    if (!file)
+        {
+        logMsg(LOG_INFO, "store_new", "path=\"%s\"", storePath);
+        return;
+        }
+
+    head = (const storeHeader_t *)file;
+    recordSize = (size >= sizeof(storeHeader_t)) ? getLe16(head->recordSize) : 0;
+    count = (size >= sizeof(storeHeader_t)) ? getLe16(head->count) : 0;
+    version = (size >= sizeof(storeHeader_t)) ? getLe16(head->version) : 0;
+    known = (version == STORE_VERSION_V1) ? offsetof(storeRecord_t, points) : sizeof(storeRecord_t);
+    if ((size < sizeof(storeHeader_t)) ||
+        memcmp(head->magic, STORE_MAGIC, sizeof(STORE_MAGIC)) ||
+        ((version != STORE_VERSION) && (version != STORE_VERSION_V1)) ||
+        (recordSize < known) ||
+        (sizeof(storeHeader_t) + count * recordSize > size))
+        {
+        logMsg(LOG_WARN, "store_bad_file", "path=\"%s\"", storePath);
+        unmapFile(file);
+        return;
+        }
+
+    memcpy(&storeHead, head, sizeof(storeHead));
+    storeHead.masterLabel[sizeof(storeHead.masterLabel) - 1] = '\0';
+    putLe16(storeHead.version, STORE_VERSION);
+
+    for (int r = 0; (r < count) && (r < STORE_MAX_APPS); r++)
+        {
+        storeRecord_t rec;
+
+        memset(&rec, 0, sizeof(rec));
+        memcpy(&rec, file + sizeof(storeHeader_t) + r * recordSize, known);
+        rec.app[sizeof(rec.app) - 1] = '\0';
+        rec.label[sizeof(rec.label) - 1] = '\0';
+        rec.lastLabel[sizeof(rec.lastLabel) - 1] = '\0';
+        if ((version == STORE_VERSION_V1) && (rec.curve >= CURVE_POINTS))
+            {
+            //Reserved in version 1, there are no points to go with it
+            rec.curve = CURVE_LINEAR;
+            }
+        storeRecords.push_back(rec);
+        }
+    unmapFile(file);
+
+    if (version == STORE_VERSION_V1)
+        {
+        //Written back in the current layout
+        logMsg(LOG_INFO, "store_migrated", "path=\"%s\" from=%d to=%d", storePath, version, STORE_VERSION);
+        storeDirty = 1;
+        }
+
+    //Shown until initDevice finds the endpoint
+    storeWiden(deviceData.deviceName, _countof(deviceData.deviceName), storeHead.masterLabel);
+
+    logMsg(LOG_INFO, "store_loaded", "path=\"%s\" apps=%d us=%d", storePath, (int)storeRecords.size(),
+        (int)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - t0).count());
+    }
+
+/*
+**------------------------------------------------------------------------------
+** storeWrite:
+**
+** Writes the store if anything changed. The temporary file is on the disk
+** before it replaces the store, and the replace is written through, so a
+** crash leaves either the old store or the new one.
+**------------------------------------------------------------------------------
+*/
+void storeWrite(void)
+    {
+    char tmpPath[MAX_PATH];
+    FILE *f;
+    int ok;
+
+    if (!storeDirty || !storePath[0])
+        {
+        return;
+        }
+    storeDirty = 0;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", storePath);
+    if (fopen_s(&f, tmpPath, "wb") || !f)
+        {
+        logMsg(LOG_WARN, "store_write_failed", "path=\"%s\"", tmpPath);
+        return;
+        }
+
+    putLe16(storeHead.recordSize, sizeof(storeRecord_t));
+    putLe16(storeHead.count, (uint16_t)storeRecords.size());
+    fwrite(&storeHead, sizeof(storeHead), 1, f);
+    if (!storeRecords.empty())
+        {
+        fwrite(storeRecords.data(), sizeof(storeRecord_t), storeRecords.size(), f);
+        }
+    ok = !fflush(f) && !ferror(f) && !_commit(_fileno(f));
+    fclose(f);
+
+    if (!ok)
+        {
+        logMsg(LOG_WARN, "store_write_failed", "path=\"%s\"", tmpPath);
+        return;
+        }
+
+    if (!MoveFileExA(tmpPath, storePath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+        {
+        logMsg(LOG_WARN, "store_write_failed", "path=\"%s\" error=%lu", storePath, (unsigned long)GetLastError());
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** storeApp:
+**
+** Finds the store record of an executable, adding one if needed. A full store
+** reuses a record without preferences that is not shown and not held, see
+** storeHeld. Returns the index in storeRecords, -1 if there is no room.
+**------------------------------------------------------------------------------
+*/
+int storeApp(const WCHAR *exeName)
+    {
+    storeRecord_t rec;
+    int spare = -1;
+
+    if (!exeName[0])
+        {
+        return -1;
+        }
+
+    memset(&rec, 0, sizeof(rec));
+    strncpy_s(rec.app, sizeof(rec.app), labelCp437(exeName).c_str(), _TRUNCATE);
+    for (char *c = rec.app; *c; c++)
+        {
+        *c = tolower((uint8_t)*c);
+        }
+
+    for (int r = 0; r < (int)storeRecords.size(); r++)
+        {
+        storeRecord_t *old = &storeRecords[r];
+
+        if (!strcmp(old->app, rec.app))
+            {
+            return storeHold(r);
+            }
+
+        if ((spare < 0) && (old->slot == STORE_NO_SLOT) && !old->label[0] && !old->curve && (old->lastSlot == STORE_NO_SLOT) &&
+            !((r < (int)storeHeld.size()) && storeHeld[r]))
+            {
+            spare = r;
+            }
+        }
+
+    rec.slot = STORE_NO_SLOT;
+    rec.lastSlot = STORE_NO_SLOT;
+    storeDirty = 1;
+
+    if ((int)storeRecords.size() < STORE_MAX_APPS)
+        {
+        storeRecords.push_back(rec);
+        return storeHold(storeRecords.size() - 1);
+        }
+
+    if (spare >= 0)
+        {
+        storeRecords[spare] = rec;
+        }
+    return storeHold(spare);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** storeHold:
+**
+** Marks a record storeApp hands out as taken, so a second new app in the same
+** getLabels pass does not get the same spare. Returns the index.
+**------------------------------------------------------------------------------
+*/
+int storeHold(int ix)
+    {
+    if (ix >= 0)
+        {
+        if ((int)storeHeld.size() <= ix)
+            {
+            storeHeld.resize(ix + 1, 0);
+            }
+        storeHeld[ix] = 1;
+        }
+    return ix;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** storePref:
+**
+** Sets a preference from the command line,
+** --pref <app> slot=<n>|label=<text>|curve=linear|db|<knob>:<volume>,...
+** Slots count from 1, curve points are in percent and must both rise. An
+** empty value clears the preference.
+**------------------------------------------------------------------------------
+*/
+void storePref(const WCHAR *appName, const WCHAR *setting)
+    {
+    const WCHAR *value = wcschr(setting, L'=');
+    storeRecord_t *rec;
+    int ix = value ? storeApp(appName) : -1;
+
+    if (ix < 0)
+        {
+        logMsg(LOG_WARN, "pref_ignored", "app=\"%S\" setting=\"%S\"", appName, setting);
+        return;
+        }
+    rec = &storeRecords[ix];
+    value++;
+
+    if (!wcsncmp(setting, L"slot=", 5))
+        {
+        int slot = _wtoi(value);
+        rec->slot = ((slot > 0) && (slot <= INT8_MAX)) ? slot - 1 : STORE_NO_SLOT;
+        }
+    else if (!wcsncmp(setting, L"label=", 6))
+        {
+        strncpy_s(rec->label, sizeof(rec->label), labelCp437(value).c_str(), _TRUNCATE);
+        }
+    else if (!wcsncmp(setting, L"curve=", 6) && (!value[0] || !wcscmp(value, L"linear")))
+        {
+        rec->curve = CURVE_LINEAR;
+        }
+    else if (!wcsncmp(setting, L"curve=", 6) && !wcscmp(value, L"db"))
+        {
+        rec->curve = CURVE_DB;
+        }
+    else if (!wcsncmp(setting, L"curve=", 6) && curveParse(rec->points, value))
+        {
+        rec->curve = CURVE_POINTS;
+        }
+    else
+        {
+        logMsg(LOG_WARN, "pref_ignored", "app=\"%S\" setting=\"%S\"", appName, setting);
+        return;
+        }
+
+    storeDirty = 1;
+    logMsg(LOG_INFO, "pref", "app=\"%s\" slot=%d label=\"%s\" curve=%d", rec->app, rec->slot + 1, rec->label, rec->curve);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** storeLayout:
+**
+** Puts the groups with a preferred slot on it, the others keep their order in
+** the gaps. On the first cycle a group without a preference goes back where it
+** was last time, where the receiver already shows it. Then clears what was
+** shown from the store but did not turn up, and remembers the layout for the
+** next startup.
+**------------------------------------------------------------------------------
+*/
+void storeLayout(int initial)
+    {
+    int n = groupList.size();
+    vector <list <Group>::iterator> order(n, groupList.end());
+    vector <list <Group>::iterator> rest;
+    vector <int> shown(storeRecords.size(), STORE_NO_SLOT);
+    list <Group>::iterator grp;
+    storeRecord_t *rec;
+    mixer_t *mx;
+    int chnum;
+    int ch;
+    int r;
+    int moved = 0;
+
+    for (grp = groupList.begin(); grp != groupList.end(); grp++)
+        {
+        int slot = STORE_NO_SLOT;
+
+        if ((*grp).g.app >= 0)
+            {
+            rec = &storeRecords[(*grp).g.app];
+            slot = ((rec->slot == STORE_NO_SLOT) && initial) ? rec->lastSlot : rec->slot;
+            }
+
+        if ((slot >= 0) && (slot < n) && (order[slot] == groupList.end()))
+            {
+            order[slot] = grp;
+            }
+        else
+            {
+            rest.push_back(grp);
+            }
+        }
+
+    for (ch = 0, r = 0; ch < n; ch++)
+        {
+        if (order[ch] == groupList.end())
+            {
+            order[ch] = rest[r++];
+            }
+        }
+
+    //A channel that gets another group shows it from scratch
+    for (grp = groupList.begin(), ch = 0; grp != groupList.end(); grp++, ch++)
+        {
+        if (order[ch] != grp)
+            {
+            (*order[ch]).g.update = true;
+            moved++;
+            }
+        }
+
+    if (moved)
+        {
+        for (ch = 0; ch < n; ch++)
+            {
+            groupList.splice(groupList.end(), groupList, order[ch]);
+            }
+        logMsg(LOG_DEBUG, "reorder", "groups=%d moved=%d", n, moved);
+        }
+
+    for (ch = n; ch < storeShown; ch++)
+        {
+        mx = channelMixer(ch, &chnum);
+        if (mx)
+            {
+            sendChannelVol(mx, chnum, 0, false);
+            sendChannelLabel(mx, chnum, L"");
+            }
+        }
+    storeShown = 0;
+
+    for (grp = groupList.begin(), ch = 0; (grp != groupList.end()) && (ch <= INT8_MAX); grp++, ch++)
+        {
+        char label[sizeof(rec->lastLabel)];
+
+        if (((*grp).g.app < 0) || (shown[(*grp).g.app] != STORE_NO_SLOT))
+            {
+            //Unknown executable, or another session of it is shown already
+            continue;
+            }
+        shown[(*grp).g.app] = ch;
+        rec = &storeRecords[(*grp).g.app];
+
+        strncpy_s(label, sizeof(label), labelCp437((*grp).g.prettyName).c_str(), _TRUNCATE);
+        if (strcmp(label, rec->lastLabel))
+            {
+            strcpy_s(rec->lastLabel, sizeof(rec->lastLabel), label);
+            storeDirty = 1;
+            }
+
+        if (((*grp).g.prevVolume >= 0) && ((getLe16(rec->lastVolume) != (*grp).g.prevVolume) || (rec->lastMute != (*grp).g.prevMute)))
+            {
+            putLe16(rec->lastVolume, (*grp).g.prevVolume);
+            rec->lastMute = (*grp).g.prevMute;
+            storeDirty = 1;
+            }
+        }
+
+    for (r = 0; r < (int)storeRecords.size(); r++)
+        {
+        if (storeRecords[r].lastSlot != shown[r])
+            {
+            storeRecords[r].lastSlot = shown[r];
+            storeDirty = 1;
+            }
+        }
+
+    char master[sizeof(storeHead.masterLabel)];
+    strncpy_s(master, sizeof(master), labelCp437(deviceData.deviceName).c_str(), _TRUNCATE);
+    if (strcmp(master, storeHead.masterLabel))
+        {
+        strcpy_s(storeHead.masterLabel, sizeof(storeHead.masterLabel), master);
+        storeDirty = 1;
+        }
+
+    if ((deviceData.prevVolume >= 0) && ((getLe16(storeHead.masterVolume) != deviceData.prevVolume) || (storeHead.masterMute != deviceData.prevMute)))
+        {
+        putLe16(storeHead.masterVolume, deviceData.prevVolume);
+        storeHead.masterMute = deviceData.prevMute;
+        storeDirty = 1;
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** storeWiden:
+**
+** Converts a CP437 label from the store back to a WCHAR string
+**------------------------------------------------------------------------------
+*/
+void storeWiden(WCHAR *dst, size_t len, const char *src)
+    {
+    size_t i;
+
+    for (i = 0; src[i] && (i + 1 < len); i++)
+        {
+        uint8_t c = src[i];
+        dst[i] = (c < 0x80) ? c : CP437_HIGH[c - 0x80];
+        }
+    dst[i] = '\0';
+    }
+
+/*
+**------------------------------------------------------------------------------
+** sendStoredLayout:
+**
+** Shows the layout of the last run on the receivers that just connected, so
+** they are usable before the audio sessions have been enumerated. storeLayout
+** sorts out what changed since.
+**------------------------------------------------------------------------------
+*/
+void sendStoredLayout(void)
+    {
+    WCHAR label[sizeof(((storeRecord_t *)0)->lastLabel)];
+    storeRecord_t *rec;
+    mixer_t *mx;
+    int chnum;
+    int channels = 0;
+
+    if (!storeHead.masterLabel[0])
+        {
+        //Nothing shown yet, a first run
+        return;
+        }
+
+    for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+        {
+        if (mx->state == MIXER_ACTIVE)
+            {
+            sendMasterVol(mx, getLe16(storeHead.masterVolume), storeHead.masterMute);
+            }
+        }
+
+    for (int r = 0; r < (int)storeRecords.size(); r++)
+        {
+        rec = &storeRecords[r];
+        mx = (rec->lastSlot != STORE_NO_SLOT) ? channelMixer(rec->lastSlot, &chnum) : NULL;
+        if (!mx)
+            {
+            continue;
+            }
+
+        sendChannelVol(mx, chnum, getLe16(rec->lastVolume), rec->lastMute);
+        storeWiden(label, _countof(label), rec->label[0] ? rec->label : rec->lastLabel);
+        sendChannelLabel(mx, chnum, label);
+
+        storeShown = max(storeShown, rec->lastSlot + 1);
+        channels++;
+        }
+
+    for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+        {
+        if (mx->state == MIXER_ACTIVE)
+            {
+            sendMasterLabel(mx);
+            sendMasterIcon(mx);
+            }
+        }
+
+    logMsg(LOG_INFO, "stored_layout", "channels=%d ms_since_start=%d", channels, (int)(GetTickCount64() - logStart));
+    }
+
+/*
+**------------------------------------------------------------------------------
+** benchFrame:
+**
+** Adds one frame to a benchmark case
+**------------------------------------------------------------------------------
+*/
+void benchFrame(vector <vector <uint8_t>> *frames, msgtype_t msgType, const void *payload, int len)
+    {
+    vector <uint8_t> frame(1, msgType);
+
+    frame.insert(frame.end(), (const uint8_t *)payload, (const uint8_t *)payload + len);
+    frames->push_back(frame);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** benchCase:
+**
+** Benchmarks a set of frames in both framings
+**------------------------------------------------------------------------------
+*/
+void benchCase(FILE *f, const char *name, vector <vector <uint8_t>> &frames, int *first)
+    {
+    for (int cobs = 0; cobs < 2; cobs++)
+        {
+        benchFraming(f, name, frames, cobs, first);
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** benchFraming:
+**
+** Times encoding and decoding a set of frames in one framing and writes the
+** results as two entries of the benchmark JSON. Each pass is doubled until it
+** runs for at least BENCH_MIN_MS.
+**------------------------------------------------------------------------------
+*/
+void benchFraming(FILE *f, const char *name, vector <vector <uint8_t>> &frames, int cobs, int *first)
+    {
+    mixer_t *enc = new mixer_t();
+    mixer_t *dec = new mixer_t();
+    vector <uint8_t> wire;
+    size_t dataBytes = 0;
+    uint64_t iterations;
+    double ns = 0;
+    chrono::steady_clock::time_point t0;
+    const char *pass[2] = { "encode", "decode" };
+
+    enc->txCobs = cobs;
+    dec->bdrate = LINK_DEFAULT_BAUD;
+    dec->replay = REPLAY_TX;
+
+    for (size_t i = 0; i < frames.size(); i++)
+        {
+        int n = protocolEncodeFrame(enc, 1, frames[i].data(), (int)frames[i].size());
+        wire.insert(wire.end(), enc->txBuffer, enc->txBuffer + n);
+        dataBytes += frames[i].size();
+        }
+
+    for (int p = 0; p < 2; p++)
+        {
+        for (iterations = 1; ; iterations *= 2)
+            {
+            dec->replayFrames = 0;
+            t0 = chrono::steady_clock::now();
+            for (uint64_t it = 0; it < iterations; it++)
+                {
+                if (p == 0)
+                    {
+                    for (size_t i = 0; i < frames.size(); i++)
+                        {
+                        protocolEncodeFrame(enc, 1, frames[i].data(), (int)frames[i].size());
+                        }
+                    }
+                else
+                    {
+                    for (size_t i = 0; i < wire.size(); i++)
+                        {
+                        rxByte(dec, wire[i]);
+                        }
+                    }
+                }
+            ns = (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count();
+            if ((ns >= BENCH_MIN_MS * 1e6) || (iterations >= (1ULL << 32)))
+                {
+                break;
+                }
+            }
+
+        if ((p == 1) && (dec->replayFrames != iterations * frames.size()))
+            {
+            logMsg(LOG_ERROR, "bench_decode_mismatch", "case=%s frames=%llu expected=%llu", name,
+                (unsigned long long)dec->replayFrames, (unsigned long long)(iterations * frames.size()));
+            }
+
+        fprintf(f, "%s    {\"name\": \"%s/%s/%s\", \"iterations\": %llu, \"real_time\": %.1f, \"time_unit\": \"ns\", "
+            "\"frames\": %u, \"data_bytes\": %u, \"wire_bytes\": %u, \"overhead\": %.3f, \"bytes_per_second\": %.0f}",
+            *first ? "" : ",\n", pass[p], cobs ? "cobs" : "dle", name, (unsigned long long)iterations, ns / iterations,
+            (unsigned)frames.size(), (unsigned)dataBytes, (unsigned)wire.size(), (double)wire.size() / dataBytes,
+            wire.size() * iterations / (ns / 1e9));
+        *first = 0;
+        }
+
+    delete enc;
+    delete dec;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** benchProtocol:
+**
+** --bench, measures the frame encoder and decoder on typical messages, on
+** payloads that need the most stuffing and on the frames of a full receiver
+** sync. The results are written as JSON, laid out like Google Benchmark's, to
+** path or stdout.
+**------------------------------------------------------------------------------
+*/
+int benchProtocol(const char *path)
+    {
+    FILE *f = stdout;
+    vector <vector <uint8_t>> frames;
+    uint8_t payload[MAX_DATA_LENGTH];
+    const char *label = "Spotify Premium";
+    int first = 1;
+    int n;
+
+    if (path && (fopen_s(&f, path, "w") || !f))
+        {
+        logMsg(LOG_ERROR, "bench_open_failed", "path=\"%s\"", path);
+        return 1;
+        }
+
+    fprintf(f, "{\n  \"context\": {\"executable\": \"SndVolHWMixer\", \"protocol_version\": %d, \"max_data\": %d},\n  \"benchmarks\": [\n",
+        PROTOCOL_VERSION, MAX_DATA_LENGTH);
+
+    //Typical frames, one of each kind the PC sends
+    payload[0] = VOL_FINE_MASTER;
+    putLe16(&payload[1], 734);
+    payload[3] = 0;
+    benchFrame(&frames, MSGTYPE_SET_VOL_FINE, payload, 4);
+    benchCase(f, "set_vol_fine", frames, &first);
+    frames.clear();
+
+    payload[0] = 3;
+    payload[1] = (uint8_t)strlen(label);
+    memcpy(&payload[2], label, strlen(label) + 1);
+    benchFrame(&frames, MSGTYPE_SET_CHANNEL_LABEL, payload, (int)strlen(label) + 3);
+    benchCase(f, "set_channel_label", frames, &first);
+    frames.clear();
+
+    benchFrame(&frames, MSGTYPE_SET_MASTER_ICON, corsair, sizeof(corsair));
+    benchCase(f, "set_master_icon", frames, &first);
+    frames.clear();
+
+    payload[0] = MAX_METER_LEVELS;
+    for (n = 0; n < MAX_METER_LEVELS; n++)
+        {
+        payload[1 + n] = (uint8_t)((n * 37) % 101);
+        }
+    benchFrame(&frames, MSGTYPE_SET_METERS, payload, MAX_METER_LEVELS + 1);
+    benchCase(f, "set_meters", frames, &first);
+    frames.clear();
+
+    //Worst case, every byte is a reserved symbol and gets stuffed
+    for (n = 0; n < MAX_DATA_LENGTH - 1; n++)
+        {
+        payload[n] = (n % 3 == 0) ? STX : ((n % 3 == 1) ? ETX : DLE);
+        }
+    benchFrame(&frames, MSGTYPE_SET_MASTER_ICON, payload, MAX_DATA_LENGTH - 1);
+    benchCase(f, "stuffing_worst", frames, &first);
+    frames.clear();
+
+    //What a sync sends, see sendSnapshot
+    for (int c = 0; c < (int)(sizeof(BENCH_SYNC_CHANNELS) / sizeof(BENCH_SYNC_CHANNELS[0])); c++)
+        {
+        char name[32];
+
+        payload[0] = VOL_FINE_MASTER;
+        putLe16(&payload[1], 500);
+        payload[3] = 0;
+        benchFrame(&frames, MSGTYPE_SET_VOL_FINE, payload, 4);
+        for (n = 0; n < BENCH_SYNC_CHANNELS[c]; n++)
+            {
+            payload[0] = n;
+            putLe16(&payload[1], (uint16_t)(n * 61 % (VOL_FINE_MAX + 1)));
+            benchFrame(&frames, MSGTYPE_SET_VOL_FINE, payload, 4);
+            }
+
+        payload[0] = (uint8_t)strlen("Speakers");
+        memcpy(&payload[1], "Speakers", strlen("Speakers") + 1);
+        benchFrame(&frames, MSGTYPE_SET_MASTER_LABEL, payload, (int)strlen("Speakers") + 2);
+        for (n = 0; n < BENCH_SYNC_CHANNELS[c]; n++)
+            {
+            payload[0] = n;
+            payload[1] = (uint8_t)strlen(label);
+            memcpy(&payload[2], label, strlen(label) + 1);
+            benchFrame(&frames, MSGTYPE_SET_CHANNEL_LABEL, payload, (int)strlen(label) + 3);
+            }
+        benchFrame(&frames, MSGTYPE_SET_MASTER_ICON, corsair, sizeof(corsair));
+
+        snprintf(name, sizeof(name), "sync_%d", BENCH_SYNC_CHANNELS[c]);
+        benchCase(f, name, frames, &first);
+        frames.clear();
+        }
+
+    fprintf(f, "\n  ]\n}\n");
+    if (f != stdout)
+        {
+        fclose(f);
+        }
+    return 0;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** protocolTxFrame:
+**
+** Transmits a frame to a receiver. TX worker only, with the receivers lock held.
+**------------------------------------------------------------------------------
+*/
+#ifdef serialSendBuffer
+void protocolTxFrame(mixer_t *mx, uint8_t seq, void *dataPtr, int dataLength)
+    {
+    int totalData = protocolEncodeFrame(mx, seq, dataPtr, dataLength);
+
+    serialSendBuffer(mx, mx->txBuffer, totalData);
+    if (captureFile)
+        {
+        captureData(mx->cport_nr, 0, mx->txBuffer, totalData);
+        }
+
+    metrics.framesTx[((uint8_t *)dataPtr)[0] % MAX_MSGTYPES]++;
+    metrics.bytesTx += totalData;
+    }
+#endif
+
+/*
+**------------------------------------------------------------------------------
+** protocolEncodeFrame:
+**
+** Pads, checksums and stuffs a frame into the receivers TX buffer, COBS framed
+** if the receiver has it. Returns the number of bytes to put on the wire.
+**------------------------------------------------------------------------------
+*/
+int protocolEncodeFrame(mixer_t *mx, uint8_t seq, void *dataPtr, int dataLength)
+    {
+    int numData = 0;
+    int i;
+    int totalData = 0;
+    uint16_t checksum;
+    uint8_t *txBufPtr;
+    uint8_t *workBufPtr;
+
+    //Fill the work buffer
+    workBufPtr = mx->msgBuffer;
+
+    //Start the message by adding the length and the sequence number
+    putLe16(workBufPtr, dataLength);
+    workBufPtr[2] = seq;
+    numData += 3;
+    workBufPtr += 3;	//Jump to the first data byte
+
+    //Copy the data
+    memcpy_s(workBufPtr, sizeof(mx->msgBuffer) - numData, dataPtr, dataLength);
+    numData += dataLength;
+    workBufPtr += dataLength;	//Jump to the checksum
+
+    //calculate the checksum
+    checksum = crc16(0xFFFF, mx->msgBuffer, numData);
+
+    //Add the checksum
+    putLe16(workBufPtr, checksum);
+    numData += 2;
+
+    if (mx->txCobs)
+        {
+        //COBS, encoded straight into the TX buffer between the delimiters
+        mx->txBuffer[0] = COBS_DELIM;
+        totalData = 1 + cobsEncode(mx->msgBuffer, numData, mx->txBuffer + 1);
+        mx->txBuffer[totalData++] = COBS_DELIM;
+        return totalData;
+        }
+
+    //Start the TX buffer with STX
+    txBufPtr = mx->txBuffer;
+    *txBufPtr++ = STX;
+    totalData++;
+
+    //Copy data and check for reserved symbols and stuff if needed
+    for (i = 0; i < numData; i++)
+        {
+        switch (mx->msgBuffer[i])
+            {
+            case STX:
+            case ETX:
+            case DLE:
+                //Reserved data, add a stuff byte and stuff the data
+                *txBufPtr++ = DLE;
+                totalData++;
+                *txBufPtr++ = mx->msgBuffer[i] ^ 0x10;
+                break;
+
+            default:
+                *txBufPtr++ = mx->msgBuffer[i];
+                break;
+            }
+        totalData++;
+        }
+
+    //Finish off by adding the ETX
+    *txBufPtr++ = ETX;
+    totalData++;
+
+    return totalData;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** telemetryService:
+**
+** Asks the receivers for their loop profile when --telemetry is given
+**------------------------------------------------------------------------------
+*/
+void telemetryService(void)
+    {
+    static ULONGLONG telemetryTime = 0;
+    serialProtocol_t *msg;
+    mixer_t *mx;
+
+    if (!telemetryPeriodMs || (GetTickCount64() - telemetryTime < (ULONGLONG)telemetryPeriodMs))
+        {
+        return;
+        }
+    telemetryTime = GetTickCount64();
+
+    for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+        {
+        if ((mx->state == MIXER_ACTIVE) && capsHasMsg(mx->caps.msgTypes, MSGTYPE_TELEMETRY))
+            {
+            msg = allocProtocolBuf(MSGTYPE_TELEMETRY, sizeof(msgtype_t));
+            protocolTxData(mx, msg, sizeof(msgtype_t));
+            freeProtocolBuf(&msg);
+            }
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** printTelemetry:
+**
+** Dumps a receivers loop profile. RX thread.
+**------------------------------------------------------------------------------
+*/
+void printTelemetry(mixer_t *mx, struct msg_telemetry *t)
+    {
+    const char *stages[TELEMETRY_STAGES] = { "decode", "readVols", "drawScreen", "updateScrolls", "pollEncs" };
+    const char *buckets[TELEMETRY_BUCKETS] = { "<64us", "<256us", "<1ms", "<4ms", "<16ms", ">=16ms" };
+    const char *tasks[TELEMETRY_TASKS] = { "link", "decode", "encoders", "redraw", "scroll", "meters", "screensaver" };
+    int s;
+    int b;
+
+    printf("Port %d telemetry: %u passes, %u ms asleep, %u I2C bytes, %u RX overruns, %u bytes SRAM free\n",
+        mx->cport_nr + 1,
+        getLe32(t->loops),
+        getLe32(t->idleUs) / 1000,
+        getLe32(t->i2cBytes),
+        getLe16(t->rxOverruns),
+        getLe16(t->freeRam));
+
+    printf("  %-14s", "stage");
+    for (b = 0; b < TELEMETRY_BUCKETS; b++)
+        {
+        printf(" %7s", buckets[b]);
+        }
+    printf(" %9s\n", "max us");
+
+    for (s = 0; s < TELEMETRY_STAGES; s++)
+        {
+        printf("  %-14s", stages[s]);
+        for (b = 0; b < TELEMETRY_BUCKETS; b++)
+            {
+            printf(" %7u", getLe16(t->hist[s][b]));
+            }
+        printf(" %9u\n", getLe32(t->maxUs[s]));
+        }
+
+    printf("  deadline misses:");
+    for (s = 0; s < TELEMETRY_TASKS; s++)
+        {
+        printf(" %s %u", tasks[s], getLe16(t->taskMisses[s]));
+        }
+    printf("\n");
+    }
+
+/*
+**------------------------------------------------------------------------------
+** linkService:
+**
+** Resends the sequenced frames that were not ACKed in time, on all receivers.
+** A frame that runs out of retries is dropped and its state is flagged for the
+** next sync cycle.
+**------------------------------------------------------------------------------
+*/
+void linkService(void)
+    {
+    ULONGLONG now = GetTickCount64();
+    vector<uint16_t> dropped;
+    int i;
+    mixer_t *mx;
+
+    for (mx = mixers; mx < mixers + MAX_MIXERS; mx++)
+        {
+        if (mx->state == MIXER_FREE)
             {
-            vol *= masterVolume;
+            continue;
             }
 
-        msg = allocProtocolBuf(MSGTYPE_SET_CHANNEL_VOL_PREC, sizeof(struct msg_set_channel_vol_prec));
-        msg->msg_set_channel_vol_prec.channel = chnum;
-        msg->msg_set_channel_vol_prec.volVal = vol;
-        msg->msg_set_channel_vol_prec.muteStatus = mute;
-        protocolTxData(msg, sizeof(struct msg_set_channel_vol_prec));
-        freeProtocolBuf(&msg);
+        unique_lock<mutex> lock(mx->lock);
 
-        wcstombs_s(&numconv, charName, (*i).g.prettyName, _countof(charName)-1);
-        charName[sizeof(charName) - 1] = 0;
+        for (i = 0; i < LINK_TX_WINDOW; i++)
+            {
+            if (mx->txPending[i].seq && (now - mx->txPending[i].sentAt >= LINK_RETX_TIMEOUT_MS))
+                {
+                if (mx->txPending[i].retries < LINK_MAX_RETRIES)
+                    {
+                    linkResend(mx, &mx->txPending[i]);
+                    }
+                else
+                    {
+                    logMsg(LOG_WARN, "tx_give_up", "port=%d type=%d", mx->cport_nr + 1, mx->txPending[i].key >> 8);
+                    metrics.giveUps++;
+                    linkDrop(mx, &mx->txPending[i]);
+                    }
+                }
+            }
 
-        int len = sizeof(struct msg_set_channel_label) + strlen(charName) + 1;
-        msg = allocProtocolBuf(MSGTYPE_SET_CHANNEL_LABEL, len);
-        msg->msg_set_channel_label.channel = chnum;
-        memcpy_s(msg->msg_set_channel_label.str, strlen(charName) + 1, charName, strlen(charName) + 1);
-        msg->msg_set_channel_label.strLen = strlen(charName);
+        //Flag what was dropped here or by the TX worker, the groups belong to this thread
+        dropped.swap(mx->txDropped);
+        lock.unlock();
 
-        protocolTxData(msg, len);
-        freeProtocolBuf(&msg);
+        for (uint16_t key : dropped)
+            {
+            linkFlag(mx, key);
+            }
+        dropped.clear();
         }
     }
 
 /*
 **------------------------------------------------------------------------------
-** sendMasterInfo:
+** linkDrop:
 **
-** Sends the audio endpoint master volume to the receiver
+** Stops tracking a frame that was never ACKed and remembers its key, so that
+** linkService flags the state for the next sync cycle. Call with the receivers
+** lock held.
 **------------------------------------------------------------------------------
 */
-void sendMasterInfo(void)
+void linkDrop(mixer_t *mx, txPending_t *slot)
     {
-    char charName[64+1];
-    size_t numconv;
-    
-    BOOL mute;
-    float fvol;    
+    mx->txDropped.push_back(slot->key);
+    slot->seq = 0;
+    }
 
-    deviceData.pEndpointVolume->GetMasterVolumeLevelScalar(&fvol);    
-    deviceData.pEndpointVolume->GetMute(&mute);
-    if ((fvol != deviceData.prevVolume) || (mute != deviceData.prevMute))
+/*
+**------------------------------------------------------------------------------
+** linkFlag:
+**
+** Flags the state a dropped frame carried, so the next sync cycle sends it
+** again. Main thread only.
+**------------------------------------------------------------------------------
+*/
+void linkFlag(mixer_t *mx, uint16_t key)
+    {
+    if ((key >> 8) == MSGTYPE_SET_CHANNEL_VOL_PREC || (key >> 8) == MSGTYPE_SET_CHANNEL_LABEL ||
+        ((key >> 8) == MSGTYPE_SET_VOL_FINE && (key & 0xFF) != VOL_FINE_MASTER))
         {
-        printf("Current volume as a scalar is: %f\n", fvol);
-        deviceData.update = true;
-        deviceData.prevVolume = fvol;
-        deviceData.prevMute = mute;
-        }
+        int ch = mx->chBase + (key & 0xFF);
+        list <Group>::iterator grp;
+        for (grp = groupList.begin(); ch && (grp != groupList.end()); grp++, ch--)
+            {
+            //do nothing
+            }
 
-    if (deviceData.update)
+        if (grp != groupList.end())
+            {
+            (*grp).g.update = true;
+            }
+        }
+    else
         {
-        deviceData.update = false;
-
-        serialProtocol_t *msg = allocProtocolBuf(MSGTYPE_SET_MASTER_VOL_PREC, sizeof(struct msg_set_master_vol_prec));
-        msg->msg_set_master_vol_prec.volVal = fvol * 100;
-        msg->msg_set_master_vol_prec.muteStatus = mute;
-        protocolTxData(msg, sizeof(struct msg_set_master_vol_prec));
-        freeProtocolBuf(&msg);
-
-        int size = sizeof(struct msg_set_master_icon) + sizeof(corsair);
-        msg = allocProtocolBuf(MSGTYPE_SET_MASTER_ICON, size);
-        memcpy(msg->msg_set_master_icon.icon, corsair, sizeof(corsair));
-        protocolTxData(msg, size);
-        freeProtocolBuf(&msg);
-
-        wcstombs_s(&numconv, charName, deviceData.deviceName, _countof(charName) - 1);
-        charName[sizeof(charName) - 1] = 0;
-
-        int len = sizeof(struct msg_set_master_label) + strlen(charName) + 1;
-        msg = allocProtocolBuf(MSGTYPE_SET_MASTER_LABEL, len);
-        memcpy_s(msg->msg_set_master_label.str, strlen(charName) + 1, charName, strlen(charName) + 1);
-        msg->msg_set_master_label.strLen = strlen(charName);
-
-        protocolTxData(msg, len);
-        freeProtocolBuf(&msg);
+        deviceData.update = true;
         }
     }
 
 /*
 **------------------------------------------------------------------------------
-** allocProtocolBuf:
+** linkResend:
 **
-** Allocates memory for the specified message
+** Queues a pending frame for resending, it gets a new sequence number when it
+** goes out. Call with the receivers lock held.
 **------------------------------------------------------------------------------
 */
-serialProtocol_t * allocProtocolBuf(msgtype_t msgType, size_t bytes)
+void linkResend(mixer_t *mx, txPending_t *slot)
     {
-    serialProtocol_t *blockPtr = 0;
+    txItem_t *item = new txItem_t;
 
-    blockPtr = (serialProtocol_t*)malloc(bytes);
+    slot->retries++;
+    metrics.resends++;
+    slot->sentAt = GetTickCount64();
 
-    blockPtr->msgType = msgType;
+    item->mx = mx;
+    item->lane = txLane(slot->data[0]);
+    item->key = slot->key;
+    item->retries = slot->retries;
+    item->len = slot->len;
+    memcpy_s(item->data, sizeof(item->data), slot->data, slot->len);
 
-    return blockPtr;
+    mx->txQueued++;
+    txPush(item);
     }
 
 /*
 **------------------------------------------------------------------------------
-** freeProtocolBuf:
+** linkAck:
 **
-** Frees up a previously allocated buffer
+** The receiver got a sequenced frame, stop tracking it. Once a master volume
+** is ACKed the receiver has state, and stops repeating STATE_LOST.
 **------------------------------------------------------------------------------
 */
-void freeProtocolBuf(serialProtocol_t **blockBtr)
+void linkAck(mixer_t *mx, uint8_t seq)
     {
-    free(*blockBtr);
-    *blockBtr = NULL;
+    lock_guard<mutex> lock(mx->lock);
+
+    for (int i = 0; i < LINK_TX_WINDOW; i++)
+        {
+        if (seq && (mx->txPending[i].seq == seq))
+            {
+            mx->txPending[i].seq = 0;
+
+            if ((mx->txPending[i].key == (MSGTYPE_SET_MASTER_VOL_PREC << 8)) || (mx->txPending[i].key == ((MSGTYPE_SET_VOL_FINE << 8) | VOL_FINE_MASTER)))
+                {
+                //The STATE_LOST frames sent before this ACK were about the boot
+                mx->stateAcked = 1;
+                mx->resyncRequest = 0;
+                }
+            }
+        }
     }
 
 /*
 **------------------------------------------------------------------------------
-** protocolTxData:
+** linkNak:
 **
-** Pads, checksums and transmits a message to the receiver
+** The receiver missed a sequenced frame, resend it right away
 **------------------------------------------------------------------------------
 */
-#ifdef serialSendBuffer
-static void protocolTxData(void *dataPtr, int dataLength)
+void linkNak(mixer_t *mx, uint8_t seq)
     {
-    int numData = 0;
-    int i;
-    int totalData = 0;
-    uint16_t checksum;
-    uint8_t *txBufPtr;
-    uint8_t *workBufPtr;
-
-    //Fill the work buffer
-    workBufPtr = msgBuffer;
-
-    //Start the message by adding the length
-    *((uint16_t*)workBufPtr) = dataLength;
-    numData += 2;
-    workBufPtr += 2;	//Jump to the first data byte
-
-    //Copy the data
-    memcpy_s(workBufPtr, sizeof(msgBuffer) - numData, dataPtr, dataLength);
-    numData += dataLength;
-    workBufPtr += dataLength;	//Jump to the checksum
+    lock_guard<mutex> lock(mx->lock);
 
-    //calculate the checksum
-    checksum = 0;
-    for (i = 0; i < numData; i++)
+    for (int i = 0; i < LINK_TX_WINDOW; i++)
         {
-        checksum ^= msgBuffer[i];
+        if (seq && (mx->txPending[i].seq == seq))
+            {
+            if (mx->txPending[i].retries < LINK_MAX_RETRIES)
+                {
+                linkResend(mx, &mx->txPending[i]);
+                }
+            break;
+            }
         }
+    }
 
-    //Add the checksum
-    *((uint16_t*)workBufPtr) = checksum;
-    numData += 2;
+/*
+**------------------------------------------------------------------------------
+** linkRxFrame:
+**
+** ACKs a received sequenced frame and NAKs any frames missing before it.
+** Returns 1 if the frame should be acted on, 0 for a duplicate.
+**------------------------------------------------------------------------------
+*/
+int linkRxFrame(mixer_t *mx, uint8_t seq)
+    {
+    int missing;
+    uint8_t nak;
 
+    if (!seq)
+        {
+        return 1;
+        }
 
-    //Start the TX buffer with STX
-    txBufPtr = txBuffer;
-    *txBufPtr++ = STX;
-    totalData++;
+    sendAck(mx, MSGTYPE_ACK, seq);
 
-    //Copy data and check for reserved symbols and stuff if needed
-    for (i = 0; i < numData; i++)
+    missing = seqAccept(&mx->rxWindow, seq);
+    if (missing < 0)
         {
-        switch (msgBuffer[i])
-            {
-            case STX:
-            case ETX:
-            case DLE:
-                //Reserved data, add a stuff byte and stuff the data
-                *txBufPtr++ = DLE;
-                totalData++;
-                *txBufPtr++ = msgBuffer[i] ^ 0x10;
-                break;
+        return 0;
+        }
 
-            default:
-                *txBufPtr++ = msgBuffer[i];
-                break;
-            }
-        totalData++;
+    //NAK the most recent of the missing frames
+    nak = seq;
+    for (int i = 0; (i < missing) && (i < LINK_MAX_NAKS); i++)
+        {
+        nak = (nak == 1) ? 255 : nak - 1;
+        sendAck(mx, MSGTYPE_NAK, nak);
         }
 
-    //Finish off by adding the ETX
-    *txBufPtr++ = ETX;
-    totalData++;
+    return 1;
+    }
 
-    serialSendBuffer(txBuffer, totalData);
+/*
+**------------------------------------------------------------------------------
+** sendAck:
+**
+** Sends an ACK or a NAK
+**------------------------------------------------------------------------------
+*/
+void sendAck(mixer_t *mx, msgtype_t msgType, uint8_t seq)
+    {
+    serialProtocol_t *msg = allocProtocolBuf(msgType, sizeof(struct msg_ack));
+    msg->msg_ack.seq = seq;
+    protocolTxData(mx, msg, sizeof(struct msg_ack));
+    freeProtocolBuf(&msg);
     }
-#endif
 
 
 /*
@@ -942,11 +4748,17 @@ static void protocolTxData(void *dataPtr, int dataLength)
 ** Acts on the commands received on serial
 **------------------------------------------------------------------------------
 */
-void getCmds(uint8_t *pMsgBuf, uint16_t dataLen)
+void getCmds(mixer_t *mx, uint8_t *pMsgBuf, uint16_t dataLen)
     {
     serialProtocol_t *msgPtr = (serialProtocol_t*)pMsgBuf;
     int channel;
 
+    if (!msgFits(pMsgBuf, dataLen))
+        {
+        //Too short, the fields would be stale data from an earlier frame
+        return;
+        }
+
     switch (msgPtr->msgType)
         {
         case MSGTYPE_SET_MASTER_VOL_PREC:
@@ -955,8 +4767,10 @@ void getCmds(uint8_t *pMsgBuf, uint16_t dataLen)
 
                 }*/
 
-            setMasterVolume(
-                msgPtr->msg_set_master_vol_prec.volVal,
+            postKnob(mx,
+                MSGTYPE_SET_MASTER_VOL_PREC,
+                0,
+                msgPtr->msg_set_master_vol_prec.volVal * (VOL_FINE_MAX / 100),
                 msgPtr->msg_set_master_vol_prec.muteStatus);
             break;
                   
@@ -970,11 +4784,102 @@ void getCmds(uint8_t *pMsgBuf, uint16_t dataLen)
                     }
                 }*/
             
-            setGroupVolume(
+            postKnob(mx,
+                MSGTYPE_SET_CHANNEL_VOL_PREC,
                 msgPtr->msg_set_channel_vol_prec.channel,
-                msgPtr->msg_set_channel_vol_prec.volVal,
+                msgPtr->msg_set_channel_vol_prec.volVal * (VOL_FINE_MAX / 100),
                 msgPtr->msg_set_channel_vol_prec.muteStatus);
             break;                
+
+        case MSGTYPE_SET_VOL_FINE:
+            if (getLe16(msgPtr->msg_set_vol_fine.volVal) > VOL_FINE_MAX)
+                {
+                break;
+                }
+
+            postKnob(mx,
+                (msgPtr->msg_set_vol_fine.channel == VOL_FINE_MASTER) ? MSGTYPE_SET_MASTER_VOL_PREC : MSGTYPE_SET_CHANNEL_VOL_PREC,
+                (msgPtr->msg_set_vol_fine.channel == VOL_FINE_MASTER) ? 0 : msgPtr->msg_set_vol_fine.channel,
+                getLe16(msgPtr->msg_set_vol_fine.volVal),
+                msgPtr->msg_set_vol_fine.muteStatus);
+            break;
+
+        case MSGTYPE_ACK:
+            linkAck(mx, msgPtr->msg_ack.seq);
+            break;
+
+        case MSGTYPE_NAK:
+            linkNak(mx, msgPtr->msg_ack.seq);
+            break;
+
+        case MSGTYPE_CAPS:
+            mx->capsTime = GetTickCount64();
+
+            //Only taken while connecting, the main thread reads the capabilities
+            //without a lock once connected. Keepalive answers are not stored.
+            if ((dataLen >= sizeof(struct msg_caps)) && !mx->capsReply)
+                {
+                if (msgPtr->msg_caps.maxData < CAPS_MIN_DATA)
+                    {
+                    //Not even a label fits, leave the port unanswered
+                    logMsg(LOG_WARN, "caps_rejected", "port=%d max_data=%d", mx->cport_nr + 1, msgPtr->msg_caps.maxData);
+                    break;
+                    }
+
+                mx->caps.protoVersion = msgPtr->msg_caps.protoVersion;
+                mx->txCobs = (msgPtr->msg_caps.protoVersion >= PROTOCOL_COBS) && !noCobs;
+                mx->caps.numChannels = msgPtr->msg_caps.numChannels;
+                mx->caps.masterWidth = msgPtr->msg_caps.masterWidth;
+                mx->caps.masterHeight = msgPtr->msg_caps.masterHeight;
+                mx->caps.channelWidth = msgPtr->msg_caps.channelWidth;
+                mx->caps.channelHeight = msgPtr->msg_caps.channelHeight;
+                memcpy(mx->caps.msgTypes, msgPtr->msg_caps.msgTypes, sizeof(mx->caps.msgTypes));
+                mx->caps.maxData = min(msgPtr->msg_caps.maxData, (uint8_t)MAX_DATA_LENGTH);
+
+                //The build ID is only null terminated if it fits
+                size_t n = min(dataLen - sizeof(struct msg_caps), sizeof(mx->caps.build) - 1);
+                memcpy(mx->caps.build, msgPtr->msg_caps.build, n);
+                mx->caps.build[n] = 0;
+
+                mx->capsReply = 1;
+                }
+            break;
+
+        case MSGTYPE_STATE_LOST:
+            //Repeated from the receivers boot until the first snapshot lands,
+            //only a reset after that needs a resync
+            if (mx->stateAcked)
+                {
+                mx->resyncRequest = 1;
+                }
+            break;
+
+        case MSGTYPE_TELEMETRY:
+            if (dataLen >= sizeof(struct msg_telemetry))
+                {
+                printTelemetry(mx, &msgPtr->msg_telemetry);
+                }
+            break;
+
+        case MSGTYPE_SET_BAUD:
+            mx->baudReply = getLe32(msgPtr->msg_set_baud.baud);
+            break;
+
+        case MSGTYPE_LINK_PROBE:
+            for (channel = 0; channel < LINK_PROBE_LENGTH; channel++)
+                {
+                if ((dataLen < sizeof(struct msg_link_probe) + LINK_PROBE_LENGTH) ||
+                    (msgPtr->msg_link_probe.pattern[channel] != probePattern(msgPtr->msg_link_probe.seq, channel)))
+                    {
+                    break;
+                    }
+                }
+
+            if (channel == LINK_PROBE_LENGTH)
+                {
+                mx->probeReply = msgPtr->msg_link_probe.seq;
+                }
+            break;
         
         default:
             break;
@@ -983,76 +4888,220 @@ void getCmds(uint8_t *pMsgBuf, uint16_t dataLen)
 
 /*
 **------------------------------------------------------------------------------
-** ctrlChecksum:
+** applyKnobs:
 **
-** Checks the received checksum
+** Applies the knob changes posted by the RX thread. Main thread only, this is
+** the one place the audio state is written from the receivers. The audio
+** state, groupList and deviceData, belongs to the main thread.
 **------------------------------------------------------------------------------
 */
-bool ctrlChecksum(uint8_t *pMsgBuf)
+void applyKnobs(void)
     {
-    uint16_t len = *(uint16_t*)pMsgBuf;
-    uint16_t check = *(uint16_t*)&pMsgBuf[len + 2];
-    uint16_t sum = 0;
-    unsigned int i;
+    vector <knobEvent_t> events;
+    vector <knobEvent_t>::iterator ev;
+    mixer_t *other;
+
+    takeKnobs(&events);
 
-    for (i = 0; i < len + 2; i++)
+    for (ev = events.begin(); ev != events.end(); ev++)
         {
-        sum ^= pMsgBuf[i];
+        if ((*ev).mx->state != MIXER_ACTIVE)
+            {
+            //Gone since, the channel layout may have changed too
+            continue;
+            }
+
+        if ((*ev).msgType == MSGTYPE_SET_MASTER_VOL_PREC)
+            {
+            setMasterVolume((*ev).volVal, (*ev).muteStatus);
+
+            //Every receiver shows the master, keep the others in step
+            for (other = mixers; other < mixers + MAX_MIXERS; other++)
+                {
+                if ((other != (*ev).mx) && (other->state == MIXER_ACTIVE))
+                    {
+                    sendMasterVol(other, (*ev).volVal, (*ev).muteStatus);
+                    }
+                }
+            }
+        else if ((*ev).channel < (*ev).mx->caps.numChannels)
+            {
+            setGroupVolume((*ev).mx->chBase + (*ev).channel, (*ev).volVal, (*ev).muteStatus);
+            }
         }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** waitKnobs:
+**
+** Sleeps for the given time, applying knob changes as soon as they come in.
+** A default device change is picked up here too, see waitEndpoints.
+**------------------------------------------------------------------------------
+*/
+void waitKnobs(int ms)
+    {
+    waitEndpoints(&wasapiBackend, ms, &deviceChanged);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** linkSleep:
+**
+** Sleeps in a handshake on the main thread. Knob changes from the receivers
+** keep being applied meanwhile, once the audio device is open. A default
+** device change waits for waitKnobs.
+**------------------------------------------------------------------------------
+*/
+void linkSleep(int ms)
+    {
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::milliseconds(ms);
 
-    if (check == sum)
+    if (!deviceData.pEndpointVolume)
         {
-        return 1;
+        Sleep(ms);
+        return;
         }
-    else
+
+    do
         {
-        return 0;
-        }
+        applyKnobs();
+        waitKnobEvents(deadline, NULL);
+        } while (chrono::steady_clock::now() < deadline);
+
+    applyKnobs();
     }
 
 /*
 **------------------------------------------------------------------------------
 ** setGroupVolume:
 **
-** Sets the referenced groups volume
+** Sets the referenced groups volume. Main thread only.
 **------------------------------------------------------------------------------
 */
-void setGroupVolume(int ch, int percent, int mute)
+void setGroupVolume(int ch, int vol, int mute)
     {
-    float fvol = percent / 100.0;
-    printf("New group %d vol: %d\n", ch, percent);
+    float fvol;
+    logMsg(LOG_DEBUG, "knob", "group=%d volume=%.1f mute=%d", ch, vol * 100.0 / VOL_FINE_MAX, mute);
 
     list <Group>::iterator i;
-    for (i = groupList.begin(); ch; i++, ch--)
+    for (i = groupList.begin(); ch && (i != groupList.end()); i++, ch--)
         {
         //do nothing
         }
 
-    (*i).g.pVolumeControl->SetMasterVolume(fvol, &(*i).g.guid);
-    (*i).g.prevVolume = fvol;
+    if (i == groupList.end())
+        {
+        //Knob for a channel that has not been enumerated yet
+        return;
+        }
 
-    (*i).g.pVolumeControl->SetMute(mute, &(*i).g.guid);
+    fvol = curveScalar((*i).g.curve, vol);
+    (*i).setVolume(fvol, mute);
+    (*i).g.prevVolume = vol;
     (*i).g.prevMute = mute;
 
+    (*i).g.knobTime = GetTickCount64();
     }
 
-
 /*
 **------------------------------------------------------------------------------
 ** setMasterVolume:
 **
-** Sets master volume
+** Sets master volume. Main thread only.
 **------------------------------------------------------------------------------
 */
-void setMasterVolume(int percent, int mute)
+void setMasterVolume(int vol, int mute)
     {
-    float fvol = percent / 100.0;
-    printf("New master vol: %d\n", percent, mute);
+    float fvol = volScalar(vol);
+    logMsg(LOG_DEBUG, "knob", "group=master volume=%.1f mute=%d", vol * 100.0 / VOL_FINE_MAX, mute);
 
     deviceData.pEndpointVolume->SetMasterVolumeLevelScalar(fvol, &deviceData.guid);
-    deviceData.prevVolume = fvol;
+    deviceData.prevVolume = vol;
 
     deviceData.pEndpointVolume->SetMute(mute, &deviceData.guid);
     deviceData.prevMute = mute;
 
+    deviceData.knobTime = GetTickCount64();
+    }
+
+/*
+**------------------------------------------------------------------------------
+** curveFor:
+**
+** Returns the volume curve of a store record, linear if there is none. The
+** built in curves are compiled once, the point curves once per distinct set
+** of points.
+**------------------------------------------------------------------------------
+*/
+const volCurve_t *curveFor(int app)
+    {
+    static volCurve_t builtin[CURVE_POINTS];
+    static int built = 0;
+    static unordered_map <string, volCurve_t> custom;
+    unordered_map <string, volCurve_t>::iterator hit;
+    storeRecord_t *rec;
+
+    if (!built)
+        {
+        built = 1;
+        for (int c = 0; c < CURVE_POINTS; c++)
+            {
+            if (!curveBuild(&builtin[c], c, NULL))
+                {
+                logMsg(LOG_ERROR, "curve_not_exact", "curve=%d", c);
+                }
+            }
+        }
+
+    rec = (app >= 0) ? &storeRecords[app] : NULL;
+    if (!rec || (rec->curve >= CURVES))
+        {
+        return &builtin[CURVE_LINEAR];
+        }
+
+    if (rec->curve != CURVE_POINTS)
+        {
+        return &builtin[rec->curve];
+        }
+
+    string key((const char *)rec->points, sizeof(rec->points));
+    hit = custom.find(key);
+    if (hit != custom.end())
+        {
+        return &hit->second;
+        }
+
+    volCurve_t *curve = &custom[key];
+    if (!curveBuild(curve, CURVE_POINTS, rec->points))
+        {
+        logMsg(LOG_WARN, "curve_not_exact", "app=\"%s\"", rec->app);
+        *curve = builtin[CURVE_LINEAR];
+        }
+    return curve;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** knobEcho:
+**
+** Checks if a volume read back is the echo of a knob change applied within
+** LINK_ECHO_WINDOW_MS. Nothing is sent back to the receiver then, the knob is
+** ahead of anything the PC could send. A change that differs from the knob
+** is not lost, it is picked up by the first poll after the window.
+**------------------------------------------------------------------------------
+*/
+int knobEcho(ULONGLONG knobTime, int prevVolume, BOOL prevMute, int volume, BOOL mute)
+    {
+    if (GetTickCount64() - knobTime >= LINK_ECHO_WINDOW_MS)
+        {
+        return false;
+        }
+
+    if ((volume != prevVolume) || (mute != prevMute))
+        {
+        echoSuppressed++;
+        }
+
+    return true;
     }
\ No newline at end of file
@@ -0,0 +1,101 @@
+/*
+**------------------------------------------------------------------------------
+** endpoints:
+**
+** Enumerates the endpoints and follows the default output device for the
+** main thread: the knobs are kept applied while it waits, and a device change
+** moves the master and the channels over to the new device.
+**------------------------------------------------------------------------------
+*/
+/*
+**------------------------------------------------------------------------------
+** Includes
+**------------------------------------------------------------------------------
+*/
+#include "pch.h"
+#include "endpoints.h"
+#include "knobs.h"
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/*
+**------------------------------------------------------------------------------
+** enumerateEndpoints:
+**
+** Gets the streams of all endpoints. With more than one the backend is asked
+** in parallel, one thread each. All are done on return.
+**------------------------------------------------------------------------------
+*/
+void enumerateEndpoints(EndpointBackend *backend, int endpoints)
+    {
+    vector <thread> workers;
+    int e;
+
+    if (endpoints == 1)
+        {
+        backend->enumerateEndpoint(0);
+        return;
+        }
+
+    for (e = 0; e < endpoints; e++)
+        {
+        workers.push_back(thread(&EndpointBackend::enumerateEndpoint, backend, e));
+        }
+    for (e = 0; e < endpoints; e++)
+        {
+        workers[e].join();
+        }
+    }
+
+/*
+**------------------------------------------------------------------------------
+** switchEndpoint:
+**
+** Moves an endpoint over to the device it is on now. The new device is opened
+** and its streams enumerated before anything is replaced. Returns 0 if there
+** is no device to switch to, the bound one stays.
+**------------------------------------------------------------------------------
+*/
+int switchEndpoint(EndpointBackend *backend, int endpoint, atomic<int> *changed)
+    {
+    *changed = 0;
+
+    if (!backend->openEndpoint(endpoint))
+        {
+        return 0;
+        }
+    backend->enumerateEndpoint(endpoint);
+    backend->bindEndpoint(endpoint);
+    return 1;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** waitEndpoints:
+**
+** Sleeps for the given time, applying knob changes as soon as they come in.
+** A default device change, changed set with wakeKnobs, is picked up here too.
+** Main thread only.
+**------------------------------------------------------------------------------
+*/
+void waitEndpoints(EndpointBackend *backend, int ms, atomic<int> *changed)
+    {
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::milliseconds(ms);
+
+    do
+        {
+        if (*changed)
+            {
+            //A knob turned before the change was meant for the old device
+            backend->applyKnobs();
+            switchEndpoint(backend, 0, changed);
+            }
+        backend->applyKnobs();
+        waitKnobEvents(deadline, changed);
+        } while (chrono::steady_clock::now() < deadline);
+
+    backend->applyKnobs();
+    }
@@ -0,0 +1,35 @@
+#ifndef _ENDPOINTS_H_
+#define _ENDPOINTS_H_
+
+#include <atomic>
+
+//What enumerating the endpoints and following the default device need from
+//the audio system. The WASAPI
+//backend is in SndVolHWMixer.cpp, test/test_endpoints.cpp has a mock.
+class EndpointBackend
+    {
+    public:
+        virtual ~EndpointBackend(void) {}
+
+        //Opens the device an endpoint is on now, 0 for the default output,
+        //next to the one bound. Returns 0 if there is none.
+        virtual int openEndpoint(int) = 0;
+
+        //Gets the streams of the opened device, or of the bound one if none
+        //was opened. Runs for several endpoints at once, see
+        //enumerateEndpoints.
+        virtual void enumerateEndpoint(int) = 0;
+
+        //Replaces the bound device with the opened one and its streams, only
+        //the differences are sent
+        virtual void bindEndpoint(int) = 0;
+
+        //Applies the knob changes waiting, to the bound devices
+        virtual void applyKnobs(void) = 0;
+    };
+
+void enumerateEndpoints(EndpointBackend *, int);
+int switchEndpoint(EndpointBackend *, int, std::atomic<int> *);
+void waitEndpoints(EndpointBackend *, int, std::atomic<int> *);
+
+#endif
@@ -0,0 +1,197 @@
+/*
+**------------------------------------------------------------------------------
+** framing:
+**
+** Decodes the byte stream of a receiver into frames, either framing, and
+** checks what a frame holds before the fields are read.
+**------------------------------------------------------------------------------
+*/
+/*
+**------------------------------------------------------------------------------
+** Includes
+**------------------------------------------------------------------------------
+*/
+#include "pch.h"
+#include "framing.h"
+
+using namespace std;
+
+/*
+**------------------------------------------------------------------------------
+** decodeReset:
+**
+** Drops whatever was being decoded, the next frame starts clean
+**------------------------------------------------------------------------------
+*/
+void decodeReset(frameDecoder_t *dec)
+    {
+    dec->state = MSGSTATE_IDLE;
+    dec->len = 0;
+    dec->cobsLeft = 0;
+    dec->cobsZero = 0;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** decodeCobs:
+**
+** Decodes one byte of a COBS frame straight into the buffer. Only the
+** delimiter is special, STX, ETX and DLE are data here.
+**------------------------------------------------------------------------------
+*/
+static int decodeCobs(frameDecoder_t *dec, uint8_t ch)
+    {
+    if (ch == COBS_DELIM)
+        {
+        if (!dec->len && !dec->cobsLeft && !dec->cobsZero)
+            {
+            //Nothing yet, this was the opening delimiter
+            return 0;
+            }
+
+        //A block cut short is a broken frame, the zero of the last block is
+        //the delimiter itself
+        dec->state = MSGSTATE_IDLE;
+        return !dec->cobsLeft;
+        }
+
+    if (dec->len >= MAX_MSG_LENGTH)
+        {
+        //Longer than any valid frame, drop it instead of waiting for the delimiter
+        dec->state = MSGSTATE_IDLE;
+        }
+    else if (!dec->cobsLeft)
+        {
+        //Block length, the zero that ended the previous block goes in first
+        if (dec->cobsZero)
+            {
+            dec->buffer[dec->len++] = 0;
+            }
+        dec->cobsLeft = ch - 1;
+        dec->cobsZero = (ch != 0xFF);
+        }
+    else
+        {
+        dec->buffer[dec->len++] = ch;
+        dec->cobsLeft--;
+        }
+    return 0;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** decodeByte:
+**
+** Runs one received byte through the decoder. Returns 1 when the buffer holds
+** a complete frame, len bytes, its length and CRC not checked yet.
+**------------------------------------------------------------------------------
+*/
+int decodeByte(frameDecoder_t *dec, uint8_t ch)
+    {
+    if (dec->state == MSGSTATE_COBS)
+        {
+        return decodeCobs(dec, ch);
+        }
+
+    switch (ch)
+        {
+        case STX:
+            //Message starting
+            dec->state = MSGSTATE_ACTIVE;
+            dec->len = 0;
+            break;
+
+        case ETX:
+            //Message ending. An ETX right after a DLE is a broken frame, wait
+            //for the next STX.
+            if (dec->state == MSGSTATE_ACTIVE)
+                {
+                dec->state = MSGSTATE_IDLE;
+                return 1;
+                }
+            dec->state = MSGSTATE_IDLE;
+            break;
+
+        case DLE:
+            //Stuff byte, only inside a frame. Two in a row is a broken frame.
+            dec->state = (dec->state == MSGSTATE_ACTIVE) ? MSGSTATE_DLE : MSGSTATE_IDLE;
+            break;
+
+        default:
+            //Copy data
+            if (dec->state == MSGSTATE_IDLE)
+                {
+                if (ch == COBS_DELIM)
+                    {
+                    //COBS frame starting
+                    decodeReset(dec);
+                    dec->state = MSGSTATE_COBS;
+                    }
+                //Else line noise between frames
+                break;
+                }
+
+            if (dec->len >= MAX_MSG_LENGTH)
+                {
+                //Longer than any valid frame, drop it instead of waiting for the ETX
+                dec->state = MSGSTATE_IDLE;
+                break;
+                }
+
+            dec->buffer[dec->len++] = (dec->state == MSGSTATE_DLE) ? (ch ^ DLE) : ch;
+            dec->state = MSGSTATE_ACTIVE;
+            break;
+        }
+    return 0;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** msgFits:
+**
+** Returns 1 if the data layer of a frame is long enough for the fields of its
+** message type. Anything shorter would be read from stale buffer contents.
+**------------------------------------------------------------------------------
+*/
+bool msgFits(const uint8_t *pMsgBuf, int dataLen)
+    {
+    return (dataLen >= (int)sizeof(msgtype_t)) && (dataLen >= msgMinLength(pMsgBuf[0]));
+    }
+
+/*
+**------------------------------------------------------------------------------
+** ctrlChecksum:
+**
+** Checks the received length and CRC
+**------------------------------------------------------------------------------
+*/
+bool ctrlChecksum(uint8_t *pMsgBuf, int msgLen)
+    {
+    uint16_t len;
+    uint16_t check;
+    uint16_t sum;
+
+    if (msgLen < 5)
+        {
+        return 0;
+        }
+
+    //Length, sequence number, data and CRC must add up to what was received
+    len = getLe16(pMsgBuf);
+    if (len + 5 != msgLen)
+        {
+        return 0;
+        }
+
+    check = getLe16(&pMsgBuf[len + 3]);
+    sum = crc16(0xFFFF, pMsgBuf, len + 3);
+
+    if (check == sum)
+        {
+        return 1;
+        }
+    else
+        {
+        return 0;
+        }
+    }
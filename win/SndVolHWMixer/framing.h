@@ -0,0 +1,20 @@
+#ifndef _FRAMING_H_
+#define _FRAMING_H_
+
+#include <stdint.h>
+#include "../../common/serialprotocol.h"
+
+typedef struct
+    {
+    msgState_t              state;
+    int                     len;                    //Bytes in buffer
+    int                     cobsLeft;               //Bytes left in the COBS block being decoded
+    int                     cobsZero;               //The COBS block being decoded ends with a zero
+    uint8_t                 buffer[MAX_RXTX_BUFFER_LENGTH];
+    }frameDecoder_t;
+
+void decodeReset(frameDecoder_t *);
+int decodeByte(frameDecoder_t *, uint8_t);
+bool msgFits(const uint8_t *, int);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+**------------------------------------------------------------------------------
+** knobs:
+**
+** Hands knob changes from the RX thread to the main thread, the only thread
+** that applies them to the audio state.
+**------------------------------------------------------------------------------
+*/
+/*
+**------------------------------------------------------------------------------
+** Includes
+**------------------------------------------------------------------------------
+*/
+#include "pch.h"
+#include "knobs.h"
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+/*
+**------------------------------------------------------------------------------
+** Globals
+**------------------------------------------------------------------------------
+*/
+atomic<uint32_t> knobFrames(0);
+
+//Knob changes waiting for the main thread, see postKnob
+static mutex knobLock;
+static condition_variable knobWake;
+static vector <knobEvent_t> knobEvents;
+
+/*
+**------------------------------------------------------------------------------
+** postKnob:
+**
+** Hands a knob change, volume 0..VOL_FINE_MAX, from the RX thread to the main
+** thread. A change still waiting for the same knob is overwritten, only the
+** latest position matters.
+**------------------------------------------------------------------------------
+*/
+void postKnob(mixer_t *mx, msgtype_t msgType, uint8_t channel, uint16_t volVal, uint8_t muteStatus)
+    {
+    knobEvent_t ev = { mx, msgType, channel, volVal, muteStatus };
+    vector <knobEvent_t>::iterator i;
+
+    knobFrames++;
+
+        {
+        lock_guard<mutex> lock(knobLock);
+
+        for (i = knobEvents.begin(); i != knobEvents.end(); i++)
+            {
+            if (((*i).mx == mx) && ((*i).msgType == msgType) && ((*i).channel == channel))
+                {
+                *i = ev;
+                break;
+                }
+            }
+
+        if (i == knobEvents.end())
+            {
+            knobEvents.push_back(ev);
+            }
+        }
+
+    knobWake.notify_one();
+    }
+
+/*
+**------------------------------------------------------------------------------
+** takeKnobs:
+**
+** Takes all knob changes posted so far, in the order the knobs were first
+** turned
+**------------------------------------------------------------------------------
+*/
+void takeKnobs(vector <knobEvent_t> *events)
+    {
+    events->clear();
+
+    lock_guard<mutex> lock(knobLock);
+    events->swap(knobEvents);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** waitKnobEvents:
+**
+** Waits until a knob change is posted, wake is set or the deadline passes.
+** wake may be NULL. Returns 1 if there is something to do.
+**------------------------------------------------------------------------------
+*/
+int waitKnobEvents(chrono::steady_clock::time_point deadline, const atomic<int> *wake)
+    {
+    unique_lock<mutex> lock(knobLock);
+
+    return knobWake.wait_until(lock, deadline, [wake] { return !knobEvents.empty() || (wake && *wake); });
+    }
+
+/*
+**------------------------------------------------------------------------------
+** wakeKnobs:
+**
+** Sets a flag waitKnobEvents is watching and wakes it, from any thread. Set
+** under the lock, so the waiter cannot miss it between its check and its wait.
+**------------------------------------------------------------------------------
+*/
+void wakeKnobs(atomic<int> *flag)
+    {
+    lock_guard<mutex> lock(knobLock);
+
+    *flag = 1;
+    knobWake.notify_one();
+    }
@@ -0,0 +1,28 @@
+#ifndef _KNOBS_H_
+#define _KNOBS_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include "../../common/serialprotocol.h"
+
+typedef struct mixer_s mixer_t;
+
+typedef struct
+    {
+    mixer_t                 *mx;                    //Receiver the knob is on
+    msgtype_t               msgType;                //MSGTYPE_SET_MASTER_VOL_PREC or MSGTYPE_SET_CHANNEL_VOL_PREC
+    uint8_t                 channel;                //Channel on that receiver
+    uint16_t                volVal;                 //0..VOL_FINE_MAX
+    uint8_t                 muteStatus;
+    }knobEvent_t;
+
+extern std::atomic<uint32_t> knobFrames;            //Volume frames received from the knobs
+
+void postKnob(mixer_t *, msgtype_t, uint8_t, uint16_t, uint8_t);
+void takeKnobs(std::vector <knobEvent_t> *);
+int waitKnobEvents(std::chrono::steady_clock::time_point, const std::atomic<int> *);
+void wakeKnobs(std::atomic<int> *);
+
+#endif
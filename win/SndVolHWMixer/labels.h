@@ -0,0 +1,18 @@
+#ifndef _LABELS_H_
+#define _LABELS_H_
+
+#include <stddef.h>
+#include <string>
+
+extern const wchar_t CP437_HIGH[128];       //Unicode code points of the CP437 glyphs 0x80-0xFF
+
+const int LABEL_CACHE_MAX = 512;            //Transliterated labels kept, the cache starts over when full
+const int FONT_ADVANCE_PX = 6;              //Receiver font, 5 px glyphs and a 1 px gap, none needed after the last
+const int MASTER_ICON_PX = 20;              //Master label room taken by the app icon
+
+const std::string &labelCp437(const wchar_t *);
+size_t labelCacheSize(void);
+size_t labelFit(int);
+void shortenLabel(char *, size_t);
+
+#endif
@@ -264,6 +264,58 @@ http://man7.org/linux/man-pages/man3/termios.3.html
 }
 
 
+int RS232_SetBaudrate(int comport_number, int baudrate)
+{
+  int baudr;
+  struct termios port_settings;
+
+  switch(baudrate)
+  {
+    case    9600 : baudr = B9600;
+                   break;
+    case   19200 : baudr = B19200;
+                   break;
+    case   38400 : baudr = B38400;
+                   break;
+    case   57600 : baudr = B57600;
+                   break;
+    case  115200 : baudr = B115200;
+                   break;
+    case  230400 : baudr = B230400;
+                   break;
+    case  460800 : baudr = B460800;
+                   break;
+    case  500000 : baudr = B500000;
+                   break;
+    case  921600 : baudr = B921600;
+                   break;
+    case 1000000 : baudr = B1000000;
+                   break;
+    default      : printf("invalid baudrate\n");
+                   return(1);
+                   break;
+  }
+
+  if(tcgetattr(Cport[comport_number], &port_settings) == -1)
+  {
+    perror("unable to read portsettings ");
+    return(1);
+  }
+
+  cfsetispeed(&port_settings, baudr);
+  cfsetospeed(&port_settings, baudr);
+
+  /* let the pending output go out at the old speed first */
+  if(tcsetattr(Cport[comport_number], TCSADRAIN, &port_settings) == -1)
+  {
+    perror("unable to adjust portsettings ");
+    return(1);
+  }
+
+  return(0);
+}
+
+
 int RS232_PollComport(int comport_number, unsigned char *buf, int size)
 {
   int n;
@@ -275,7 +327,7 @@ int RS232_PollComport(int comport_number, unsigned char *buf, int size)
     if(errno == EAGAIN)  return 0;
   }
 
-  return(n);
+  return(n);  /* -1 when the device is gone, e.g. EIO after a USB unplug */
 }
 
 
@@ -480,6 +532,17 @@ void RS232_flushRXTX(int comport_number)
 }
 
 
+int RS232_PortExists(int comport_number)
+{
+  if((comport_number>=RS232_PORTNR)||(comport_number<0))
+  {
+    return(0);
+  }
+
+  return(access(comports[comport_number], F_OK) == 0);
+}
+
+
 #else  /* windows */
 
 #define RS232_PORTNR  16
@@ -647,6 +710,30 @@ http://technet.microsoft.com/en-us/library/cc732236.aspx
 }
 
 
+int RS232_SetBaudrate(int comport_number, int baudrate)
+{
+  DCB port_settings;
+  memset(&port_settings, 0, sizeof(port_settings));  /* clear the new struct  */
+  port_settings.DCBlength = sizeof(port_settings);
+
+  if(!GetCommState(Cport[comport_number], &port_settings))
+  {
+    printf("unable to read comport cfg settings\n");
+    return(1);
+  }
+
+  port_settings.BaudRate = baudrate;
+
+  if(!SetCommState(Cport[comport_number], &port_settings))
+  {
+    printf("unable to set comport cfg settings\n");
+    return(1);
+  }
+
+  return(0);
+}
+
+
 int RS232_PollComport(int comport_number, unsigned char *buf, int size)
 {
   int n;
@@ -654,7 +741,10 @@ int RS232_PollComport(int comport_number, unsigned char *buf, int size)
 /* added the void pointer cast, otherwise gcc will complain about */
 /* "warning: dereferencing type-punned pointer will break strict aliasing rules" */
 
-  ReadFile(Cport[comport_number], buf, size, (LPDWORD)((void *)&n), NULL);
+  if(!ReadFile(Cport[comport_number], buf, size, (LPDWORD)((void *)&n), NULL))
+  {
+    return(-1);  /* the device is gone, e.g. a USB unplug */
+  }
 
   return(n);
 }
@@ -773,6 +863,20 @@ void RS232_flushRXTX(int comport_number)
 }
 
 
+int RS232_PortExists(int comport_number)
+{
+  char target[256];
+
+  if((comport_number>=RS232_PORTNR)||(comport_number<0))
+  {
+    return(0);
+  }
+
+  /* skip the \\.\ prefix, QueryDosDevice wants the bare name */
+  return(QueryDosDeviceA(comports[comport_number] + 4, target, sizeof(target)) != 0);
+}
+
+
 #endif
 
 
@@ -790,11 +894,12 @@ int RS232_GetPortnr(const char *devname)
   char str[32];
 
 #if defined(__linux__) || defined(__FreeBSD__)   /* Linux & FreeBSD */
-  strcpy_s(str, "/dev/");
+  strcpy(str, "/dev/");
+  strncat(str, devname, 16);
 #else  /* windows */
   strcpy_s(str, sizeof(str), "\\\\.\\");
+  strncat_s(str, sizeof(str), devname, 16);
 #endif
-  strncat_s(str, strlen(devname), devname, 16);
   str[31] = 0;
 
   for(i=0; i<RS232_PORTNR; i++)
@@ -809,6 +914,13 @@ int RS232_GetPortnr(const char *devname)
 }
 
 
+/* number of entries in comports */
+int RS232_GetPortCount(void)
+{
+  return RS232_PORTNR;
+}
+
+
 
 
 
@@ -61,6 +61,7 @@ extern "C" {
 #endif
 
 int RS232_OpenComport(int, int, const char *);
+int RS232_SetBaudrate(int, int);
 int RS232_PollComport(int, unsigned char *, int);
 int RS232_SendByte(int, unsigned char);
 int RS232_SendBuf(int, unsigned char *, int);
@@ -77,6 +78,8 @@ void RS232_flushRX(int);
 void RS232_flushTX(int);
 void RS232_flushRXTX(int);
 int RS232_GetPortnr(const char *);
+int RS232_GetPortCount(void);
+int RS232_PortExists(int);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,242 @@
+/*
+**------------------------------------------------------------------------------
+** volcurve:
+**
+** Volume curves, the knob steps of a receiver to session volumes and back,
+** and the plain 0..VOL_FINE_MAX conversions they fall back to
+**------------------------------------------------------------------------------
+*/
+/*
+**------------------------------------------------------------------------------
+** Includes
+**------------------------------------------------------------------------------
+*/
+#include "pch.h"
+#include "volcurve.h"
+#include <string.h>
+#include <wchar.h>
+#include <cmath>
+
+/*
+**------------------------------------------------------------------------------
+** volFine:
+**
+** Converts an audio scalar to 0..VOL_FINE_MAX. Rounded, not truncated, so that
+** volFine(volScalar(n)) == n for every step.
+**------------------------------------------------------------------------------
+*/
+uint16_t volFine(float fvol)
+    {
+    if (!(fvol > 0.0f))
+        {
+        return 0;
+        }
+
+    if (fvol >= 1.0f)
+        {
+        return VOL_FINE_MAX;
+        }
+
+    return (uint16_t)(fvol * VOL_FINE_MAX + 0.5f);
+    }
+
+/*
+**------------------------------------------------------------------------------
+** volScalar:
+**
+** Converts 0..VOL_FINE_MAX to an audio scalar
+**------------------------------------------------------------------------------
+*/
+float volScalar(int vol)
+    {
+    return vol / (float)VOL_FINE_MAX;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** curveBuild:
+**
+** Compiles a curve into its tables and checks that every knob step reads back
+** as itself. Returns 0 if one does not, two steps too close for a float.
+**------------------------------------------------------------------------------
+*/
+int curveBuild(volCurve_t *curve, int type, const uint8_t (*points)[2])
+    {
+    int n;
+    int b;
+
+    for (n = 0; n <= VOL_FINE_MAX; n++)
+        {
+        double x = n / (double)VOL_FINE_MAX;
+        double y = x;
+
+        if (type == CURVE_DB)
+            {
+            y = n ? pow(10.0, (x - 1.0) * CURVE_DB_RANGE / 20.0) : 0.0;
+            }
+        else if (type == CURVE_POINTS)
+            {
+            int k0 = 0;
+            int v0 = 0;
+
+            //The segment x is on, points end with zeros
+            for (int p = 0; (p < CURVE_MAX_POINTS) && (points[p][0] > k0); p++)
+                {
+                if (x * 100.0 <= points[p][0])
+                    {
+                    y = (v0 + (x * 100.0 - k0) * (points[p][1] - v0) / (points[p][0] - k0)) / 100.0;
+                    break;
+                    }
+                k0 = points[p][0];
+                v0 = points[p][1];
+                y = v0 / 100.0;
+                }
+            }
+
+        curve->scalar[n] = (float)y;
+        }
+
+    for (n = 0; n < VOL_FINE_MAX; n++)
+        {
+        curve->bound[n] = (curve->scalar[n] + curve->scalar[n + 1]) / 2.0f;
+        }
+
+    for (b = 0, n = 0; b <= CURVE_BUCKETS; b++)
+        {
+        while ((n < VOL_FINE_MAX) && (curve->bound[n] <= b / (float)CURVE_BUCKETS))
+            {
+            n++;
+            }
+        curve->bucket[b] = n;
+        }
+
+    for (n = 0; n <= VOL_FINE_MAX; n++)
+        {
+        if (curveFine(curve, curve->scalar[n]) != n)
+            {
+            return 0;
+            }
+        }
+
+    return 1;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** curveParse:
+**
+** Reads curve points, <knob>:<volume>,... in percent. 0:0 is implied, and
+** 100:100 unless the last point is at 100 already. Both have to rise so that
+** every knob step has a volume of its own.
+** Returns 1 if the points are good.
+**------------------------------------------------------------------------------
+*/
+int curveParse(uint8_t (*points)[2], const wchar_t *text)
+    {
+    uint8_t parsed[CURVE_MAX_POINTS][2] = { { 0 } };
+    const wchar_t *p = text;
+    wchar_t *end;
+    long k0 = 0;
+    long v0 = 0;
+    int n = 0;
+
+    while (*p)
+        {
+        long k = wcstol(p, &end, 10);
+        if ((end == p) || (*end != L':'))
+            {
+            return 0;
+            }
+        p = end + 1;
+
+        long v = wcstol(p, &end, 10);
+        if ((end == p) || (*end && (*end != L',')))
+            {
+            return 0;
+            }
+        p = *end ? end + 1 : end;
+
+        if ((n >= CURVE_MAX_POINTS) || (k <= k0) || (k > 100) || (v <= v0) || (v > 100))
+            {
+            return 0;
+            }
+        parsed[n][0] = (uint8_t)k;
+        parsed[n][1] = (uint8_t)v;
+        k0 = k;
+        v0 = v;
+        n++;
+        }
+
+    if (k0 < 100)
+        {
+        if ((n >= CURVE_MAX_POINTS) || (v0 >= 100))
+            {
+            return 0;
+            }
+        parsed[n][0] = 100;
+        parsed[n][1] = 100;
+        }
+
+    memcpy(points, parsed, sizeof(parsed));
+    return 1;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** curveFine:
+**
+** Converts an audio scalar to the knob step of a curve, the nearest one. The
+** bucket gives the range of steps to search.
+**------------------------------------------------------------------------------
+*/
+uint16_t curveFine(const volCurve_t *curve, float fvol)
+    {
+    int b;
+    int lo;
+    int hi;
+
+    if (!curve)
+        {
+        return volFine(fvol);
+        }
+
+    if (!(fvol > 0.0f))
+        {
+        return 0;
+        }
+
+    b = (fvol >= 1.0f) ? CURVE_BUCKETS : (int)(fvol * CURVE_BUCKETS);
+    lo = curve->bucket[b];
+    hi = (b < CURVE_BUCKETS) ? curve->bucket[b + 1] : VOL_FINE_MAX;
+    while (lo < hi)
+        {
+        int mid = (lo + hi) / 2;
+        if (curve->bound[mid] <= fvol)
+            {
+            lo = mid + 1;
+            }
+        else
+            {
+            hi = mid;
+            }
+        }
+
+    return lo;
+    }
+
+/*
+**------------------------------------------------------------------------------
+** curveScalar:
+**
+** Converts a knob step, 0..VOL_FINE_MAX, to an audio scalar on a curve
+**------------------------------------------------------------------------------
+*/
+float curveScalar(const volCurve_t *curve, int vol)
+    {
+    if (!curve)
+        {
+        return volScalar(vol);
+        }
+
+    return curve->scalar[(vol < 0) ? 0 : ((vol > VOL_FINE_MAX) ? VOL_FINE_MAX : vol)];
+    }
@@ -0,0 +1,36 @@
+#ifndef _VOLCURVE_H_
+#define _VOLCURVE_H_
+
+#include <stdint.h>
+#include "../../common/serialprotocol.h"
+
+//Volume curves, knob to session volume, see --pref. Each is compiled into
+//tables both ways so that a volume read back gives the knob step it was set
+//from, the step boundaries are half way between the volumes of two steps.
+typedef enum
+    {
+    CURVE_LINEAR = 0,
+    CURVE_DB,                                       //Even dB steps from -CURVE_DB_RANGE to 0, the first step is silence
+    CURVE_POINTS,                                   //Straight lines between knob and volume percent points
+    CURVES
+    }curveType_t;
+
+const double CURVE_DB_RANGE = 60.0;
+const int CURVE_MAX_POINTS = 8;
+const int CURVE_BUCKETS = 1024;                     //Reverse lookup buckets over 0..1
+
+typedef struct
+    {
+    float                   scalar[VOL_FINE_MAX + 1]; //Knob step to audio scalar
+    float                   bound[VOL_FINE_MAX];    //Half way between the scalars of step n and n + 1
+    uint16_t                bucket[CURVE_BUCKETS + 1]; //First step with a bound above n / CURVE_BUCKETS
+    }volCurve_t;
+
+uint16_t volFine(float);
+float volScalar(int);
+int curveBuild(volCurve_t *, int, const uint8_t (*)[2]);
+int curveParse(uint8_t (*)[2], const wchar_t *);
+uint16_t curveFine(const volCurve_t *, float);
+float curveScalar(const volCurve_t *, int);
+
+#endif